@@ -135,3 +135,48 @@ MDL *usbip::tail(_In_opt_ MDL *mdl)
         for ( ; mdl && mdl->Next; mdl = mdl->Next);
         return mdl;
 }
+
+/*
+ * @param offset in the chain, on return is relative to the returned MDL
+ * @return MDL that contains the byte at the offset or nullptr
+ */
+MDL *usbip::seek(_In_opt_ MDL *mdl, _Inout_ size_t &offset)
+{
+        for ( ; mdl; mdl = mdl->Next) {
+                if (auto len = MmGetMdlByteCount(mdl); offset < len) {
+                        break;
+                } else {
+                        offset -= len;
+                }
+        }
+
+        return mdl;
+}
+
+/*
+ * Copy to a chain of MDLs starting from the given offset.
+ */
+NTSTATUS usbip::copy(_In_ MDL *dst, _In_ size_t offset, _In_reads_bytes_(len) const void *src, _In_ size_t len)
+{
+        auto from = static_cast<const char*>(src);
+
+        for (auto mdl = seek(dst, offset); len; mdl = mdl->Next, offset = 0) {
+
+                if (!mdl) {
+                        return STATUS_BUFFER_OVERFLOW;
+                }
+
+                auto to = static_cast<char*>(MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute));
+                if (!to) {
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                auto cnt = min(MmGetMdlByteCount(mdl) - offset, len);
+                RtlCopyMemory(to + offset, from, cnt);
+
+                from += cnt;
+                len -= cnt;
+        }
+
+        return STATUS_SUCCESS;
+}
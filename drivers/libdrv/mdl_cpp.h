@@ -14,9 +14,13 @@ enum class memory { nonpaged, paged, stack = paged };
 MDL *tail(_In_opt_ MDL *mdl);
 size_t size(_In_opt_ const MDL *mdl);
 
+MDL *seek(_In_opt_ MDL *mdl, _Inout_ size_t &offset);
+NTSTATUS copy(_In_ MDL *dst, _In_ size_t offset, _In_reads_bytes_(len) const void *src, _In_ size_t len);
+
 class Mdl
 {
 public:
+        Mdl() = default;
         Mdl(_In_opt_ __drv_aliasesMem void *VirtualAddress, _In_ ULONG Length);
         Mdl(_In_ MDL *SourceMdl, _In_ ULONG Offset, _In_ ULONG Length);
 
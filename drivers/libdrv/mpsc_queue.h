@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <wdm.h>
+
+namespace libdrv
+{
+
+/*
+ * Intrusive lock-free multi-producer/single-consumer queue.
+ *
+ * Any number of producers can push concurrently. The producer that made the queue non-empty
+ * becomes its consumer and must call drain, other producers return immediately.
+ * Thus there is at most one consumer at a time and items are consumed in FIFO order,
+ * the order of pushes on the same thread is preserved.
+ *
+ * The consumer can push items while draining (for example, from a completion routine
+ * that is called synchronously), they will be consumed in the same drain call.
+ * Items taken at once can be processed as a batch, @see drain.
+ *
+ * T must have SLIST_ENTRY member, its address must be aligned on MEMORY_ALLOCATION_ALIGNMENT.
+ */
+template<typename T, SLIST_ENTRY T::*Entry>
+class mpsc_queue
+{
+public:
+        _IRQL_requires_max_(DISPATCH_LEVEL)
+        void init()
+        {
+                InitializeSListHead(&m_head);
+                m_pending = 0;
+        }
+
+        /*
+         * The counter is incremented before the push, thus the consumer never takes an item it was not told about
+         * and m_pending can't become negative. Otherwise a producer that is late with the increment could see 1
+         * and start the second concurrent drain.
+         *
+         * IRQL must be raised to DISPATCH_LEVEL to prevent preemption between increment and push,
+         * otherwise the consumer can spin in drain for a long time.
+         * @return true if the caller has become the consumer and must call drain
+         */
+        _IRQL_requires_(DISPATCH_LEVEL)
+        bool push(_Inout_ T &item)
+        {
+                auto consumer = InterlockedIncrement(&m_pending) == 1;
+                InterlockedPushEntrySList(&m_head, &(item.*Entry));
+                return consumer;
+        }
+
+        /*
+         * @param f is called for each item, the item can be freed by f
+         * @param flushed is called after each run of items that were taken at once
+         */
+        template<typename F, typename G>
+        _IRQL_requires_(DISPATCH_LEVEL)
+        void drain(_In_ F &&f, _In_ G &&flushed)
+        {
+                for (LONG cnt; ; ) {
+                        cnt = 0;
+
+                        for (auto e = flush(); e; ++cnt) {
+                                auto next = e->Next; // f can free the item
+                                f(*container(e));
+                                e = next;
+                        }
+
+                        if (cnt) {
+                                flushed();
+                        }
+
+                        if (!InterlockedAdd(&m_pending, -cnt)) {
+                                break; // each push has been consumed
+                        } else if (!cnt) {
+                                YieldProcessor(); // a producer is between increment and push
+                        }
+                }
+        }
+
+        auto empty() const { return !ReadNoFence(&m_pending); }
+
+private:
+        SLIST_HEADER m_head;
+        volatile LONG m_pending; // number of pushed minus number of consumed items
+
+        static auto container(_In_ SLIST_ENTRY *e)
+        {
+                auto offset = reinterpret_cast<ULONG_PTR>(&(static_cast<T*>(nullptr)->*Entry));
+                return reinterpret_cast<T*>(reinterpret_cast<char*>(e) - offset);
+        }
+
+        /*
+         * @return items in FIFO order
+         */
+        auto flush()
+        {
+                SLIST_ENTRY *head{};
+
+                for (auto e = InterlockedFlushSList(&m_head); e; ) { // LIFO
+                        auto next = e->Next;
+                        e->Next = head;
+                        head = e;
+                        e = next;
+                }
+
+                return head;
+        }
+};
+
+} // namespace libdrv
@@ -381,6 +381,16 @@ NTSTATUS wsk::receive(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags,
         return sock->invoke(nullptr /*&sock->recv_cnt*/, sock->Connection->WskReceive, sock->Self, buffer, flags, irp);
 }
 
+/*
+ * Release data indications that were retained by WskReceiveEvent callback.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS wsk::release(_In_ SOCKET *sock, _In_ WSK_DATA_INDICATION *DataIndication)
+{
+        NT_ASSERT(sock);
+        return sock->invoke(nullptr, sock->Connection->WskRelease, sock->Self, DataIndication);
+}
+
 _IRQL_requires_max_(APC_LEVEL)
 PAGED NTSTATUS wsk::send(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags)
 {
@@ -443,6 +453,25 @@ PAGED NTSTATUS wsk::getaddrinfo(
                                                 irp);
 }
 
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS wsk::getaddrinfo(
+        _Out_ ADDRINFOEXW* &Result,
+        _In_opt_ UNICODE_STRING *NodeName,
+        _In_opt_ UNICODE_STRING *ServiceName,
+        _In_opt_ ADDRINFOEXW *Hints)
+{
+        PAGED_CODE();
+        Result = nullptr;
+
+        irp_cls irp;
+        if (!irp) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        auto st = getaddrinfo(Result, NodeName, ServiceName, Hints, irp.get());
+        return irp.wait_for_completion(st);
+}
+
 _IRQL_requires_max_(APC_LEVEL)
 PAGED void wsk::free(_In_opt_ ADDRINFOEXW *AddrInfo)
 {
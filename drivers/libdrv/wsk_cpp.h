@@ -79,6 +79,9 @@ NTSTATUS send(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags, _In_ IR
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS receive(_In_ SOCKET *sock, _In_ WSK_BUF *buffer, _In_ ULONG flags, _In_ IRP *irp);
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS release(_In_ SOCKET *sock, _In_ WSK_DATA_INDICATION *DataIndication);
+
 _IRQL_requires_max_(APC_LEVEL)
 PAGED NTSTATUS disconnect(_In_ SOCKET *sock, _In_opt_ WSK_BUF *buffer = nullptr, _In_ ULONG flags = 0);
 
@@ -110,6 +113,13 @@ PAGED NTSTATUS getaddrinfo(
         _In_opt_ ADDRINFOEXW *Hints,
         _Inout_ IRP *irp);
 
+_IRQL_requires_max_(APC_LEVEL)
+PAGED NTSTATUS getaddrinfo(
+        _Out_ ADDRINFOEXW* &Result,
+        _In_opt_ UNICODE_STRING *NodeName,
+        _In_opt_ UNICODE_STRING *ServiceName,
+        _In_opt_ ADDRINFOEXW *Hints);
+
 _IRQL_requires_max_(APC_LEVEL)
 PAGED void free(_In_opt_ ADDRINFOEXW *AddrInfo);
 
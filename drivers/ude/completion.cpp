@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "completion.h"
+#include "trace.h"
+#include "completion.tmh"
+
+#include "context.h"
+#include "wsk_receive.h"
+#include "jitter_buffer.h"
+
+namespace
+{
+
+using namespace usbip;
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete_now(_Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ NTSTATUS status)
+{
+        auto start = KeQueryPerformanceCounter(nullptr).QuadPart;
+
+        if (auto jb = get_endpoint_ctx(get_request_ctx(request)->endpoint)->jitter; !jb) {
+                usbip::complete(request, status);
+        } else if (NT_SUCCESS(status)) {
+                hold(*jb, request, status);
+        } else {
+                flush(*jb); // preserve the order of completion
+                usbip::complete(request, status);
+        }
+
+        auto ticks = KeQueryPerformanceCounter(nullptr).QuadPart - start;
+        dev.complete_ticks += ticks; // by the receive stage or by the owner of completions, @see take
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void append(_Inout_ completion_list &lst, _In_ const completion_list &other)
+{
+        if (!other.head) {
+                return;
+        } else if (lst.head) {
+                lst.tail->complete_next = other.head;
+        } else {
+                lst.head = other.head;
+        }
+
+        lst.tail = other.tail;
+        lst.cnt += other.cnt;
+}
+
+/*
+ * @return false if the list is empty or another instance of complete_dpc owns it
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+auto take(_Inout_ device_ctx &dev, _Out_ completion_list &lst, _Inout_ bool &owner)
+{
+        KLOCK_QUEUE_HANDLE lck;
+        KeAcquireInStackQueuedSpinLockAtDpcLevel(&dev.completion_lock, &lck);
+
+        if (!owner && dev.completing) {
+                lst = {};
+        } else {
+                lst = dev.completions;
+                dev.completions = {};
+
+                owner = lst.head;
+                dev.completing = owner;
+        }
+
+        KeReleaseInStackQueuedSpinLockFromDpcLevel(&lck);
+        return owner;
+}
+
+/*
+ * Requests are completed in the order they were received.
+ * The DPC can run on several CPUs at once, the instance that owns the list completes
+ * requests until it is empty, others return immediately.
+ */
+_Function_class_(KDEFERRED_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void complete_dpc(
+        _In_ KDPC*, _In_opt_ void *DeferredContext, _In_opt_ void* /*SystemArgument1*/, _In_opt_ void* /*SystemArgument2*/)
+{
+        auto &dev = *static_cast<device_ctx*>(DeferredContext);
+        completion_list lst;
+
+        for (bool owner = false; take(dev, lst, owner); ) {
+                for (auto req = lst.head; req; ) {
+                        auto next = req->complete_next; // req is invalid after completion
+                        complete_now(dev, get_handle(req), req->complete_status);
+                        req = next;
+                }
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::init_completion(_Inout_ device_ctx &dev)
+{
+        KeInitializeSpinLock(&dev.completion_lock);
+        KeInitializeDpc(&dev.completion_dpc, complete_dpc, &dev);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::complete(_Inout_ device_ctx &dev, _Inout_ completion_list &lst, _In_ WDFREQUEST request, _In_ NTSTATUS status)
+{
+        if (!dev.deferred_completion) {
+                complete_now(dev, request, status);
+                return;
+        }
+
+        auto req = get_request_ctx(request);
+        req->complete_next = nullptr;
+        req->complete_status = status;
+
+        append(lst, { .head = req, .tail = req, .cnt = 1 });
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::submit(_Inout_ device_ctx &dev, _Inout_ completion_list &lst)
+{
+        if (!lst.head) {
+                return;
+        }
+
+        ++dev.completion_batches; // the receive stage is single-threaded
+        dev.deferred_requests += lst.cnt;
+
+        {
+                KLOCK_QUEUE_HANDLE lck;
+                KeAcquireInStackQueuedSpinLock(&dev.completion_lock, &lck);
+
+                append(dev.completions, lst);
+
+                KeReleaseInStackQueuedSpinLock(&lck);
+        }
+
+        lst = {};
+        KeInsertQueueDpc(&dev.completion_dpc, nullptr, nullptr); // false if it is already queued
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::flush_completion(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        if (dev.deferred_completion) {
+                KeFlushQueuedDpcs();
+                NT_ASSERT(!dev.completions.head);
+        }
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv/codeseg.h>
+#include <libdrv/wdf_cpp.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+struct request_ctx;
+
+/*
+ * If enabled, the receive stage only parses PDUs and fills URBs, completion of requests 
+ * (with completion routines of upper drivers) is done by DPC. Thus the socket is drained
+ * while requests are being completed. It is read from the registry on device creation.
+ * @see get_parameter
+ */
+inline constexpr auto deferred_completion_value_name = L"DeferredCompletion";
+
+/*
+ * Requests that are waiting for completion, linked through request_ctx::complete_next.
+ */
+struct completion_list
+{
+        request_ctx *head;
+        request_ctx *tail;
+        ULONG cnt;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init_completion(_Inout_ device_ctx &dev);
+
+/*
+ * Completes the request now or appends it to the list if completion is deferred.
+ * The time of completion is accounted in device_ctx::complete_ticks.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete(_Inout_ device_ctx &dev, _Inout_ completion_list &lst, _In_ WDFREQUEST request, _In_ NTSTATUS status);
+
+/*
+ * Passes the requests to the completion stage, the list becomes empty.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void submit(_Inout_ device_ctx &dev, _Inout_ completion_list &lst);
+
+/*
+ * Waits until all submitted requests are completed.
+ * Must be called after the receive stage has stopped.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void flush_completion(_Inout_ device_ctx &dev);
+
+} // namespace usbip
@@ -7,8 +7,12 @@
 #include <libdrv\codeseg.h>
 #include <libdrv\ch9.h>
 #include <libdrv\wdf_cpp.h>
+#include <libdrv\mpsc_queue.h>
 
 #include <usbip\proto.h>
+#include <usbip\frame_clock.h>
+#include <usbip\usb_state.h>
+#include <usbip\reconnect.h>
 
 #include <wdfusb.h>
 #include <UdeCx.h>
@@ -16,6 +20,10 @@
 #include <initguid.h>
 #include <usbip\vhci.h>
 
+#include "wsk_context.h"
+#include "completion.h"
+#include "descriptor_cache.h"
+
 /*
  * Macro WDF_TYPE_NAME_TO_TYPE_INFO (see WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE)
  * makes impossible to declare context type with the same name in different namespaces.
@@ -67,6 +75,9 @@ inline auto get_handle(_In_ vhci_ctx *ctx)
 
 struct wsk_context;
 struct device_ctx;
+struct endpoint_ctx;
+struct event_receiver;
+struct jitter_buffer;
 
 /*
  * Context extention for device_ctx. 
@@ -95,6 +106,30 @@ struct device_ctx_ext
         vhci::imported_device_properties dev; // for ioctl::get_imported_devices
 };
 
+/*
+ * How long a spin lock was held, in KeQueryPerformanceCounter ticks.
+ * hold_ticks/acquisitions is the average hold time.
+ * It is updated under the lock it describes, thus each lock has its own.
+ */
+struct lock_stat
+{
+        LONG64 acquisitions;
+        LONG64 hold_ticks;
+        LONG64 max_hold_ticks;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline void add(_Inout_ lock_stat &total, _In_ const lock_stat &st)
+{
+        total.acquisitions += st.acquisitions;
+        total.hold_ticks += st.hold_ticks;
+
+        if (st.max_hold_ticks > total.max_hold_ticks) {
+                total.max_hold_ticks = st.max_hold_ticks;
+        }
+}
+
 /*
  * Context space for UDECXUSBDEVICE - emulated USB device.
  */
@@ -109,9 +144,17 @@ struct device_ctx
         WDFDEVICE vhci; // parent, virtual (emulated) host controller interface
 
         UDECXUSBENDPOINT ep0; // default control pipe
-        WDFSPINLOCK endpoint_list_lock; // for endpoint_ctx::entry
+        WDFSPINLOCK endpoint_list_lock; // for endpoint_ctx::entry, updates of endpoints and pipe_handles
 
-        WDFSPINLOCK send_lock; // for WskSend on sock()
+        enum { ENDPOINT_SLOTS = 32, PIPE_HANDLE_BUCKETS = 16 }; // @see endpoint_list.cpp
+        endpoint_ctx *endpoints[ENDPOINT_SLOTS]; // by bEndpointAddress, the most recently inserted one
+        endpoint_ctx *pipe_handles[PIPE_HANDLE_BUCKETS]; // cache for search by PipeHandle
+
+        libdrv::mpsc_queue<wsk_context, &wsk_context::send_entry> send_queue; // for WskSend on sock()
+
+        frame_clock clock; // of the server, KeQueryPerformanceCounter is the local time, @see clock_now
+
+        ULONG inline_max; // OUT payload is copied to wsk_context::inline_buf if not greater, @see inline_max_value_name
 
         int port; // vhci_ctx.devices[port - 1]
         seqnum_t seqnum; // @see next_seqnum
@@ -121,14 +164,73 @@ struct device_ctx
 
         WDFWAITLOCK delete_lock; // serialize UdecxUsbDevicePlugOutAndDelete and UDECX_USB_DEVICE_STATE_CHANGE_CALLBACKS
 
-        LIST_ENTRY requests; // list head, requests that are waiting for USBIP_RET_SUBMIT from a server
-        WDFSPINLOCK requests_lock;
+        enum { REQUESTS_BUCKETS = 512, REQUESTS_LOCKS = 16 }; // must be a power of two, @see request_list.cpp
+        LIST_ENTRY requests[REQUESTS_BUCKETS]; // hash table by seqnum, requests that are waiting for USBIP_RET_SUBMIT
+        WDFSPINLOCK requests_locks[REQUESTS_LOCKS]; // requests[i] is protected by requests_locks[i % REQUESTS_LOCKS]
+        LONG requests_cnt; // total number of requests in the buckets
 
         // statistics
         UINT64 sent_requests; // were sent successfully
-        UINT64 cancelable_requests; // marked as
-
-        _KTHREAD *recv_thread;
+        LONG64 cancelable_requests; // marked as
+        UINT64 wsk_sends; // WskSend calls
+        UINT64 batched_pdus; // were passed to WskSend, batched_pdus/wsk_sends is the average batch size
+        UINT64 urgent_pdus; // were sent ahead of non-urgent PDUs that were queued earlier
+        UINT64 start_frames; // StartFrame of isoch transfers was passed to the server
+        UINT64 start_frames_asap; // StartFrame was replaced by USBD_START_ISO_TRANSFER_ASAP
+        lock_stat requests_locks_stat[REQUESTS_LOCKS]; // requests_locks_stat[i] is updated under requests_locks[i]
+        lock_stat endpoint_locks_stat; // endpoint_ctx::requests_lock_stat of deleted endpoints, under endpoint_list_lock
+        LONG64 recv_ticks; // parsing of PDUs and filling of URBs, includes complete_ticks if completion is not deferred
+        LONG64 complete_ticks; // completion of received requests, KeQueryPerformanceCounter
+        UINT64 completion_batches; // were passed to completion_dpc
+        UINT64 deferred_requests; // deferred_requests/completion_batches is the average batch size
+
+        _KTHREAD *recv_thread; // recv_mode::thread
+        bool recv_events; // recv_mode::events, @see recv_events_start
+        event_receiver *events; // must be free-d
+
+        bool deferred_completion; // @see deferred_completion_value_name
+        KDPC completion_dpc; // completes requests from completions
+        KSPIN_LOCK completion_lock;
+        completion_list completions; // protected by completion_lock
+        bool completing; // complete_dpc owns completions, protected by completion_lock
+
+        ULONG jitter_frames; // @see jitter_frames_value_name
+
+        descriptor_cache descriptors;
+        LONG64 plugin_time; // KeQueryPerformanceCounter before UdecxUsbDevicePlugIn
+        LONG64 enum_ticks; // from plugin_time till the first SET_CONFIGURATION with non-zero value
+
+        KSPIN_LOCK std_state_lock;
+        usb_state std_state; // @see answer_locally
+
+        LONG64 saved_round_trips; // requests were answered by the driver, @see traffic_saved
+        LONG64 saved_bytes; // of CMD_SUBMIT and RET_SUBMIT that were not sent and received for them
+
+        // @see device::suspend
+        volatile bool suspended; // the link is in a low power state
+        volatile bool park_polling; // interrupt IN requests are not sent to the server while suspended
+        volatile bool wake_signaled; // UdecxUsbDeviceSignalWake was called while suspended
+        ULONG function_wake; // bitmask of interfaces that are armed for function remote wake, SuperSpeed only
+        KSPIN_LOCK parked_lock;
+        LIST_ENTRY parked; // head for request_ctx::entry, protected by parked_lock
+
+        LONG64 suspend_start; // KeQueryPerformanceCounter
+        LONG64 suspended_ticks; // in total
+        UINT64 suspends;
+        UINT64 parked_requests; // were withdrawn from the server or not sent to it while suspended or reconnecting
+        UINT64 wakes; // UdecxUsbDeviceSignalWake calls
+
+        // @see device::reconnect
+        reconnector reconnect; // KeQueryInterruptTime is the local time, recv_mode::thread only
+        bool retry_requests; // @see reconnect_retry_value_name
+        volatile bool reconnecting; // new requests are parked until the session is restored
+        KEVENT reconnect_abort; // is set by detach to interrupt a delay between attempts
+        WDFWAITLOCK reconnect_lock; // for attempt_sock
+        wsk::SOCKET *attempt_sock; // of the attempt in progress, is closed by detach
+        wsk::SOCKET *retired_sock; // closed socket of the lost session, must be free-d
+
+        UINT64 retried_requests; // were sent again over the new connection
+        UINT64 failed_requests; // were completed because the connection was lost
 };        
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(device_ctx, get_device_ctx)
 
@@ -138,6 +240,24 @@ inline auto get_handle(_In_ device_ctx *ctx)
         return static_cast<UDECXUSBDEVICE>(WdfObjectContextGetObject(ctx));
 }
 
+/*
+ * @return local time for device_ctx::clock
+ */
+inline auto clock_now()
+{
+        return KeQueryPerformanceCounter(nullptr).QuadPart;
+}
+
+/*
+ * A control transfer was answered from the descriptor cache or the tracked standard state.
+ * @param len of the data stage
+ */
+inline void traffic_saved(_Inout_ device_ctx &dev, _In_ ULONG len)
+{
+        InterlockedIncrement64(&dev.saved_round_trips);
+        InterlockedAdd64(&dev.saved_bytes, LONG64(2*sizeof(header) + len));
+}
+
 /*
  * Context space for UDECXUSBENDPOINT.
  */
@@ -153,8 +273,21 @@ struct endpoint_ctx
         // UCHAR interface_number; // interface to which it belongs
         // UCHAR alternate_setting;
 
-        USBD_PIPE_HANDLE PipeHandle;
+        USBD_PIPE_HANDLE PipeHandle; // @see set_pipe_handle
         LIST_ENTRY entry; // list head if default control pipe, protected by device_ctx::endpoint_list_lock
+
+        LIST_ENTRY requests; // list head for request_ctx::endpoint_entry
+        WDFSPINLOCK requests_lock; // for requests, is acquired after device_ctx::requests_locks
+        lock_stat requests_lock_stat; // is updated under requests_lock
+
+        jitter_buffer *jitter; // isoch IN only, @see device_ctx::jitter_frames
+
+        // statistics, UDE does not call EvtUsbEndpointPurge concurrently for the same endpoint
+        LONG64 purge_start; // KeQueryPerformanceCounter
+        LONG64 purge_ticks; // from EvtUsbEndpointPurge till UdecxUsbEndpointPurgeComplete, in total
+        LONG64 purge_max_ticks;
+        UINT64 purges;
+        UINT64 purged_requests; // were unlinked and cancelled
 };        
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(endpoint_ctx, get_endpoint_ctx)
 
@@ -170,10 +303,14 @@ inline auto& get_endpoint(_In_ WDFQUEUE queue)
  */
 struct request_ctx
 {
-        LIST_ENTRY entry; // head is device_ctx::requests
+        LIST_ENTRY entry; // head is device_ctx::requests[bucket(seqnum)] or device_ctx::parked
+        LIST_ENTRY endpoint_entry; // head is endpoint_ctx::requests
         UDECXUSBENDPOINT endpoint;
         seqnum_t seqnum;
         bool cancelable;
+
+        request_ctx *complete_next; // @see completion_list
+        NTSTATUS complete_status;
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(request_ctx, get_request_ctx)
 
@@ -222,10 +359,6 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 seqnum_t next_seqnum(_Inout_ device_ctx &dev, _In_ bool dir_in);
 
-constexpr auto extract_num(seqnum_t seqnum) { return seqnum >> 1; }
-constexpr auto extract_dir(seqnum_t seqnum) { return usbip::direction(seqnum & 1); }
-constexpr bool is_valid_seqnum(seqnum_t seqnum) { return extract_num(seqnum); }
-
 constexpr UINT32 make_devid(UINT16 busnum, UINT16 devnum)
 {
         return (busnum << 16) | devnum;
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "descriptor_cache.h"
+#include "trace.h"
+#include "descriptor_cache.tmh"
+
+#include "driver.h"
+
+namespace
+{
+
+using namespace usbip;
+
+constexpr auto is_match(
+        _In_ const descriptor_cache_entry &e, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        return e.data && e.wValue == pkt.wValue.W && e.wIndex == pkt.wIndex.W && e.wLength == pkt.wLength;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto find(_In_ descriptor_cache &c, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        for (auto &e: c.entries) {
+                if (is_match(e, pkt)) {
+                        return &e;
+                }
+        }
+
+        return static_cast<descriptor_cache_entry*>(nullptr);
+}
+
+/*
+ * A descriptor that has wTotalLength, such as configuration and BOS ones.
+ */
+template<typename T>
+constexpr auto is_valid_total(_In_ const void *data, _In_ ULONG length, _In_ USHORT wLength)
+{
+        if (length < offsetof(T, wTotalLength) + sizeof(USHORT)) {
+                return length == wLength; // too short to read wTotalLength, but the whole request was satisfied
+        }
+
+        auto &d = *static_cast<const T*>(data);
+        return d.bLength == sizeof(d) && d.wTotalLength >= sizeof(d) && length == min(ULONG(wLength), ULONG(d.wTotalLength));
+}
+
+/*
+ * The server can return a short descriptor because of an error or a device that does not follow the spec,
+ * such responses are not cached.
+ */
+constexpr auto is_valid(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, _In_ const void *data, _In_ ULONG length)
+{
+        if (length < sizeof(USB_COMMON_DESCRIPTOR) || length > pkt.wLength) {
+                return false;
+        }
+
+        auto &d = *static_cast<const USB_COMMON_DESCRIPTOR*>(data);
+        if (d.bDescriptorType != pkt.wValue.HiByte || d.bLength < sizeof(d)) {
+                return false;
+        }
+
+        switch (d.bDescriptorType) {
+        case USB_DEVICE_DESCRIPTOR_TYPE:
+                return d.bLength == sizeof(USB_DEVICE_DESCRIPTOR) && length == min(ULONG(pkt.wLength), ULONG(d.bLength));
+        case USB_STRING_DESCRIPTOR_TYPE:
+                return length == min(ULONG(pkt.wLength), ULONG(d.bLength));
+        case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+                return is_valid_total<USB_CONFIGURATION_DESCRIPTOR>(data, length, pkt.wLength);
+        case USB_BOS_DESCRIPTOR_TYPE:
+                return is_valid_total<USB_BOS_DESCRIPTOR>(data, length, pkt.wLength);
+        }
+
+        return false;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::init(_Out_ descriptor_cache &c, _In_ bool enabled)
+{
+        RtlZeroMemory(&c, sizeof(c));
+        KeInitializeSpinLock(&c.lock);
+        c.enabled = enabled;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::free(_Inout_ descriptor_cache &c)
+{
+        for (auto &e: c.entries) {
+                if (auto data = e.data) {
+                        ExFreePoolWithTag(data, pooltag);
+                }
+                e = {};
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::is_cacheable(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        auto &t = pkt.bmRequestType;
+
+        if (!(t.Dir == BMREQUEST_DEVICE_TO_HOST && t.Type == BMREQUEST_STANDARD && t.Recipient == BMREQUEST_TO_DEVICE &&
+              pkt.bRequest == USB_REQUEST_GET_DESCRIPTOR && pkt.wLength)) {
+                return false;
+        }
+
+        switch (pkt.wValue.HiByte) {
+        case USB_DEVICE_DESCRIPTOR_TYPE:
+        case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+        case USB_STRING_DESCRIPTOR_TYPE:
+        case USB_BOS_DESCRIPTOR_TYPE:
+                return true;
+        }
+
+        return false;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::lookup(
+        _Inout_ descriptor_cache &c, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, 
+        _Out_writes_bytes_(size) void *buf, _In_ ULONG size, _Out_ ULONG &length)
+{
+        length = 0;
+
+        if (!(c.enabled && is_cacheable(pkt))) {
+                return false;
+        }
+
+        KLOCK_QUEUE_HANDLE lck;
+        KeAcquireInStackQueuedSpinLock(&c.lock, &lck);
+
+        auto e = find(c, pkt);
+        bool found = e && e->size <= size;
+
+        if (found) {
+                RtlCopyMemory(buf, e->data, e->size);
+                length = e->size;
+                ++c.hits;
+        } else {
+                ++c.misses;
+        }
+
+        KeReleaseInStackQueuedSpinLock(&lck);
+        return found;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::insert(
+        _Inout_ descriptor_cache &c, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, 
+        _In_reads_bytes_(length) const void *data, _In_ ULONG length)
+{
+        if (!(c.enabled && is_cacheable(pkt))) {
+                return;
+        } else if (length > descriptor_cache::MAX_SIZE || !is_valid(pkt, data, length)) {
+                TraceDbg("wValue %#06x, wIndex %#x, wLength %d: %lu bytes are not cached", 
+                          pkt.wValue.W, pkt.wIndex.W, pkt.wLength, length);
+                return;
+        }
+
+        auto copy = (UCHAR*)ExAllocatePoolUninitialized(NonPagedPoolNx, length, pooltag);
+        if (!copy) {
+                Trace(TRACE_LEVEL_ERROR, "can't allocate %lu bytes", length);
+                return;
+        }
+        RtlCopyMemory(copy, data, length);
+
+        UCHAR *old{};
+
+        {
+                KLOCK_QUEUE_HANDLE lck;
+                KeAcquireInStackQueuedSpinLock(&c.lock, &lck);
+
+                auto e = find(c, pkt);
+
+                for (auto i = 0; !e && i < descriptor_cache::MAX_ENTRIES; ++i) {
+                        if (auto &f = c.entries[i]; !f.data) {
+                                e = &f;
+                        }
+                }
+
+                if (!e) {
+                        e = &c.entries[c.next++ % descriptor_cache::MAX_ENTRIES];
+                }
+
+                old = e->data;
+                *e = { .wValue = pkt.wValue.W, .wIndex = pkt.wIndex.W, .wLength = pkt.wLength, 
+                       .size = static_cast<USHORT>(length), .data = copy };
+
+                KeReleaseInStackQueuedSpinLock(&lck);
+        }
+
+        if (old) {
+                ExFreePoolWithTag(old, pooltag);
+        }
+}
+
+/*
+ * Descriptors of a device normally do not change, the invalidation is a precaution.
+ * A response that is received after the invalidation can be cached for the same reason.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::invalidate(_Inout_ descriptor_cache &c)
+{
+        if (!c.enabled) {
+                return;
+        }
+
+        descriptor_cache_entry entries[descriptor_cache::MAX_ENTRIES];
+
+        {
+                KLOCK_QUEUE_HANDLE lck;
+                KeAcquireInStackQueuedSpinLock(&c.lock, &lck);
+
+                RtlCopyMemory(entries, c.entries, sizeof(entries));
+                RtlZeroMemory(c.entries, sizeof(c.entries));
+                ++c.invalidations;
+
+                KeReleaseInStackQueuedSpinLock(&lck);
+        }
+
+        for (auto &e: entries) {
+                if (auto data = e.data) {
+                        ExFreePoolWithTag(data, pooltag);
+                }
+        }
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv/codeseg.h>
+#include <usbspec.h>
+
+namespace usbip
+{
+
+/*
+ * If enabled (disabled by default), repeated GET_DESCRIPTOR requests for device, configuration, string and BOS descriptors 
+ * are answered from the cache instead of the server. It is read from the registry on device creation.
+ * @see get_parameter
+ */
+inline constexpr auto descriptor_cache_value_name = L"DescriptorCache";
+
+struct descriptor_cache_entry
+{
+        USHORT wValue; // type and index
+        USHORT wIndex; // LANGID for string descriptors
+        USHORT wLength; // as requested
+        USHORT size; // of data, can be less than wLength
+        UCHAR *data; // NonPagedPoolNx
+};
+
+/*
+ * Responses of the server to GET_DESCRIPTOR are cached by (type, index, langid, length).
+ * The cache is invalidated on SET_CONFIGURATION, SET_DESCRIPTOR, vendor or class OUT request and reset of the device.
+ */
+struct descriptor_cache
+{
+        enum { MAX_ENTRIES = 32, MAX_SIZE = 4096 }; // arbitrary
+
+        KSPIN_LOCK lock;
+        descriptor_cache_entry entries[MAX_ENTRIES]; // protected by lock
+        ULONG next; // index of the entry to replace if all are used
+        bool enabled; // @see descriptor_cache_value_name
+
+        // statistics
+        UINT64 hits;
+        UINT64 misses;
+        UINT64 invalidations;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init(_Out_ descriptor_cache &c, _In_ bool enabled);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free(_Inout_ descriptor_cache &c);
+
+/*
+ * @return true if the response for such request can be cached
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool is_cacheable(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt);
+
+/*
+ * @param length number of bytes copied to the buffer if the result is true
+ * @return true if the descriptor was found in the cache
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool lookup(
+        _Inout_ descriptor_cache &c, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, 
+        _Out_writes_bytes_(size) void *buf, _In_ ULONG size, _Out_ ULONG &length);
+
+/*
+ * Stores the response of the server if it is a well-formed descriptor of the requested type.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void insert(
+        _Inout_ descriptor_cache &c, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, 
+        _In_reads_bytes_(length) const void *data, _In_ ULONG length);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void invalidate(_Inout_ descriptor_cache &c);
+
+} // namespace usbip
@@ -12,6 +12,12 @@
 #include "network.h"
 #include "device_ioctl.h"
 #include "wsk_receive.h"
+#include "wsk_events.h"
+#include "completion.h"
+#include "std_requests.h"
+#include "jitter_buffer.h"
+#include "reconnect.h"
+#include "persistent.h"
 #include "ioctl.h"
 #include "vhci.h"
 
@@ -54,15 +60,64 @@ PAGED void NTAPI device_destroy(_In_ WDFOBJECT object)
         PAGED_CODE();
 
         auto device = static_cast<UDECXUSBDEVICE>(object);
-        auto &ext = get_device_ctx(device)->ext;
+        auto &dev = *get_device_ctx(device);
+        auto &ext = dev.ext;
 
         Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %!USTR!:%!USTR!/%!USTR!", 
                 ptr04x(device), &ext->node_name, &ext->service_name, &ext->busid);
 
+        free(dev.events);
+        dev.events = nullptr;
+
+        if (dev.retired_sock != ext->sock) { // @see device::reconnect
+                wsk::free(dev.retired_sock);
+        }
+
         free(ext);
         ext = nullptr;
 }
 
+/*
+ * @param ticks of KeQueryPerformanceCounter
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto ticks_to_us(_In_ LONG64 ticks)
+{
+        LARGE_INTEGER freq;
+        KeQueryPerformanceCounter(&freq);
+        return UINT64(ticks)*1'000'000/UINT64(freq.QuadPart);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto create_spin_lock(_Out_ WDFSPINLOCK *handle, _In_ WDFOBJECT parent)
+{
+        PAGED_CODE();
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = parent;
+
+        if (auto err = WdfSpinLockCreate(&attr, handle)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfSpinLockCreate %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void trace_lock_stat(_In_ UDECXUSBDEVICE device, _In_ const char *name, _In_ const lock_stat &st)
+{
+        PAGED_CODE();
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %s locks were acquired %!UINT64! times, held %!UINT64! us in total, "
+                "%!UINT64! us max", ptr04x(device), name, UINT64(st.acquisitions), 
+                ticks_to_us(st.hold_ticks), ticks_to_us(st.max_hold_ticks));
+}
+
 _Function_class_(EVT_WDF_DEVICE_CONTEXT_CLEANUP)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -74,10 +129,59 @@ PAGED void device_cleanup(_In_ WDFOBJECT Object)
         auto &dev = *get_device_ctx(device);
 
         Trace(TRACE_LEVEL_INFORMATION, "dev %04x, cancelable(%!UINT64!) / sent(%!UINT64!) requests",
-                ptr04x(device), dev.cancelable_requests, dev.sent_requests);
+                ptr04x(device), UINT64(dev.cancelable_requests), dev.sent_requests);
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %!UINT64! PDUs were sent by %!UINT64! WskSend calls, "
+                "%!UINT64! urgent PDUs overtook others", ptr04x(device), dev.batched_pdus, dev.wsk_sends, dev.urgent_pdus);
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, receive %!UINT64! us, completion %!UINT64! us, "
+                "%!UINT64! deferred request(s) in %!UINT64! batch(es)", ptr04x(device), 
+                ticks_to_us(dev.recv_ticks), ticks_to_us(dev.complete_ticks), dev.deferred_requests, dev.completion_batches);
+
+        if (auto &st = dev.clock.stat; st.samples) {
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, frame clock: %!UINT64! samples, %!UINT64! resyncs, "
+                        "jitter %!UINT64! us avg, %!UINT64! us max, drift %I64d ppm; StartFrame %!UINT64!, ASAP %!UINT64!", 
+                        ptr04x(device), st.samples, st.resyncs, ticks_to_us(st.sum_error/st.samples), 
+                        ticks_to_us(st.max_error), get_drift_ppm(st), dev.start_frames, dev.start_frames_asap);
+        }
+
+        lock_stat requests_stat{};
+        for (auto &st: dev.requests_locks_stat) {
+                add(requests_stat, st);
+        }
+
+        trace_lock_stat(device, "requests", requests_stat);
+        trace_lock_stat(device, "endpoint", dev.endpoint_locks_stat);
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, enumeration %!UINT64! us; descriptor cache: "
+                "%!UINT64! hits, %!UINT64! misses, %!UINT64! invalidations", ptr04x(device), 
+                ticks_to_us(dev.enum_ticks), dev.descriptors.hits, dev.descriptors.misses, dev.descriptors.invalidations);
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %!UINT64! standard request(s) were answered locally", 
+                ptr04x(device), dev.std_state.avoided);
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, traffic saved: %I64d round trip(s), %I64d byte(s)", 
+                ptr04x(device), dev.saved_round_trips, dev.saved_bytes);
+
+        if (dev.suspends) {
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %!UINT64! suspend(s), %!UINT64! us in total, "
+                        "%!UINT64! polling request(s) were parked, %!UINT64! wake(s)", ptr04x(device), dev.suspends, 
+                        ticks_to_us(dev.suspended_ticks), dev.parked_requests, dev.wakes);
+        }
+        NT_ASSERT(IsListEmpty(&dev.parked));
+
+        if (auto &st = dev.reconnect.stat; st.losses) {
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, connection lost %!UINT64! time(s), %!UINT64! reconnect(s) "
+                        "in %!UINT64! attempt(s), latency %I64d ms avg, %I64d ms max; %!UINT64! request(s) retried, "
+                        "%!UINT64! failed", ptr04x(device), st.losses, st.reconnects, st.attempts,
+                        st.reconnects ? st.sum_latency/LONG64(st.reconnects)/wdm::msec : 0, st.max_latency/wdm::msec,
+                        dev.retried_requests, dev.failed_requests);
+        }
 
-        // all resources must be freed except for device_ctx_ext*
-        NT_ASSERT(IsListEmpty(&dev.requests));
+        free(dev.descriptors);
+
+        // all resources must be freed except for device_ctx_ext* and event_receiver*
+        NT_ASSERT(!dev.requests_cnt);
         NT_ASSERT(dev.unplugged);
         NT_ASSERT(!dev.port);
         NT_ASSERT(!dev.recv_thread);
@@ -90,9 +194,9 @@ PAGED _KTHREAD *recv_thread_join(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx
         PAGED_CODE();
 
         auto thread = (_KTHREAD*)InterlockedExchangePointer(reinterpret_cast<PVOID*>(&dev.recv_thread), nullptr);
-        NT_ASSERT(thread);
+        NT_ASSERT(thread || dev.recv_events);
 
-        if (thread == KeGetCurrentThread()) {
+        if (!thread || thread == KeGetCurrentThread()) {
                 return thread;
         }
 
@@ -145,6 +249,18 @@ PAGED void NTAPI endpoint_cleanup(_In_ WDFOBJECT object)
                   ptr04x(endpoint), d.bEndpointAddress, usbd_pipe_type_str(usb_endpoint_type(d)),
                   usb_endpoint_dir_out(d) ? "Out" : "In", usb_endpoint_num(d), ptr04x(endp.PipeHandle));
 
+        if (endp.purges) {
+                TraceDbg("endp %04x, %!UINT64! purge(s) of %!UINT64! request(s), %!UINT64! us in total, %!UINT64! us max",
+                          ptr04x(endpoint), endp.purges, endp.purged_requests, 
+                          ticks_to_us(endp.purge_ticks), ticks_to_us(endp.purge_max_ticks));
+        }
+
+        if (auto dev = get_device_ctx(endp.device)) {
+                wdf::Lock lck(dev->endpoint_list_lock);
+                add(dev->endpoint_locks_stat, endp.requests_lock_stat);
+        }
+
+        free(endp.jitter);
         remove_endpoint_list(endp);
 }
 
@@ -174,15 +290,27 @@ void endpoint_purge(_In_ UDECXUSBENDPOINT endpoint)
 
         TraceDbg("dev %04x, endp %04x, queue %04x", ptr04x(endp.device), ptr04x(endpoint), ptr04x(endp.queue));
 
-        while (auto request = device::remove_request(dev, endpoint)) {
-                device::send_cmd_unlink_and_cancel(endp.device, request);
+        endp.purge_start = KeQueryPerformanceCounter(nullptr).QuadPart;
+
+        if (endp.jitter) {
+                flush(*endp.jitter); // held requests can't be unlinked, they are already completed by the server
         }
 
+        endp.purged_requests += device::cancel_parked(endp.device, endpoint);
+        endp.purged_requests += device::purge_requests(endp.device, endpoint);
+
         auto purge_complete = [] ([[maybe_unused]] auto queue, auto ctx) // EVT_WDF_IO_QUEUE_STATE
         { 
                 auto endpoint = static_cast<UDECXUSBENDPOINT>(ctx);
                 NT_ASSERT(get_endpoint(queue) == endpoint);
 
+                auto &endp = *get_endpoint_ctx(endpoint);
+                auto ticks = KeQueryPerformanceCounter(nullptr).QuadPart - endp.purge_start;
+
+                endp.purge_ticks += ticks;
+                endp.purge_max_ticks = max(endp.purge_max_ticks, ticks);
+                ++endp.purges;
+
                 UdecxUsbEndpointPurgeComplete(endpoint);
         };
 
@@ -209,6 +337,7 @@ _IRQL_requires_same_
 NTSTATUS d0_entry(_In_ WDFDEVICE vhci, _In_ UDECXUSBDEVICE dev)
 {
         TraceDbg("vhci %04x, dev %04x", ptr04x(vhci), ptr04x(dev));
+        device::resume(dev);
         return STATUS_SUCCESS;
 }
 
@@ -224,18 +353,24 @@ _IRQL_requires_same_
 NTSTATUS d0_exit(_In_ WDFDEVICE vhci, _In_ UDECXUSBDEVICE dev, _In_ UDECX_USB_DEVICE_WAKE_SETTING WakeSetting)
 {
         TraceDbg("vhci %04x, dev %04x, %!UDECX_USB_DEVICE_WAKE_SETTING!", ptr04x(vhci), ptr04x(dev), WakeSetting);
+
+        auto &ctx = *get_device_ctx(dev);
+        bool park_polling = true; // the device can't wake, it will not be asked for data until resume
         
         switch (WakeSetting) {
         case UdecxUsbDeviceWakeDisabled:
                 break;
         case UdecxUsbDeviceWakeEnabled:
-                NT_ASSERT(get_device_ctx(dev)->speed() < USB_SPEED_SUPER);
+                NT_ASSERT(ctx.speed() < USB_SPEED_SUPER);
+                park_polling = false;
                 break;
         case UdecxUsbDeviceWakeNotApplicable: // SuperSpeed device
-                NT_ASSERT(get_device_ctx(dev)->speed() >= USB_SPEED_SUPER);
+                NT_ASSERT(ctx.speed() >= USB_SPEED_SUPER);
+                park_polling = !ctx.function_wake;
                 break;
         }
 
+        device::suspend(dev, park_polling);
         return STATUS_SUCCESS;
 }
 
@@ -254,14 +389,18 @@ NTSTATUS function_suspend_and_wake(
         TraceDbg("vhci %04x, dev %04x, Interface %lu, %!UDECX_USB_DEVICE_FUNCTION_POWER!", 
                   ptr04x(vhci), ptr04x(dev), Interface, FunctionPower);
 
-        NT_ASSERT(get_device_ctx(dev)->speed() >= USB_SPEED_SUPER);
+        auto &ctx = *get_device_ctx(dev);
+        NT_ASSERT(ctx.speed() >= USB_SPEED_SUPER);
+
+        auto mask = Interface < 8*sizeof(ctx.function_wake) ? 1UL << Interface : 0;
 
         switch (FunctionPower) {
         case UdecxUsbDeviceFunctionNotSuspended:
-                break;
         case UdecxUsbDeviceFunctionSuspendedCannotWake:
+                ctx.function_wake &= ~mask;
                 break;
         case UdecxUsbDeviceFunctionSuspendedCanWake:
+                ctx.function_wake |= mask;
                 break;
         }
 
@@ -277,7 +416,7 @@ NTSTATUS function_suspend_and_wake(
  * it can be called concurrently from UDECX_USB_ENDPOINT_CALLBACKS.EvtUsbEndpointPurge.
  * If set SynchronizationScopeDevice for UDECXUSBENDPOINT, UdecxUsbEndpointCreate 
  * will return STATUS_WDF_SYNCHRONIZATION_SCOPE_INVALID. For these reasons,
- * explicit WDFSPINLOCK device_ctx.send_lock is used to serialize WskSend calls.
+ * lock-free device_ctx.send_queue is used to serialize WskSend calls.
  * 
  * Using power-managed queues for I/O requests that require the device to be in its working state, 
  * and using queues that are not power-managed for all other requests.
@@ -364,6 +503,11 @@ PAGED NTSTATUS endpoint_add(_In_ UDECXUSBDEVICE device, _In_ UDECX_USB_ENDPOINT_
 
         endp.device = device;
         InitializeListHead(&endp.entry);
+        InitializeListHead(&endp.requests);
+
+        if (auto err = create_spin_lock(&endp.requests_lock, endpoint)) {
+                return err;
+        }
 
         if (auto len = data->EndpointDescriptorBufferLength) {
                 NT_ASSERT(epd.bLength == len);
@@ -380,6 +524,13 @@ PAGED NTSTATUS endpoint_add(_In_ UDECXUSBDEVICE device, _In_ UDECX_USB_ENDPOINT_
                 return err;
         }
 
+        if (auto &d = endp.descriptor; 
+            dev.jitter_frames && usb_endpoint_type(d) == UsbdPipeTypeIsochronous && usb_endpoint_dir_in(d)) {
+                if (auto err = create_jitter_buffer(endp, endpoint, dev.jitter_frames)) {
+                        return err;
+                }
+        }
+
         {
                 auto &d = endp.descriptor;
                 TraceDbg("dev %04x, endp %04x{Length %d, Address %#04x{%s %s[%d]}, Attributes %#x, MaxPacketSize %#x, "
@@ -517,7 +668,7 @@ PAGED auto prepare_init(_In_ _UDECXUSBDEVICE_INIT *init, _In_ device_ctx_ext &ex
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto create_delete_lock(_Out_ WDFWAITLOCK &handle, _In_ WDFOBJECT parent)
+PAGED auto create_wait_lock(_Out_ WDFWAITLOCK &handle, _In_ WDFOBJECT parent)
 {
         PAGED_CODE();
 
@@ -535,46 +686,43 @@ PAGED auto create_delete_lock(_Out_ WDFWAITLOCK &handle, _In_ WDFOBJECT parent)
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto create_spin_lock(_Out_ WDFSPINLOCK *handle, _In_ WDFOBJECT parent)
+PAGED auto init_device(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
 {
         PAGED_CODE();
 
-        WDF_OBJECT_ATTRIBUTES attr;
-        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
-        attr.ParentObject = parent;
-
-        if (auto err = WdfSpinLockCreate(&attr, handle)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfSpinLockCreate %!STATUS!", err);
+        if (auto err = create_spin_lock(&dev.endpoint_list_lock, device)) {
                 return err;
         }
 
-        return STATUS_SUCCESS;
-}
-
-_IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto init_device(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
-{
-        PAGED_CODE();
-
-        WDFSPINLOCK *v[] = {
-                &dev.send_lock,
-                &dev.endpoint_list_lock,
-                &dev.requests_lock,
-        };
-
-        for (auto i: v) {
-                if (auto err = create_spin_lock(i, device)) {
+        for (auto &lock: dev.requests_locks) {
+                if (auto err = create_spin_lock(&lock, device)) {
                         return err;
                 }
         }
 
-        if (auto err = create_delete_lock(dev.delete_lock, device)) {
+        if (auto err = create_wait_lock(dev.delete_lock, device)) {
+                return err;
+        }
+
+        if (auto err = create_wait_lock(dev.reconnect_lock, device)) {
                 return err;
         }
 
-        InitializeListHead(&dev.requests);
+        for (auto &head: dev.requests) {
+                InitializeListHead(&head);
+        }
+        dev.send_queue.init();
+        init_completion(dev);
+        init_usb_state(dev);
+
+        KeInitializeSpinLock(&dev.parked_lock);
+        InitializeListHead(&dev.parked);
+
+        LARGE_INTEGER freq;
+        KeQueryPerformanceCounter(&freq);
+        init(dev.clock, freq.QuadPart/1000); // per 1 ms frame
         KeInitializeEvent(&dev.detach_completed, NotificationEvent, false);
+        KeInitializeEvent(&dev.reconnect_abort, NotificationEvent, false);
 
         return STATUS_SUCCESS;
 }
@@ -624,7 +772,13 @@ PAGED auto detach(_In_ UDECXUSBDEVICE device)
         auto &dev = *get_device_ctx(device);
 	NT_ASSERT(dev.unplugged);
 
-        if (close_socket(dev.sock())) {
+        if (dev.recv_events) {
+                recv_events_stop(device); // before close_socket
+        }
+
+        if (device::abort_reconnect(dev)) {
+                // the socket was closed when the connection was lost
+        } else if (close_socket(dev.sock())) {
                 Trace(TRACE_LEVEL_INFORMATION, "dev %04x, connection closed", ptr04x(device));
                 device_state_changed(dev, vhci::state::disconnected);
         }
@@ -743,6 +897,18 @@ PAGED NTSTATUS usbip::device::create(_Out_ UDECXUSBDEVICE &device, _In_ WDFDEVIC
         ctx.ext = ext;
         ext->ctx = &ctx;
 
+        ctx.recv_events = get_parameter(recv_mode_value_name, ULONG(recv_mode::thread)) == ULONG(recv_mode::events);
+        if (contains_device(recv_mode_devices_value_name, *ext)) {
+                ctx.recv_events = !ctx.recv_events;
+        }
+        ctx.inline_max = min(get_parameter(inline_max_value_name, INLINE_BUF_SIZE), ULONG(INLINE_BUF_SIZE));
+        ctx.deferred_completion = get_parameter(deferred_completion_value_name, 0);
+        ctx.jitter_frames = min(get_parameter(jitter_frames_value_name, 0), ULONG(MAX_JITTER_FRAMES));
+        init(ctx.descriptors, get_parameter(descriptor_cache_value_name, 0));
+
+        init_reconnect(ctx, ctx.recv_events ? 0 : min(get_parameter(reconnect_grace_value_name, 0), ULONG(MAX_RECONNECT_GRACE)),
+                       get_parameter(reconnect_retry_value_name, 0));
+
         if (auto err = init_device(device, ctx)) {
                 return err;
         }
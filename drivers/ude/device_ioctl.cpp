@@ -14,12 +14,15 @@
 #include "proto.h"
 #include "network.h"
 #include "ioctl.h"
+#include "urbtransfer.h"
 
 #include "filter_request.h"
+#include "std_requests.h"
+#include "endpoint_list.h"
 #include <ude_filter\request.h>
 
 #include <libdrv\irp.h>
-#include <libdrv\pdu.h>
+#include <usbip\pdu.h>
 #include <libdrv\ch9.h>
 #include <libdrv\ch11.h>
 #include <libdrv\usbdsc.h>
@@ -33,26 +36,40 @@ namespace
 
 using namespace usbip;
 
+enum : ULONG { // limits for PDUs coalesced into single WskSend
+        SEND_BATCH_MAX_PDUS = 32,
+        SEND_BATCH_MAX_BYTES = 64*1024,
+};
+
 /*
- * wsk_irp->Tail.Overlay.DriverContext[] are zeroed.
- *
- * The completion handler for WskReceive is executed by a high priority thread
- * and is usually called before this handler.
- * @see wsk_receive.cpp, ret_command 
+ * Restore the state of MDL chain that was changed by append(send_batch&, ...).
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inexpressible_("varies")) void *context)
+void untie(_Inout_ wsk_context &ctx)
 {
-        wsk_context_ptr ctx(static_cast<wsk_context*>(context), true);
+        auto next = ctx.batch_next;
+        if (!next) {
+                return;
+        }
+
+        for (auto mdl = ctx.mdl_hdr.get(); mdl; mdl = mdl->Next) {
+                if (mdl->Next == next->mdl_hdr.get()) {
+                        mdl->Next = nullptr;
+                        break;
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_complete(_In_ wsk_context *context, _In_ const IO_STATUS_BLOCK &wsk)
+{
+        wsk_context_ptr ctx(context, true);
 
         auto request = ctx->request; // can be WDF_NO_HANDLE or already completed
         auto &dev = *ctx->dev;
 
-        auto &wsk = wsk_irp->IoStatus;
-        TraceWSK("req %04x -> wsk irp %04x, %!STATUS!, Information %Iu", 
-                  ptr04x(request), ptr04x(wsk_irp), wsk.Status, wsk.Information);
-
         if (!request) {
                 // nothing to do
         } else if (NT_SUCCESS(wsk.Status)) {
@@ -66,8 +83,35 @@ NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_I
         } else {
                 TraceDbg("req %04x not found, could not complete", ptr04x(request));
         }
+}
 
-        if (wsk.Status == STATUS_FILE_FORCED_CLOSED && !dev.unplugged) {
+/*
+ * wsk_irp->Tail.Overlay.DriverContext[] are zeroed.
+ *
+ * The completion handler for WskReceive is executed by a high priority thread
+ * and is usually called before this handler.
+ * @see wsk_receive.cpp, ret_command 
+ *
+ * @param context the first PDU of the batch, @see send(device_ctx&, send_batch&)
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inexpressible_("varies")) void *context)
+{
+        auto ctx = static_cast<wsk_context*>(context);
+        auto &dev = *ctx->dev;
+
+        auto wsk = wsk_irp->IoStatus; // wsk_irp is reused by send_complete for the first PDU
+        TraceWSK("req %04x -> wsk irp %04x, %!STATUS!, Information %Iu", 
+                  ptr04x(ctx->request), ptr04x(wsk_irp), wsk.Status, wsk.Information);
+
+        for (wsk_context *next; ctx; ctx = next) {
+                next = ctx->batch_next;
+                untie(*ctx);
+                send_complete(ctx, wsk);
+        }
+
+        if (wsk.Status == STATUS_FILE_FORCED_CLOSED && !(dev.unplugged || is_enabled(dev.reconnect))) {
                 auto device = get_handle(&dev);
                 TraceDbg("dev %04x, unplugging after %!STATUS!", ptr04x(device), wsk.Status);
                 device::async_detach_nowait(device);
@@ -76,49 +120,254 @@ NTSTATUS send_complete(_In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_I
         return StopCompletion;
 }
 
+/*
+ * Short OUT payload is copied to the preallocated buffer, 
+ * this saves MDL allocation and locking of the transfer buffer.
+ * TransferBuffer can be allocated from paged pool.
+ * 
+ * @param len of the payload, can be less than TransferBufferLength, @see control_transfer
+ * @return partial MDL that describes the copied payload or NULL if the payload was not copied
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+MDL *copy_inline(_Inout_ wsk_context &ctx, _In_ const URB &urb, _In_ ULONG len)
+{
+        auto &r = AsUrbTransfer(urb);
+        NT_ASSERT(len <= r.TransferBufferLength);
+
+        if (!len || len > ctx.dev->inline_max || ctx.is_isoc) {
+                return nullptr;
+        }
+
+        const void *src{};
+
+        if (auto mdl = r.TransferBufferMDL) {
+                if (MmGetMdlByteCount(mdl) >= len) { // can be a chain
+                        src = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
+                }
+        } else if (KeGetCurrentIrql() < DISPATCH_LEVEL) {
+                src = r.TransferBuffer;
+        }
+
+        if (!src) {
+                return nullptr;
+        }
+
+        RtlCopyMemory(ctx.inline_buf, src, len);
+
+        auto part = ctx.mdl_inline_part.get();
+        MmPrepareMdlForReuse(part);
+        IoBuildPartialMdl(ctx.mdl_inline.get(), part, ctx.inline_buf, len);
+
+        return part;
+}
+
+/*
+ * The MDL chain must describe exactly get_total_size(ctx.hdr) bytes, otherwise the surplus
+ * would be sent as the header of the next PDU of the batch, @see append.
+ * The payload is sized by transfer_buffer_length of the header, it can be less than TransferBufferLength.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_ const URB *transfer_buffer)
 {
         NT_ASSERT(!ctx.mdl_buf);
+        MDL *data{};
 
-        if (transfer_buffer && is_transfer_dir_out(ctx.hdr)) { // TransferFlags can have wrong direction
-                if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, URB_BUF_LEN, IoReadAccess, *transfer_buffer)) {
-                        Trace(TRACE_LEVEL_ERROR, "make_transfer_buffer_mdl %!STATUS!", err);
-                        return err;
-                }
+        auto len = static_cast<ULONG>(ctx.hdr.cmd_submit.transfer_buffer_length);
+
+        if (!(transfer_buffer && is_transfer_dir_out(ctx.hdr))) { // TransferFlags can have wrong direction
+                //
+        } else if (data = copy_inline(ctx, *transfer_buffer, len); data) {
+                //
+        } else if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, len, IoReadAccess, *transfer_buffer)) {
+                Trace(TRACE_LEVEL_ERROR, "make_transfer_buffer_mdl %!STATUS!", err);
+                return err;
+        } else {
+                data = ctx.mdl_buf.get();
         }
 
-        ctx.mdl_hdr.next(ctx.mdl_buf); // always replace tie from previous call
+        ctx.mdl_hdr.next(data); // always replace tie from previous call
 
         if (ctx.is_isoc) {
-                NT_ASSERT(ctx.mdl_isoc);
+                auto &mdl_isoc = get_isoc_mdl(ctx);
+                NT_ASSERT(mdl_isoc);
                 byteswap(ctx.isoc, number_of_packets(ctx));
                 auto t = tail(ctx.mdl_hdr); // ctx.mdl_buf can be a chain
-                t->Next = ctx.mdl_isoc.get();
+                t->Next = mdl_isoc.get();
         }
 
         buf.Mdl = ctx.mdl_hdr.get();
         buf.Offset = 0;
         buf.Length = get_total_size(ctx.hdr);
 
-        NT_ASSERT(verify(buf, ctx.is_isoc));
+        NT_ASSERT(verify(buf, true));
         return STATUS_SUCCESS;
 }
 
 /*
- * switch (wdf::Lock lck(...); auto st = send(...))
- * is not used due to unspecified evaluation order of init-statement and condition.
- * switch (init-statement; condition) {} can be treated as:
- * {
- *      auto c = condition;
- *      init-statement;
- *      switch (c) {}
- * }
+ * PDUs that will be sent by single WskSend, their MDL chains are linked together.
+ */
+struct send_batch
+{
+        wsk_context *head; // its wsk_irp is used
+        wsk_context *last;
+        WSK_BUF buf;
+        ULONG cnt;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void send(_Inout_ device_ctx &dev, _Inout_ send_batch &batch)
+{
+        auto ctx = batch.head; // do not access ctx after send
+        if (!ctx) {
+                return;
+        }
+
+        auto request = ctx->request;
+        auto wsk_irp = ctx->wsk_irp;
+
+        auto buf = batch.buf;
+        auto cnt = batch.cnt;
+        batch = {};
+
+        ++dev.wsk_sends;
+        dev.batched_pdus += cnt;
+
+        NT_ASSERT(verify(buf, false));
+        auto st = send(dev.sock(), &buf, WSK_FLAG_NODELAY, wsk_irp); // completion handler will be called anyway
+
+        TraceWSK("req %04x -> wsk irp %04x, %lu PDU(s), %Iu bytes, %!STATUS!", 
+                  ptr04x(request), ptr04x(wsk_irp), cnt, buf.Length, st);
+}
+
+/*
+ * The order of PDUs is preserved.
+ * MDL chains are spliced only if each of them describes exactly buf.Length bytes,
+ * a PDU with a longer chain is sent by its own WskSend that sends buf.Length bytes only.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void append(_Inout_ device_ctx &dev, _Inout_ send_batch &batch, _Inout_ wsk_context &ctx)
+{
+        auto &buf = ctx.send_buf;
+
+        auto exact = verify(buf, true);
+        NT_ASSERT(exact);
+
+        if (batch.head && (!exact || batch.cnt == SEND_BATCH_MAX_PDUS || 
+                           batch.buf.Length + buf.Length > SEND_BATCH_MAX_BYTES)) {
+                send(dev, batch);
+        }
+
+        NT_ASSERT(!ctx.batch_next);
+
+        if (auto last = batch.last) {
+                NT_ASSERT(!buf.Offset);
+                tail(last->mdl_hdr)->Next = ctx.mdl_hdr.get();
+                last->batch_next = &ctx;
+                batch.buf.Length += buf.Length;
+        } else {
+                batch.head = &ctx;
+                batch.buf = buf;
+        }
+
+        batch.last = &ctx;
+        ++batch.cnt;
+
+        if (!exact) {
+                send(dev, batch);
+        }
+}
+
+/*
+ * All endpoints share the same TCP stream, a large bulk transfer delays PDUs queued after it.
+ * Interrupt and isoch transfers, and transfers of endpoints that have priority boost 
+ * (HID, audio, @see get_priority_boost) are urgent.
+ * 
+ * CMD_UNLINK is not urgent, it must not overtake CMD_SUBMIT of a bulk transfer it unlinks.
+ * Requests to the default control pipe are not urgent for the same reason, they can change the state 
+ * of other endpoints (CLEAR_FEATURE(ENDPOINT_HALT), SET_INTERFACE, SET_CONFIGURATION) which must see 
+ * the transfers queued before. The same is true for standard requests to an interface or endpoint 
+ * on another control pipe.
+ * The order of PDUs of the same endpoint is always preserved.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_ device_ctx &dev,
+auto is_urgent(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ const header &hdr)
+{
+        if (!endpoint) {
+                return false;
+        }
+
+        auto &endp = *get_endpoint_ctx(endpoint);
+
+        switch (usb_endpoint_type(endp.descriptor)) {
+        case UsbdPipeTypeBulk:
+                return endp.priority_boost;
+        case UsbdPipeTypeControl:
+                if (usb_default_control_pipe(endp.descriptor)) {
+                        return false;
+                } else {
+                        auto &pkt = reinterpret_cast<const USB_DEFAULT_PIPE_SETUP_PACKET&>(hdr.cmd_submit.setup);
+                        auto &t = pkt.bmRequestType;
+                        return !(t.Type == BMREQUEST_STANDARD && 
+                                 (t.Recipient == BMREQUEST_TO_INTERFACE || t.Recipient == BMREQUEST_TO_ENDPOINT));
+                }
+        }
+
+        return true;
+}
+
+/*
+ * WskSend is called by a single thread at a time, the one that has made the queue non-empty.
+ * It also sends contexts that have been queued by other threads meanwhile,
+ * coalescing the PDUs that were taken at once into a few WskSend calls.
+ * Urgent PDUs among them are sent first.
+ * Sending is never delayed to accumulate a larger batch.
+ * @see libdrv::mpsc_queue
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void drain(_Inout_ device_ctx &dev)
+{
+        send_batch urgent{};
+        send_batch batch{};
+
+        auto f = [&dev, &urgent, &batch] (auto &ctx) 
+        {
+                if (ctx.urgent) {
+                        dev.urgent_pdus += bool(batch.head); // overtakes
+                        append(dev, urgent, ctx);
+                } else {
+                        append(dev, batch, ctx);
+                }
+        };
+
+        dev.send_queue.drain(f, [&dev, &urgent, &batch] { send(dev, urgent); send(dev, batch); });
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void submit(_Inout_ device_ctx &dev, _In_ wsk_context &ctx)
+{
+        KIRQL irql;
+        KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+        if (dev.send_queue.push(ctx)) {
+                drain(dev);
+        }
+
+        KeLowerIrql(irql);
+}
+
+/*
+ * Everything except submit, ctx is ready to be pushed to the send queue if it succeeds.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS prepare_send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_ device_ctx &dev,
         _In_ bool log_setup, _Inout_opt_ const URB* transfer_buffer = nullptr)
 {
         auto request = ctx->request; // can be WDF_NO_HANDLE, do not access after send
@@ -136,22 +385,92 @@ auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_
                 device::append_request(dev, *ctx, endpoint);
         }
 
+        ctx->urgent = is_urgent(endpoint, ctx->hdr);
         byteswap_header(ctx->hdr, swap_dir::host2net);
 
-        auto wsk_irp = ctx->wsk_irp; // do not access ctx or wsk_irp after send
-        IoSetCompletionRoutine(wsk_irp, send_complete, ctx.release(), true, true, true);
+        ctx->send_buf = buf;
+        ctx->batch_next = nullptr;
+        IoSetCompletionRoutine(ctx->wsk_irp, send_complete, &*ctx, true, true, true);
+        return STATUS_SUCCESS;
+}
 
-        NTSTATUS st;
-        {
-                wdf::Lock lck(dev.send_lock); // EvtUsbEndpointPurge, EvtIoInternalDeviceControl on other queues
-                st = send(dev.sock(), &buf, WSK_FLAG_NODELAY, wsk_irp); // completion handler will be called anyway
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_ device_ctx &dev,
+        _In_ bool log_setup, _Inout_opt_ const URB* transfer_buffer = nullptr)
+{
+        if (auto err = prepare_send(endpoint, ctx, dev, log_setup, transfer_buffer)) {
+                return err;
         }
-        TraceWSK("req %04x -> wsk irp %04x, %Iu bytes, %!STATUS!", 
-                  ptr04x(request), ptr04x(wsk_irp), buf.Length, st);
 
+        submit(dev, *ctx.release()); // EvtUsbEndpointPurge, EvtIoInternalDeviceControl on other queues
         return STATUS_PENDING;
 }
 
+/*
+ * @return STATUS_PENDING if the request must be sent to the server
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto from_descriptor_cache(
+        _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        UCHAR *buf{};
+        ULONG buf_len{};
+        ULONG len{};
+
+        if (!is_cacheable(pkt) || UdecxUrbRetrieveBuffer(request, &buf, &buf_len) || 
+            !lookup(dev.descriptors, pkt, buf, min(buf_len, ULONG(pkt.wLength)), len)) {
+                return STATUS_PENDING;
+        }
+
+        UdecxUrbSetBytesCompleted(request, len);
+        traffic_saved(dev, len);
+
+        TraceUrb("req %04x, wValue %#06x, wIndex %#x, wLength %d <- %lu bytes from the cache", 
+                  ptr04x(request), pkt.wValue.W, pkt.wIndex.W, pkt.wLength, len);
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void on_set_configuration(_Inout_ device_ctx &dev, _In_ UCHAR ConfigurationValue)
+{
+        invalidate(dev.descriptors);
+
+        if (ConfigurationValue && !dev.enum_ticks && dev.plugin_time) {
+                dev.enum_ticks = KeQueryPerformanceCounter(nullptr).QuadPart - dev.plugin_time;
+        }
+}
+
+/*
+ * SET_CONFIGURATION, SET_DESCRIPTOR from an upper driver or unpacked SELECT_CONFIGURATION.
+ * Vendor and class OUT requests can change descriptors as well (DFU, firmware update, mode switch).
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void on_control_request(_Inout_ device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        if (auto &t = pkt.bmRequestType; t.Type != BMREQUEST_STANDARD) {
+                if (t.Dir == BMREQUEST_HOST_TO_DEVICE) {
+                        invalidate(dev.descriptors);
+                }
+                return;
+        } else if (t.Recipient != BMREQUEST_TO_DEVICE) {
+                return;
+        }
+
+        switch (pkt.bRequest) {
+        case USB_REQUEST_SET_CONFIGURATION:
+                on_set_configuration(dev, pkt.wValue.LowByte);
+                break;
+        case USB_REQUEST_SET_DESCRIPTOR:
+                invalidate(dev.descriptors);
+                break;
+        }
+}
+
 using urb_function_t = NTSTATUS (device_ctx&, UDECXUSBENDPOINT, endpoint_ctx&, WDFREQUEST, URB&);
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -166,11 +485,11 @@ auto control_transfer(
         auto &r = urb.UrbControlTransferEx;
 
         if (r.PipeHandle && endp.PipeHandle != r.PipeHandle) { // r.PipeHandle is null if USBD_DEFAULT_PIPE_TRANSFER
-                endp.PipeHandle = r.PipeHandle;
+                set_pipe_handle(dev, endp, r.PipeHandle);
         }
 
         if (!filter::is_request(r)) {
-                //
+                on_request(dev, get_setup_packet(r));
         } else if (auto func = filter::get_function(r, true); auto err = filter::unpack_request(dev, r, func)) {
                 return err;
         }
@@ -190,6 +509,13 @@ auto control_transfer(
         auto buf_len = r.TransferBufferLength;
         auto &pkt = get_setup_packet(r); // @see UdecxUrbRetrieveControlSetupPacket
 
+        if (auto st = from_descriptor_cache(dev, request, pkt); st != STATUS_PENDING) {
+                return st;
+        } else if (st = answer_locally(dev, request, pkt); st != STATUS_PENDING) {
+                return st;
+        }
+        on_control_request(dev, pkt);
+
         if (buf_len > pkt.wLength) { // see drivers/usb/core/urb.c, usb_submit_urb
                 buf_len = pkt.wLength; // usb_submit_urb checks for equality
         } else if (buf_len < pkt.wLength) {
@@ -226,7 +552,7 @@ auto bulk_or_interrupt_transfer(
         auto &r = urb.UrbBulkOrInterruptTransfer;
 
         if (endp.PipeHandle != r.PipeHandle) {
-                endp.PipeHandle = r.PipeHandle;
+                set_pipe_handle(dev, endp, r.PipeHandle);
         }
 
         {
@@ -281,8 +607,45 @@ auto repack(_In_ iso_packet_descriptor *d, _In_ const _URB_ISOCH_TRANSFER &r)
 }
 
 /*
- * USBD_START_ISO_TRANSFER_ASAP is appended because URB_GET_CURRENT_FRAME_NUMBER is not implemented.
+ * StartFrame is a frame number of device_ctx::clock, it is honoured if the clock is synchronized
+ * and the frame is far enough to reach the server in time. Otherwise USBD_START_ISO_TRANSFER_ASAP is appended.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_isoch_flags(_Inout_ device_ctx &dev, _In_ const _URB_ISOCH_TRANSFER &r)
+{
+        enum { MIN_LEAD = 16 }; // frames, covers the latency of the network and the server
+
+        auto flags = r.TransferFlags;
+
+        if (flags & USBD_START_ISO_TRANSFER_ASAP) {
+                // as requested
+        } else if (is_schedulable(dev.clock, r.StartFrame, clock_now(), MIN_LEAD)) {
+                ++dev.start_frames;
+        } else {
+                flags |= USBD_START_ISO_TRANSFER_ASAP;
+                ++dev.start_frames_asap;
+        }
+
+        return flags;
+}
+
+/*
+ * The number of the server's frame, @see frame_clock.
  */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Function_class_(urb_function_t)
+auto get_current_frame_number(
+        _In_ device_ctx &dev, _In_ UDECXUSBENDPOINT, _In_ endpoint_ctx&, 
+        _In_ WDFREQUEST request, _In_ URB &urb)
+{
+        auto &r = urb.UrbGetCurrentFrameNumber;
+        r.FrameNumber = get_frame(dev.clock, clock_now());
+
+        TraceUrb("req %04x -> FrameNumber %lu", ptr04x(request), r.FrameNumber);
+        return STATUS_SUCCESS;
+}
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Function_class_(urb_function_t)
 auto isoch_transfer(
@@ -293,7 +656,7 @@ auto isoch_transfer(
         auto &r = urb.UrbIsochronousTransfer;
 
         if (endp.PipeHandle != r.PipeHandle) {
-                endp.PipeHandle = r.PipeHandle;
+                set_pipe_handle(dev, endp, r.PipeHandle);
         }
 
         {
@@ -321,7 +684,7 @@ auto isoch_transfer(
         }
 
         if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp.descriptor, 
-                               r.TransferFlags | USBD_START_ISO_TRANSFER_ASAP, r.TransferBufferLength)) {
+                               get_isoch_flags(dev, r), r.TransferBufferLength)) {
                 return err;
         }
 
@@ -330,7 +693,7 @@ auto isoch_transfer(
         }
 
         if (auto cmd = &ctx->hdr.cmd_submit) {
-                cmd->start_frame = r.StartFrame;
+                cmd->start_frame = to_server_frame(r.StartFrame, usb_device_speed(dev.speed()));
                 cmd->number_of_packets = r.NumberOfPackets;
         }
 
@@ -356,6 +719,91 @@ auto allocate_request_ctx(_In_ WDFREQUEST request)
         return STATUS_SUCCESS;
 }
 
+constexpr auto is_polling(_In_ const endpoint_ctx &endp)
+{
+        auto &d = endp.descriptor;
+        return usb_endpoint_type(d) == UsbdPipeTypeInterrupt && usb_endpoint_dir_in(d);
+}
+
+_Function_class_(EVT_WDF_REQUEST_CANCEL)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel_parked(_In_ WDFREQUEST request)
+{
+        auto &dev = *get_device_ctx(get_device(request));
+
+        {
+                KLOCK_QUEUE_HANDLE lck;
+                KeAcquireInStackQueuedSpinLock(&dev.parked_lock, &lck);
+
+                RemoveEntryList(&get_request_ctx(request)->entry);
+
+                KeReleaseInStackQueuedSpinLock(&lck);
+        }
+
+        TraceDbg("req %04x", ptr04x(request));
+        complete(request, STATUS_CANCELLED);
+}
+
+/*
+ * The request is kept by the driver while the device is suspended or reconnecting, @see unpark.
+ * It must not be in the list of sent requests.
+ * The condition is checked again under the lock because it is cleared under the lock, @see device::reconnected.
+ *
+ * @return false if the request must be sent because the condition is no longer true
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool park(_Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ UDECXUSBENDPOINT endpoint)
+{
+        auto &req = *get_request_ctx(request);
+        req.endpoint = endpoint;
+
+        auto polling = is_polling(*get_endpoint_ctx(endpoint));
+        NTSTATUS err{};
+
+        {
+                KLOCK_QUEUE_HANDLE lck;
+                KeAcquireInStackQueuedSpinLock(&dev.parked_lock, &lck);
+
+                if (!(dev.reconnecting || (dev.park_polling && polling))) {
+                        KeReleaseInStackQueuedSpinLock(&lck);
+                        return false;
+                }
+
+                InsertTailList(&dev.parked, &req.entry);
+                err = WdfRequestMarkCancelableEx(request, cancel_parked);
+
+                if (err) { // STATUS_CANCELLED
+                        RemoveEntryList(&req.entry);
+                } else {
+                        ++dev.parked_requests;
+                }
+
+                KeReleaseInStackQueuedSpinLock(&lck);
+        }
+
+        if (err) {
+                complete(request, err);
+        }
+
+        return true;
+}
+
+/*
+ * The request was sent over the connection that was lost, @see device::withdraw_requests.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete_lost(_In_ WDFREQUEST request)
+{
+        if (auto urb = try_get_urb(request)) {
+                urb->UrbHeader.Status = USBD_STATUS_XACT_ERROR;
+        }
+
+        complete(request, STATUS_UNSUCCESSFUL);
+}
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto usb_submit_urb(
@@ -367,6 +815,10 @@ auto usb_submit_urb(
                 return err;
         }
 
+        if ((dev.reconnecting || (dev.park_polling && is_polling(endp))) && park(dev, request, endpoint)) {
+                return STATUS_PENDING;
+        }
+
         auto &urb = get_urb(request);
         urb_function_t *handler{};
 
@@ -383,6 +835,9 @@ auto usb_submit_urb(
         case URB_FUNCTION_CONTROL_TRANSFER:
                 handler = control_transfer;
                 break;
+        case URB_FUNCTION_GET_CURRENT_FRAME_NUMBER:
+                handler = get_current_frame_number;
+                break;
         default:
                 Trace(TRACE_LEVEL_ERROR, "%s(%#04x), dev %04x, endp %04x", urb_function_str(func), func, 
                                           ptr04x(endp.device), ptr04x(endpoint));
@@ -393,6 +848,136 @@ auto usb_submit_urb(
         return handler(dev, endpoint, endp, request, urb);
 }
 
+/*
+ * CMD_UNLINK PDUs for all requests of the endpoint are pushed to the send queue first and the queue
+ * is drained after that, thus they are coalesced by WskSend calls, @see SEND_BATCH_MAX_PDUS.
+ * If another thread is the consumer of the queue, it will send them.
+ *
+ * Removed requests are collected and passed to f after the drain, completion routines of upper drivers
+ * would delay sending of the unlinks otherwise. The link of completion_list is free for that,
+ * a removed request can't be received.
+ *
+ * @param f is called for each removed request instead of its completion
+ * @return number of removed requests
+ */
+template<typename F>
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG unlink_requests(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ const F &f)
+{
+        ULONG cnt = 0;
+        bool consumer = false;
+
+        request_ctx *head{};
+        auto tail = &head;
+
+        KIRQL irql;
+        KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+        for (WDFREQUEST request; (request = device::remove_request(dev, endpoint)) != WDF_NO_HANDLE; ++cnt) {
+
+                auto req = get_request_ctx(request);
+                req->complete_next = nullptr;
+
+                *tail = req;
+                tail = &req->complete_next;
+
+                if (auto seqnum = req->seqnum; dev.unplugged || dev.reconnecting) {
+                        // do not send unlink
+                } else if (wsk_context_ptr ctx(&dev, WDFREQUEST(WDF_NO_HANDLE)); !ctx) {
+                        Trace(TRACE_LEVEL_ERROR, "dev %04x, seqnum %u, wsk_context_ptr error", ptr04x(get_handle(&dev)), seqnum);
+                } else {
+                        set_cmd_unlink_usbip_header(ctx->hdr, dev, seqnum);
+                        if (NT_SUCCESS(prepare_send(WDF_NO_HANDLE, ctx, dev, false))) {
+                                consumer |= dev.send_queue.push(*ctx.release());
+                        }
+                }
+        }
+
+        if (consumer) {
+                drain(dev);
+        }
+
+        for (auto req = head; req; ) {
+                auto next = req->complete_next; // f can complete the request
+                f(get_handle(req));
+                req = next;
+        }
+
+        KeLowerIrql(irql);
+        return cnt;
+}
+
+/*
+ * Parked requests are resubmitted or completed with STATUS_CANCELLED.
+ * A request is taken from the list only if WdfRequestUnmarkCancelable succeeded, 
+ * otherwise cancel_parked will remove it.
+ *
+ * @param endpoint all parked requests if null
+ * @return number of requests that were taken
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto unpark(_Inout_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint, _In_ bool resubmit)
+{
+        LIST_ENTRY taken;
+        InitializeListHead(&taken);
+
+        {
+                KLOCK_QUEUE_HANDLE lck;
+                KeAcquireInStackQueuedSpinLock(&dev.parked_lock, &lck);
+
+                for (auto entry = dev.parked.Flink; entry != &dev.parked; ) {
+                        auto req = CONTAINING_RECORD(entry, request_ctx, entry);
+                        entry = entry->Flink;
+
+                        if (endpoint && req->endpoint != endpoint) {
+                                //
+                        } else if (WdfRequestUnmarkCancelable(get_handle(req)) != STATUS_CANCELLED) {
+                                RemoveEntryList(&req->entry);
+                                InsertTailList(&taken, &req->entry);
+                        }
+                }
+
+                KeReleaseInStackQueuedSpinLock(&lck);
+        }
+
+        ULONG cnt = 0;
+
+        for ( ; !IsListEmpty(&taken); ++cnt) {
+                auto req = CONTAINING_RECORD(RemoveHeadList(&taken), request_ctx, entry);
+                auto request = get_handle(req);
+
+                if (!resubmit) {
+                        complete(request, STATUS_CANCELLED);
+                } else if (auto endp = req->endpoint; 
+                           auto st = usb_submit_urb(dev, endp, *get_endpoint_ctx(endp), request); st != STATUS_PENDING) {
+                        UdecxUrbCompleteWithNtStatus(request, st);
+                }
+        }
+
+        return cnt;
+}
+
+/*
+ * An unlinked request is parked, but resume or device::reconnected could clear the condition
+ * after the request was unlinked. Such request is sent again as unpark does.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void park_or_submit(_Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ UDECXUSBENDPOINT endpoint)
+{
+        if (park(dev, request, endpoint)) {
+                return;
+        }
+
+        TraceDbg("req %04x, resubmit", ptr04x(request));
+
+        if (auto st = usb_submit_urb(dev, endpoint, *get_endpoint_ctx(endpoint), request); st != STATUS_PENDING) {
+                UdecxUrbCompleteWithNtStatus(request, st);
+        }
+}
+
 /*
  * @param request can be WDF_NO_HANDLE
  */
@@ -453,8 +1038,8 @@ void usbip::device::send_cmd_unlink_and_complete(_In_ UDECXUSBDEVICE device, _In
 
         TraceDbg("dev %04x, seqnum %u", ptr04x(device), req.seqnum);
 
-        if (dev.unplugged) {
-                TraceDbg("Unplugged, do not send unlink");
+        if (dev.unplugged || dev.reconnecting) {
+                TraceDbg("Unplugged or reconnecting, do not send unlink");
         } else if (auto ctx = wsk_context_ptr(&dev, WDFREQUEST(WDF_NO_HANDLE))) {
                 set_cmd_unlink_usbip_header(ctx->hdr, dev, req.seqnum);
                 ::send(WDF_NO_HANDLE, ctx, dev, false); // ignore error
@@ -465,6 +1050,166 @@ void usbip::device::send_cmd_unlink_and_complete(_In_ UDECXUSBDEVICE device, _In
         complete(request, status);
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::device::purge_requests(_In_ UDECXUSBDEVICE device, _In_ UDECXUSBENDPOINT endpoint)
+{
+        auto cnt = unlink_requests(*get_device_ctx(device), endpoint, [] (auto request) 
+        {
+                complete(request, STATUS_CANCELLED);
+        });
+
+        TraceDbg("dev %04x, endp %04x, %lu request(s)", ptr04x(device), ptr04x(endpoint), cnt);
+        return cnt;
+}
+
+/*
+ * Requests of interrupt IN endpoints are withdrawn from the server and parked if the device can't wake,
+ * otherwise they stay on the server and their completion will signal a wake.
+ * TCP keepalive of the socket is set on attach, @see vhci_ioctl.cpp, set_options.
+ *
+ * A request which the server completes before it receives CMD_UNLINK is lost (RET_SUBMIT is ignored), 
+ * this is acceptable for an idle device. Parked requests are resubmitted by resume.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::suspend(_In_ UDECXUSBDEVICE device, _In_ bool park_polling)
+{
+        auto &dev = *get_device_ctx(device);
+
+        dev.suspend_start = KeQueryPerformanceCounter(nullptr).QuadPart;
+        ++dev.suspends;
+
+        dev.wake_signaled = false;
+        dev.park_polling = park_polling;
+        dev.suspended = true;
+
+        if (!park_polling) {
+                TraceDbg("dev %04x", ptr04x(device));
+                return;
+        }
+
+        UDECXUSBENDPOINT endpoints[device_ctx::ENDPOINT_SLOTS];
+        ULONG cnt = 0;
+
+        for (ULONG i = 0, n = get_endpoints(dev, endpoints, ARRAYSIZE(endpoints)); i < n; ++i) {
+                if (auto endpoint = endpoints[i]; is_polling(*get_endpoint_ctx(endpoint))) {
+                        cnt += unlink_requests(dev, endpoint, [&dev, endpoint] (auto request) 
+                        {
+                                park_or_submit(dev, request, endpoint);
+                        });
+                }
+        }
+
+        TraceDbg("dev %04x, %lu request(s) parked", ptr04x(device), cnt);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::resume(_In_ UDECXUSBDEVICE device)
+{
+        auto &dev = *get_device_ctx(device);
+        if (!dev.suspended) {
+                return;
+        }
+
+        dev.park_polling = false;
+        dev.suspended = false;
+        dev.suspended_ticks += KeQueryPerformanceCounter(nullptr).QuadPart - dev.suspend_start;
+
+        auto cnt = unpark(dev, WDF_NO_HANDLE, true);
+        TraceDbg("dev %04x, %lu request(s) resubmitted", ptr04x(device), cnt);
+}
+
+/*
+ * The server has forgotten the requests of the lost session, RET_SUBMIT will never come for them.
+ * Only requests of IN endpoints can be retried safely because their data were not delivered to the client,
+ * an OUT or control transfer could be executed by the device already.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::device::withdraw_requests(_In_ UDECXUSBDEVICE device, _In_ bool retry)
+{
+        auto &dev = *get_device_ctx(device);
+        NT_ASSERT(dev.reconnecting);
+
+        UDECXUSBENDPOINT endpoints[device_ctx::ENDPOINT_SLOTS + 1]{ dev.ep0 };
+        auto n = 1 + get_endpoints(dev, endpoints + 1, ARRAYSIZE(endpoints) - 1);
+
+        ULONG cnt = 0;
+
+        for (ULONG i = 0; i < n; ++i) {
+                auto endpoint = endpoints[i];
+                auto &d = get_endpoint_ctx(endpoint)->descriptor;
+                ULONG k{};
+
+                if (retry && endpoint != dev.ep0 && usb_endpoint_dir_in(d)) {
+                        k = unlink_requests(dev, endpoint, [&dev, endpoint] (auto request) 
+                        {
+                                park_or_submit(dev, request, endpoint);
+                        });
+                        dev.retried_requests += k;
+                } else {
+                        k = unlink_requests(dev, endpoint, complete_lost);
+                        dev.failed_requests += k;
+                }
+
+                cnt += k;
+        }
+
+        TraceDbg("dev %04x, %lu request(s)", ptr04x(device), cnt);
+        return cnt;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::device::reconnected(_In_ UDECXUSBDEVICE device)
+{
+        auto &dev = *get_device_ctx(device);
+
+        {
+                KLOCK_QUEUE_HANDLE lck;
+                KeAcquireInStackQueuedSpinLock(&dev.parked_lock, &lck);
+
+                NT_ASSERT(dev.reconnecting);
+                dev.reconnecting = false; // @see park
+
+                KeReleaseInStackQueuedSpinLock(&lck);
+        }
+
+        auto cnt = unpark(dev, WDF_NO_HANDLE, true); // polling requests are parked again if suspended
+        TraceDbg("dev %04x, %lu request(s) resubmitted", ptr04x(device), cnt);
+        return cnt;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::device::cancel_parked(_In_ UDECXUSBDEVICE device, _In_ UDECXUSBENDPOINT endpoint)
+{
+        return unpark(*get_device_ctx(device), endpoint, false);
+}
+
+/*
+ * The first completion of a request while the device is suspended, the remote wakeup must be enabled.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::signal_wake(_In_ UDECXUSBDEVICE device)
+{
+        auto &dev = *get_device_ctx(device);
+
+        static_assert(sizeof(dev.wake_signaled) == sizeof(CHAR));
+        if (!dev.suspended || dev.park_polling || InterlockedExchange8(PCHAR(&dev.wake_signaled), true)) {
+                return;
+        }
+
+        if (dev.speed() < USB_SPEED_SUPER) {
+                UdecxUsbDeviceSignalWake(device);
+                ++dev.wakes;
+                TraceDbg("dev %04x", ptr04x(device));
+        }
+}
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 USB_DEFAULT_PIPE_SETUP_PACKET usbip::device::make_set_configuration(_In_ UCHAR ConfigurationValue)
@@ -521,6 +1266,7 @@ NTSTATUS usbip::device::set_configuration(
         _In_ UDECXUSBDEVICE device, _In_opt_ WDFREQUEST request, _In_ UCHAR ConfigurationValue)
 {
         TraceDbg("dev %04x, ConfigurationValue %d", ptr04x(device), ConfigurationValue);
+        on_set_configuration(*get_device_ctx(device), ConfigurationValue);
 
         auto r = make_set_configuration(ConfigurationValue);
         return send_ep0_out(device, request, r);
@@ -569,6 +1315,8 @@ NTSTATUS usbip::device::reset_port(_In_ UDECXUSBDEVICE device, _In_opt_ WDFREQUE
         auto port = static_cast<USHORT>(dev.port); // meaningless for a server which ignores it
 
         TraceDbg("dev %04x, port %d", ptr04x(device), port);
+        invalidate(dev.descriptors);
+        forget_usb_state(dev);
 
         auto r = make_reset_port(port);
         return send_ep0_out(device, request, r);
@@ -24,6 +24,63 @@ inline void send_cmd_unlink_and_cancel(_In_ UDECXUSBDEVICE device, _In_ WDFREQUE
         send_cmd_unlink_and_complete(device, request, STATUS_CANCELLED);
 }
 
+/*
+ * Removes all requests of the endpoint, sends CMD_UNLINK for them in a few WskSend calls
+ * and completes them with STATUS_CANCELLED.
+ * @return number of purged requests
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG purge_requests(_In_ UDECXUSBDEVICE device, _In_ UDECXUSBENDPOINT endpoint);
+
+/*
+ * The link is going to a low power state.
+ * @param park_polling withdraw requests of interrupt IN endpoints from the server until resume
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void suspend(_In_ UDECXUSBDEVICE device, _In_ bool park_polling);
+
+/*
+ * Parked requests are sent to the server again.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void resume(_In_ UDECXUSBDEVICE device);
+
+/*
+ * Completes parked requests of the endpoint with STATUS_CANCELLED.
+ * @return number of cancelled requests
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG cancel_parked(_In_ UDECXUSBDEVICE device, _In_ UDECXUSBENDPOINT endpoint);
+
+/*
+ * The connection to the server was lost, requests that were sent over it are removed.
+ * @param retry requests of IN endpoints except the default control pipe are parked 
+ *        to be sent over the new connection, others are completed with USBD_STATUS_XACT_ERROR
+ * @return number of removed requests
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG withdraw_requests(_In_ UDECXUSBDEVICE device, _In_ bool retry);
+
+/*
+ * The session was restored, new requests are sent to the server again and parked ones are resubmitted.
+ * @return number of resubmitted requests
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG reconnected(_In_ UDECXUSBDEVICE device);
+
+/*
+ * Is called for each received RET_SUBMIT, does nothing if the device is not suspended.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void signal_wake(_In_ UDECXUSBDEVICE device);
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 USB_DEFAULT_PIPE_SETUP_PACKET make_set_configuration(_In_ UCHAR ConfigurationValue);
@@ -34,6 +34,56 @@ auto get_endpoint_list_head(_In_ device_ctx &dev)
         return &ep0->entry;
 }
 
+constexpr auto get_slot(_In_ UINT8 address)
+{
+        static_assert(device_ctx::ENDPOINT_SLOTS == 2*(USB_ENDPOINT_ADDRESS_MASK + 1));
+        return (address & USB_ENDPOINT_ADDRESS_MASK) | ((address & USB_ENDPOINT_DIRECTION_MASK) >> 3);
+}
+
+static_assert(get_slot(0x0F) == 0x0F);
+static_assert(get_slot(0x81) == 0x11);
+static_assert(get_slot(0x8F) == 0x1F);
+
+inline auto get_bucket(_In_ USBD_PIPE_HANDLE handle)
+{
+        static_assert(!(device_ctx::PIPE_HANDLE_BUCKETS & (device_ctx::PIPE_HANDLE_BUCKETS - 1)));
+        auto h = reinterpret_cast<ULONG_PTR>(handle);
+        return ((h >> 4) ^ (h >> 12)) & (device_ctx::PIPE_HANDLE_BUCKETS - 1);
+}
+
+/*
+ * The list is walked from its head, thus the most recently inserted endpoint is found.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+endpoint_ctx *find_locked(_In_ device_ctx &dev, _In_ const endpoint_search &crit, _In_opt_ const endpoint_ctx *skip = nullptr)
+{
+        auto head = get_endpoint_list_head(dev);
+
+        for (auto entry = head->Flink; entry != head; entry = entry->Flink) {
+                auto endp = CONTAINING_RECORD(entry, endpoint_ctx, entry);
+                if (endp != skip && matches(*endp, crit)) {
+                        return endp;
+                }
+        }
+
+        return nullptr;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto read(_In_ endpoint_ctx* const &slot)
+{
+        return static_cast<endpoint_ctx*>(ReadPointerAcquire(reinterpret_cast<PVOID const volatile*>(&slot)));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline void write(_Out_ endpoint_ctx* &slot, _In_opt_ endpoint_ctx *endp)
+{
+        WritePointerRelease(reinterpret_cast<PVOID volatile*>(&slot), endp);
+}
+
 } // namespace
 
 
@@ -46,6 +96,7 @@ void usbip::insert_endpoint_list(_In_ endpoint_ctx &endp)
         if (auto &dev = *get_device_ctx(endp.device); auto head = get_endpoint_list_head(dev)) {
                 wdf::Lock lck(dev.endpoint_list_lock);
                 InsertHeadList(head, &endp.entry); // outdated, but still not removed endpoints will be at end
+                write(dev.endpoints[get_slot(endp.descriptor.bEndpointAddress)], &endp);
         }
 }
 
@@ -57,26 +108,80 @@ void usbip::remove_endpoint_list(_In_ endpoint_ctx &endp)
 
         if (auto dev = get_device_ctx(endp.device)) {
                 wdf::Lock lck(dev->endpoint_list_lock);
+
+                auto addr = endp.descriptor.bEndpointAddress;
+
+                if (auto &slot = dev->endpoints[get_slot(addr)]; slot == &endp) {
+                        write(slot, find_locked(*dev, addr, &endp)); // the previous one with the same address
+                }
+
+                if (auto &cached = dev->pipe_handles[get_bucket(endp.PipeHandle)]; cached == &endp) {
+                        write(cached, nullptr);
+                }
+
                 RemoveEntryList(e); // works if entry was just InitializeListHead-ed
         }
 
         InitializeListHead(e);
 }
 
+/*
+ * Is called without the lock for search by address, endpoint addresses are immutable.
+ * The result for PipeHandle is cached, its bucket is invalidated if PipeHandle of any endpoint is changed.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto usbip::find_endpoint(_In_ device_ctx &dev, _In_ const endpoint_search &crit) -> endpoint_ctx*
 {
-        auto head = get_endpoint_list_head(dev);
+        switch (crit.what) {
+        case crit.ADDRESS:
+                if (auto endp = read(dev.endpoints[get_slot(crit.address)]); endp && matches(*endp, crit)) {
+                        return endp;
+                }
+                return nullptr;
+        case crit.HANDLE:
+                if (auto endp = read(dev.pipe_handles[get_bucket(crit.handle)]); endp && matches(*endp, crit)) {
+                        return endp;
+                }
+                break;
+        }
 
         wdf::Lock lck(dev.endpoint_list_lock);
+        auto endp = find_locked(dev, crit);
 
-        for (auto entry = head->Flink; entry != head; entry = entry->Flink) {
+        if (endp && crit.what == crit.HANDLE) {
+                write(dev.pipe_handles[get_bucket(crit.handle)], endp);
+        }
+
+        return endp;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::get_endpoints(_In_ device_ctx &dev, _Out_writes_to_(cnt, return) UDECXUSBENDPOINT *endpoints, _In_ ULONG cnt)
+{
+        ULONG n = 0;
+
+        wdf::Lock lck(dev.endpoint_list_lock);
+        auto head = get_endpoint_list_head(dev);
+
+        for (auto entry = head->Flink; entry != head && n < cnt; entry = entry->Flink) {
                 auto endp = CONTAINING_RECORD(entry, endpoint_ctx, entry);
-                if (matches(*endp, crit)) {
-                        return endp;
-                }
+                endpoints[n++] = static_cast<UDECXUSBENDPOINT>(WdfObjectContextGetObject(endp));
         }
 
-        return nullptr;
+        return n;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::set_pipe_handle(_In_ device_ctx &dev, _Inout_ endpoint_ctx &endp, _In_ USBD_PIPE_HANDLE handle)
+{
+        wdf::Lock lck(dev.endpoint_list_lock);
+
+        for (auto h: {endp.PipeHandle, handle}) {
+                write(dev.pipe_handles[get_bucket(h)], nullptr);
+        }
+
+        endp.PipeHandle = handle;
 }
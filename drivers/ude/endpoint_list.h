@@ -41,4 +41,19 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 endpoint_ctx *find_endpoint(_In_ device_ctx &dev, _In_ const endpoint_search &crit);
 
+/*
+ * Default control pipe is not included.
+ * @return number of endpoints that were copied, the most recently inserted ones go first
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG get_endpoints(_In_ device_ctx &dev, _Out_writes_to_(cnt, return) UDECXUSBENDPOINT *endpoints, _In_ ULONG cnt);
+
+/*
+ * Must be used to change endpoint_ctx::PipeHandle.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void set_pipe_handle(_In_ device_ctx &dev, _Inout_ endpoint_ctx &endp, _In_ USBD_PIPE_HANDLE handle);
+
 } // namespace usbip
@@ -8,6 +8,7 @@
 
 #include "endpoint_list.h"
 #include "device_ioctl.h"
+#include "std_requests.h"
 
 #include <ude_filter/request.h>
 
@@ -97,7 +98,7 @@ void update_pipe_properties(_In_ device_ctx &dev, _In_ const USBD_INTERFACE_INFO
                         usb_endpoint_dir_out(endp->descriptor) ? "Out" : "In", usb_endpoint_num(endp->descriptor),
                         ptr04x(pipe.PipeHandle), ptr04x(endp->PipeHandle), endp->priority_boost);
 
-                endp->PipeHandle = pipe.PipeHandle;
+                set_pipe_handle(dev, *endp, pipe.PipeHandle);
                 // endp->interface_number = intf.InterfaceNumber;
                 // endp->alternate_setting = intf.AlternateSetting;
         }
@@ -132,16 +133,24 @@ auto select_configuration(
         }
 
         UCHAR cfg{}; // FIXME: can't pass -1 if unconfigured
+        UCHAR attributes{};
+        ULONG interfaces{}; // bitmask
 
         if (auto cd = r.ConfigurationDescriptor) { // null if unconfigured
                 cfg = cd->bConfigurationValue;
+                attributes = cd->bmAttributes;
 
                 auto intf = &r.Interface;
                 for (int i = 0; i < cd->bNumInterfaces; ++i, intf = libdrv::next(intf)) {
                         update_pipe_properties(dev, *intf);
+                        if (intf->InterfaceNumber < usb_state::MAX_INTERFACES) {
+                                interfaces |= 1UL << intf->InterfaceNumber;
+                        }
                 }
         }
 
+        on_select_configuration(dev, cfg, attributes, interfaces);
+
         pkt = device::make_set_configuration(cfg);
         return STATUS_SUCCESS;
 }
@@ -159,6 +168,7 @@ auto select_interface(
         auto &i = r.Interface;
         update_pipe_properties(dev, i);
         pkt = device::make_set_interface(i.InterfaceNumber, i.AlternateSetting);
+        on_request(dev, pkt); // @see on_success
 
         return STATUS_SUCCESS;
 }
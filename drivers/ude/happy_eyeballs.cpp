@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "happy_eyeballs.h"
+#include "trace.h"
+#include "happy_eyeballs.tmh"
+
+#include "context.h"
+#include "driver.h"
+#include "vhci_ioctl.h"
+
+#include <usbip\connect_race.h>
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * KeQueryInterruptTime is the local time of connect_race, thus a tick is 100 ns.
+ */
+enum : LONGLONG {
+        ATTEMPT_DELAY = 250*wdm::msec, // recommended value of "Connection Attempt Delay"
+        CANCEL_POLL = 100*wdm::msec, // period of WdfRequestIsCanceled checks
+};
+
+enum { MAX_ADDRESSES = 16 }; // the rest of the list is ignored
+
+inline auto now()
+{
+        return static_cast<INT64>(KeQueryInterruptTime());
+}
+
+struct attempt
+{
+        SOCKET *sock;
+        IRP *irp;
+        KEVENT completed; // @see on_connect
+        bool pending;
+};
+
+struct race_ctx
+{
+        connect_race race;
+        ADDRINFOEXW *addrs[MAX_ADDRESSES];
+        attempt attempts[MAX_ADDRESSES];
+
+        void *objects[MAX_ADDRESSES + 1]; // pending attempts and the abort event
+        int index[MAX_ADDRESSES + 1]; // of objects in attempts
+        KWAIT_BLOCK wait_blocks[MAX_ADDRESSES + 1]; // > THREAD_WAIT_OBJECTS
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void log(_In_ const ADDRINFOEXW &ai, _In_ int idx)
+{
+        if (auto &sa = *reinterpret_cast<SOCKADDR_INET*>(ai.ai_addr); sa.si_family == AF_INET) {
+                auto &v4 = sa.Ipv4;
+                TraceDbg("#%d %!IPADDR!", idx, v4.sin_addr.s_addr);
+        } else {
+                auto &v6 = sa.Ipv6;
+                TraceDbg("#%d %!BIN!", idx, WppBinary(&v6.sin6_addr, sizeof(v6.sin6_addr)));
+        }
+}
+
+/*
+ * @see Using IRPs with Winsock Kernel Functions
+ */
+_Function_class_(IO_COMPLETION_ROUTINE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS on_connect(_In_ DEVICE_OBJECT*, _In_ IRP *irp, _In_reads_opt_(_Inexpressible_("varies")) void *context)
+{
+        if (irp->PendingReturned) {
+                KeSetEvent(static_cast<KEVENT*>(context), IO_NO_INCREMENT, false);
+        }
+
+        return StopCompletion;
+}
+
+/*
+ * @return STATUS_PENDING if the event of the attempt will be set on completion
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS start(_Inout_ attempt &a, _In_ device_ctx_ext &ext, _In_ const ADDRINFOEXW &ai)
+{
+        PAGED_CODE();
+
+        if (auto err = vhci::create_socket(a.sock, ext, ai)) {
+                return err;
+        }
+
+        a.irp = IoAllocateIrp(1, false);
+        if (!a.irp) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        KeInitializeEvent(&a.completed, SynchronizationEvent, false);
+        IoSetCompletionRoutine(a.irp, on_connect, &a.completed, true, true, true);
+
+        auto st = connect(a.sock, ai.ai_addr, a.irp); // the completion routine is called anyway
+        a.pending = st == STATUS_PENDING;
+
+        return st;
+}
+
+/*
+ * Pending connect is cancelled, the socket of the loser is closed.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void stop(_Inout_ attempt &a)
+{
+        PAGED_CODE();
+
+        if (a.pending) {
+                IoCancelIrp(a.irp);
+                NT_VERIFY(!KeWaitForSingleObject(&a.completed, Executive, KernelMode, false, nullptr));
+                a.pending = false;
+        }
+
+        if (a.irp) {
+                IoFreeIrp(a.irp);
+                a.irp = nullptr;
+        }
+
+        if (a.sock) {
+                close(a.sock);
+                wsk::free(a.sock);
+        }
+}
+
+/*
+ * @return the number of objects to wait for, the abort event is the last one
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto prepare_objects(_Inout_ race_ctx &ctx, _In_opt_ KEVENT *abort)
+{
+        ULONG cnt = 0;
+
+        for (int i = 0; i < ctx.race.started; ++i) {
+                if (auto &a = ctx.attempts[i]; a.pending) {
+                        ctx.objects[cnt] = &a.completed;
+                        ctx.index[cnt++] = i;
+                }
+        }
+
+        if (abort) {
+                ctx.objects[cnt] = abort;
+                ctx.index[cnt++] = -1;
+        }
+
+        return cnt;
+}
+
+/*
+ * @return ticks to wait for completion of pending attempts, negative means infinite
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_timeout(_In_ const connect_race &r, _In_ INT64 now, _In_ bool poll, _In_ LONGLONG timeout)
+{
+        auto wait = get_wait(r, now);
+
+        auto set_min = [&wait] (auto val)
+        {
+                if (wait < 0 || val < wait) {
+                        wait = val;
+                }
+        };
+
+        if (poll) {
+                set_min(CANCEL_POLL);
+        }
+
+        if (timeout) {
+                auto left = timeout - get_latency(r, now);
+                set_min(left > 0 ? left : 0);
+        }
+
+        return wait;
+}
+
+/*
+ * @return the index of the completed attempt, -1 if aborted, -2 if timed out
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto wait(_Inout_ race_ctx &ctx, _In_opt_ KEVENT *abort, _In_ LONGLONG ticks)
+{
+        PAGED_CODE();
+
+        auto cnt = prepare_objects(ctx, abort);
+        NT_ASSERT(cnt);
+
+        auto timeout = make_timeout(ticks, wdm::period::relative);
+
+        auto st = KeWaitForMultipleObjects(cnt, ctx.objects, WaitAny, Executive, KernelMode, false,
+                                           ticks < 0 ? nullptr : &timeout, ctx.wait_blocks);
+
+        if (st == STATUS_TIMEOUT) {
+                return -2;
+        }
+
+        auto i = static_cast<ULONG>(st - STATUS_WAIT_0);
+        NT_ASSERT(i < cnt);
+
+        return ctx.index[i];
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS run(
+        _Inout_ race_ctx &ctx, _Out_ int &winner, _In_ device_ctx_ext &ext,
+        _In_opt_ KEVENT *abort, _In_opt_ WDFREQUEST request, _In_ LONGLONG timeout)
+{
+        PAGED_CODE();
+
+        auto &r = ctx.race;
+        NTSTATUS st = STATUS_HOST_UNREACHABLE; // if the list is empty
+
+        for (winner = -1; !is_lost(r); ) {
+                auto t = now();
+
+                if (request && WdfRequestIsCanceled(request)) {
+                        return STATUS_CANCELLED;
+                } else if (timeout && get_latency(r, t) >= timeout) {
+                        return STATUS_IO_TIMEOUT;
+                }
+
+                int idx;
+
+                if (!get_wait(r, t)) {
+                        idx = r.started;
+                        on_started(r, t);
+
+                        log(*ctx.addrs[idx], idx);
+                        st = start(ctx.attempts[idx], ext, *ctx.addrs[idx]);
+
+                        if (st == STATUS_PENDING) {
+                                continue;
+                        }
+                } else if (idx = wait(ctx, abort, get_timeout(r, t, bool(request), timeout)); idx == -1) {
+                        return STATUS_CANCELLED;
+                } else if (idx < 0) {
+                        continue;
+                } else {
+                        auto &a = ctx.attempts[idx];
+                        a.pending = false;
+                        st = a.irp->IoStatus.Status;
+                }
+
+                if (NT_SUCCESS(st)) {
+                        winner = idx;
+                        break;
+                }
+
+                TraceDbg("#%d %!STATUS!", idx, st);
+
+                on_failed(r);
+                stop(ctx.attempts[idx]);
+        }
+
+        return st;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::happy_eyeballs(
+        _Out_ SOCKET* &sock, _In_ device_ctx_ext &ext, _In_ ADDRINFOEXW *head,
+        _In_opt_ KEVENT *abort, _In_opt_ WDFREQUEST request, _In_ LONGLONG timeout)
+{
+        PAGED_CODE();
+        sock = nullptr;
+
+        unique_ptr ptr(NonPagedPoolNx, sizeof(race_ctx)); // KEVENT and KWAIT_BLOCK must be resident
+        if (!ptr) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate race_ctx");
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        auto &ctx = *ptr.get<race_ctx>();
+        auto &r = ctx.race;
+
+        auto total = interleave(head, ctx.addrs, ARRAYSIZE(ctx.addrs));
+        init(r, total, ATTEMPT_DELAY, now());
+
+        int winner;
+        auto st = run(ctx, winner, ext, abort, request, timeout);
+
+        if (winner >= 0) {
+                NT_ASSERT(NT_SUCCESS(st));
+                auto &a = ctx.attempts[winner];
+
+                sock = a.sock;
+                a.sock = nullptr;
+
+                Trace(TRACE_LEVEL_INFORMATION, "%!USTR!:%!USTR!, connected in %I64d ms, address #%d of %d, "
+                        "%d attempt(s) started", &ext.node_name, &ext.service_name,
+                        get_latency(r, now())/wdm::msec, winner, total, r.started);
+        } else {
+                Trace(TRACE_LEVEL_ERROR, "%!USTR!:%!USTR!, %d address(es), %d attempt(s) failed, %!STATUS!",
+                        &ext.node_name, &ext.service_name, total, r.failed, st);
+        }
+
+        for (int i = 0; i < r.started; ++i) {
+                stop(ctx.attempts[i]);
+        }
+
+        return st;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+#include <libdrv\wsk_cpp.h>
+
+namespace usbip
+{
+
+struct device_ctx_ext;
+
+/*
+ * Connects to one of the resolved addresses of the server, @see <usbip\connect_race.h>.
+ * A dead address costs the delay between attempts rather than a full TCP timeout.
+ *
+ * @param sock the socket of the winner, other attempts are cancelled
+ * @param head list of addresses, address families are interleaved
+ * @param abort the race is cancelled if the event is set
+ * @param request the race is cancelled if the request is cancelled
+ * @param timeout of the whole race in 100 ns units, zero means no timeout
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS happy_eyeballs(
+        _Out_ wsk::SOCKET* &sock, _In_ device_ctx_ext &ext, _In_ ADDRINFOEXW *head,
+        _In_opt_ KEVENT *abort, _In_opt_ WDFREQUEST request, _In_ LONGLONG timeout);
+
+} // namespace usbip
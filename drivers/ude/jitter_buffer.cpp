@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "jitter_buffer.h"
+#include "trace.h"
+#include "jitter_buffer.tmh"
+
+#include "context.h"
+#include "driver.h"
+#include "ioctl.h"
+#include "completion.h"
+#include "wsk_receive.h"
+
+#include <usbip\jitter_pacer.h>
+
+/*
+ * Completed isoch IN requests of the endpoint are held and released by the high resolution timer
+ * at the cadence of the endpoint, @see jitter_pacer.
+ * KeQueryInterruptTimePrecise is the local time, thus a tick is 100 ns.
+ */
+struct usbip::jitter_buffer
+{
+        UDECXUSBENDPOINT endpoint;
+        EX_TIMER *timer;
+        usb_device_speed speed;
+        UCHAR bInterval;
+
+        KSPIN_LOCK lock; // for the members below
+        completion_list held; // linked through request_ctx::complete_next
+        completion_list cancelling; // were taken from held, but WdfRequestUnmarkCancelable failed, @see cancel_held
+        jitter_pacer pacer;
+};
+
+namespace
+{
+
+using namespace usbip;
+
+enum { TICKS_PER_MICROFRAME = 1250 }; // 100 ns units
+
+inline auto get_time()
+{
+        ULONG64 qpc;
+        return INT64(KeQueryInterruptTimePrecise(&qpc));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_microframes(_In_ const jitter_buffer &jb, _In_ WDFREQUEST request)
+{
+        auto &r = get_urb(request).UrbIsochronousTransfer;
+        return get_isoch_microframes(jb.speed, jb.bInterval, r.NumberOfPackets);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto pop(_Inout_ completion_list &lst)
+{
+        auto req = lst.head;
+        NT_ASSERT(req);
+
+        if (!(lst.head = req->complete_next)) {
+                lst.tail = nullptr;
+        }
+        --lst.cnt;
+
+        return req;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void push(_Inout_ completion_list &lst, _In_ request_ctx *req)
+{
+        req->complete_next = nullptr;
+
+        if (lst.head) {
+                lst.tail->complete_next = req;
+        } else {
+                lst.head = req;
+        }
+
+        lst.tail = req;
+        ++lst.cnt;
+}
+
+/*
+ * @return false if the request is not in the list
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool remove(_Inout_ completion_list &lst, _In_ request_ctx *req)
+{
+        request_ctx *prev{};
+
+        for (auto cur = lst.head; cur; prev = cur, cur = cur->complete_next) {
+                if (cur != req) {
+                        continue;
+                }
+
+                (prev ? prev->complete_next : lst.head) = cur->complete_next;
+                if (lst.tail == cur) {
+                        lst.tail = prev;
+                }
+                --lst.cnt;
+
+                return true;
+        }
+
+        return false;
+}
+
+/*
+ * Must be called under the lock.
+ * The request is released only if WdfRequestUnmarkCancelable succeeded, otherwise cancel_held will complete it.
+ * @param dst where to put the released request
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void release(_Inout_ jitter_buffer &jb, _Inout_ completion_list &dst, _In_ request_ctx *req)
+{
+        auto cancelled = WdfRequestUnmarkCancelable(get_handle(req)) == STATUS_CANCELLED;
+        push(cancelled ? jb.cancelling : dst, req);
+}
+
+/*
+ * Must be called under the lock.
+ * @return requests that must be completed
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+auto take_due(_Inout_ jitter_buffer &jb, _In_ INT64 now)
+{
+        completion_list due{};
+
+        while (is_due(jb.pacer, now)) {
+                auto req = pop(jb.held);
+                on_release(jb.pacer, get_microframes(jb, get_handle(req)));
+                release(jb, due, req);
+        }
+
+        return due;
+}
+
+/*
+ * Must be called under the lock.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void set_timer(_Inout_ jitter_buffer &jb, _In_ INT64 now)
+{
+        if (auto timeout = get_timeout(jb.pacer, now); timeout >= 0) {
+                ExSetTimer(jb.timer, timeout ? -timeout : -1, 0, nullptr); // relative
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void complete_all(_In_ const completion_list &lst)
+{
+        for (auto req = lst.head; req; ) {
+                auto next = req->complete_next; // req is invalid after completion
+                usbip::complete(get_handle(req), req->complete_status);
+                req = next;
+        }
+}
+
+/*
+ * The data has been received already, but the request is completed as cancelled.
+ */
+_Function_class_(EVT_WDF_REQUEST_CANCEL)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel_held(_In_ WDFREQUEST request)
+{
+        auto req = get_request_ctx(request);
+        auto &jb = *get_endpoint_ctx(req->endpoint)->jitter;
+
+        {
+                KLOCK_QUEUE_HANDLE lck;
+                KeAcquireInStackQueuedSpinLock(&jb.lock, &lck);
+
+                if (remove(jb.held, req)) {
+                        on_cancel(jb.pacer, get_microframes(jb, request));
+                } else {
+                        NT_VERIFY(remove(jb.cancelling, req));
+                }
+
+                KeReleaseInStackQueuedSpinLock(&lck);
+        }
+
+        TraceDbg("req %04x", ptr04x(request));
+
+        get_urb(request).UrbHeader.Status = USBD_STATUS_CANCELED;
+        usbip::complete(request, STATUS_CANCELLED);
+}
+
+_Function_class_(EXT_CALLBACK)
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+void NTAPI on_timer(_In_ EX_TIMER*, _In_opt_ void *context)
+{
+        auto &jb = *static_cast<jitter_buffer*>(context);
+        completion_list due;
+
+        {
+                KLOCK_QUEUE_HANDLE lck;
+                KeAcquireInStackQueuedSpinLockAtDpcLevel(&jb.lock, &lck);
+
+                auto now = get_time();
+                due = take_due(jb, now);
+                set_timer(jb, now);
+
+                KeReleaseInStackQueuedSpinLockFromDpcLevel(&lck);
+        }
+
+        complete_all(due);
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::create_jitter_buffer(_Inout_ endpoint_ctx &endp, _In_ UDECXUSBENDPOINT endpoint, _In_ ULONG frames)
+{
+        PAGED_CODE();
+        NT_ASSERT(!endp.jitter);
+
+        auto jb = (jitter_buffer*)ExAllocatePoolZero(NonPagedPoolNx, sizeof(jitter_buffer), pooltag);
+        if (!jb) {
+                Trace(TRACE_LEVEL_ERROR, "endp %04x, can't allocate %Iu bytes", ptr04x(endpoint), sizeof(*jb));
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        endp.jitter = jb;
+
+        jb->endpoint = endpoint;
+        jb->speed = get_device_ctx(endp.device)->speed();
+        jb->bInterval = endp.descriptor.bInterval;
+
+        KeInitializeSpinLock(&jb->lock);
+        init(jb->pacer, TICKS_PER_MICROFRAME, frames*frame_clock::MICROFRAMES);
+
+        jb->timer = ExAllocateTimer(on_timer, jb, EX_TIMER_HIGH_RESOLUTION);
+        if (!jb->timer) {
+                Trace(TRACE_LEVEL_ERROR, "endp %04x, ExAllocateTimer error", ptr04x(endpoint));
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        TraceDbg("endp %04x, %lu frame(s)", ptr04x(endpoint), frames);
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::hold(_Inout_ jitter_buffer &jb, _In_ WDFREQUEST request, _In_ NTSTATUS status)
+{
+        auto req = get_request_ctx(request);
+        req->complete_status = status;
+
+        completion_list due{};
+        NTSTATUS err;
+
+        {
+                KLOCK_QUEUE_HANDLE lck;
+                KeAcquireInStackQueuedSpinLock(&jb.lock, &lck);
+
+                if (err = WdfRequestMarkCancelableEx(request, cancel_held); !err) { // cancel_held waits for the lock
+                        push(jb.held, req);
+
+                        auto now = get_time();
+                        on_hold(jb.pacer, now, get_microframes(jb, request));
+
+                        due = take_due(jb, now);
+                        set_timer(jb, now);
+                }
+
+                KeReleaseInStackQueuedSpinLock(&lck);
+        }
+
+        if (err) { // STATUS_CANCELLED
+                TraceDbg("req %04x, %!STATUS!", ptr04x(request), err);
+                get_urb(request).UrbHeader.Status = USBD_STATUS_CANCELED;
+                usbip::complete(request, err);
+        }
+
+        complete_all(due);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::flush(_Inout_ jitter_buffer &jb)
+{
+        completion_list lst{};
+
+        {
+                KLOCK_QUEUE_HANDLE lck;
+                KeAcquireInStackQueuedSpinLock(&jb.lock, &lck);
+
+                while (jb.held.head) {
+                        release(jb, lst, pop(jb.held));
+                }
+                on_flush(jb.pacer);
+
+                KeReleaseInStackQueuedSpinLock(&lck);
+        }
+
+        if (lst.head) {
+                TraceDbg("endp %04x, %lu request(s)", ptr04x(jb.endpoint), lst.cnt);
+                complete_all(lst);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::free(_In_opt_ jitter_buffer *jb)
+{
+        PAGED_CODE();
+
+        if (!jb) {
+                return;
+        }
+
+        if (auto timer = jb->timer) {
+                ExDeleteTimer(timer, true, true, nullptr); // cancel and wait for the callback
+        }
+
+        flush(*jb);
+
+        auto &st = jb->pacer.stat;
+        TraceDbg("endp %04x, held %!UINT64!, released %!UINT64!, cancelled %!UINT64!, underruns %!UINT64!, "
+                 "late %!UINT64! microframes, depth %!UINT64! avg, %lu max microframes", 
+                 ptr04x(jb->endpoint), st.held, st.released, st.cancelled, st.underruns, st.late_microframes, st.released ? st.sum_depth/st.released : 0, st.max_depth);
+
+        ExFreePoolWithTag(jb, pooltag);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv/codeseg.h>
+#include <libdrv/wdf_cpp.h>
+
+#include <usb.h>
+#include <wdfusb.h>
+#include <UdeCx.h>
+
+namespace usbip
+{
+
+struct jitter_buffer;
+struct endpoint_ctx;
+
+/*
+ * Milliseconds of isoch IN data to accumulate before completing the requests, zero disables jitter buffers.
+ * It is read from the registry on device creation.
+ * @see get_parameter
+ */
+inline constexpr auto jitter_frames_value_name = L"IsochJitterFrames";
+enum : ULONG { MAX_JITTER_FRAMES = 1000 };
+
+/*
+ * Is called for isoch IN endpoints only.
+ * @param frames milliseconds to accumulate
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS create_jitter_buffer(_Inout_ endpoint_ctx &endp, _In_ UDECXUSBENDPOINT endpoint, _In_ ULONG frames);
+
+/*
+ * The request will be completed with the status when it is due.
+ * It is cancelable while it is held.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void hold(_Inout_ jitter_buffer &jb, _In_ WDFREQUEST request, _In_ NTSTATUS status);
+
+/*
+ * Completes all held requests immediately.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void flush(_Inout_ jitter_buffer &jb);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void free(_In_opt_ jitter_buffer *jb);
+
+} // namespace usbip
@@ -21,7 +21,7 @@ using namespace usbip;
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto get_persistent_devices(_In_ WDFKEY key)
+PAGED auto get_multi_string(_In_ WDFKEY key, _In_ PCWSTR name)
 {
         PAGED_CODE();
         ObjectDelete col;
@@ -39,40 +39,62 @@ PAGED auto get_persistent_devices(_In_ WDFKEY key)
         str_attr.ParentObject = col.get();
 
         UNICODE_STRING value_name;
-        RtlUnicodeStringInit(&value_name, persistent_devices_value_name);
+        RtlUnicodeStringInit(&value_name, name);
 
         if (auto err = WdfRegistryQueryMultiString(key, &value_name, &str_attr, col.get<WDFCOLLECTION>())) {
-                Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryMultiString('%!USTR!') %!STATUS!", &value_name, err);
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND || name == persistent_devices_value_name) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryMultiString('%!USTR!') %!STATUS!", &value_name, err);
+                }
                 col.reset();
         }
 
         return col;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+inline auto get_persistent_devices(_In_ WDFKEY key)
+{
+        return get_multi_string(key, persistent_devices_value_name);
+}
+
 constexpr auto empty(_In_ const UNICODE_STRING &s)
 {
         return libdrv::empty(s) || !*s.Buffer;
 }
 
+/*
+ * @param str "host,service,busid"
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto parse_string(_Out_ vhci::ioctl::plugin_hardware &r, _In_ const UNICODE_STRING &str)
+PAGED auto split(
+        _Out_ UNICODE_STRING &host, _Out_ UNICODE_STRING &service, _Out_ UNICODE_STRING &busid, 
+        _In_ const UNICODE_STRING &str)
 {
         PAGED_CODE();
-
-        UNICODE_STRING host;
-        UNICODE_STRING service;
-        UNICODE_STRING busid;
-
         const auto sep = L',';
 
         libdrv::split(host, busid, str, sep);
         if (empty(host)) {
-                return STATUS_INVALID_PARAMETER;
+                return false;
         }
 
         libdrv::split(service, busid, busid, sep);
-        if (empty(service) || empty(busid)) {
+        return !(empty(service) || empty(busid));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto parse_string(_Out_ vhci::ioctl::plugin_hardware &r, _In_ const UNICODE_STRING &str)
+{
+        PAGED_CODE();
+
+        UNICODE_STRING host;
+        UNICODE_STRING service;
+        UNICODE_STRING busid;
+
+        if (!split(host, service, busid, str)) {
                 return STATUS_INVALID_PARAMETER;
         }
 
@@ -418,3 +440,75 @@ PAGED NTSTATUS usbip::open_parameters_key(_Out_ Registry &key, _In_ ACCESS_MASK
         key.reset(k);
         return st;
 }
+
+/*
+ * @return value of REG_DWORD from the Parameters key or default_value if it does not exist 
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG usbip::get_parameter(_In_ PCWSTR name, _In_ ULONG default_value)
+{
+        PAGED_CODE();
+
+        Registry key;
+        if (open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return default_value;
+        }
+
+        UNICODE_STRING val_name;
+        RtlUnicodeStringInit(&val_name, name);
+
+        ULONG val{};
+
+        if (auto err = WdfRegistryQueryULong(key.get(), &val_name, &val)) {
+                if (err != STATUS_OBJECT_NAME_NOT_FOUND) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRegistryQueryULong(%!USTR!) %!STATUS!", &val_name, err);
+                }
+                return default_value;
+        }
+
+        TraceDbg("%!USTR! = %lu", &val_name, val);
+        return val;
+}
+
+/*
+ * Strings are compared case-insensitively.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool usbip::contains_device(_In_ PCWSTR name, _In_ const device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        Registry key;
+        if (open_parameters_key(key, KEY_QUERY_VALUE)) {
+                return false;
+        }
+
+        auto col = get_multi_string(key.get(), name);
+        if (!col) {
+                return false;
+        }
+
+        for (ULONG i = 0, cnt = WdfCollectionGetCount(col.get<WDFCOLLECTION>()); i < cnt; ++i) {
+                auto item = (WDFSTRING)WdfCollectionGetItem(col.get<WDFCOLLECTION>(), i);
+
+                UNICODE_STRING str{};
+                WdfStringGetUnicodeString(item, &str);
+
+                UNICODE_STRING host;
+                UNICODE_STRING service;
+                UNICODE_STRING busid;
+
+                if (!split(host, service, busid, str)) {
+                        Trace(TRACE_LEVEL_ERROR, "%S: malformed '%!USTR!'", name, &str);
+                } else if (RtlEqualUnicodeString(&host, &ext.node_name, true) &&
+                           RtlEqualUnicodeString(&service, &ext.service_name, true) &&
+                           RtlEqualUnicodeString(&busid, &ext.busid, true)) {
+                        TraceDbg("%S contains '%!USTR!'", name, &str);
+                        return true;
+                }
+        }
+
+        return false;
+}
@@ -12,11 +12,24 @@ namespace usbip
 
 struct vhci_ctx;
 struct device_ctx;
+struct device_ctx_ext;
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS open_parameters_key(_Out_ Registry &key, _In_ ACCESS_MASK DesiredAccess);
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG get_parameter(_In_ PCWSTR name, _In_ ULONG default_value);
+
+/*
+ * @param name of REG_MULTI_SZ value in the Parameters key, the format of its strings is "host,service,busid"
+ * @return true if the device is in the list
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool contains_device(_In_ PCWSTR name, _In_ const device_ctx_ext &ext);
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS copy(
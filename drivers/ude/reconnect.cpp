@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "reconnect.h"
+#include "trace.h"
+#include "reconnect.tmh"
+
+#include "context.h"
+#include "vhci.h"
+#include "vhci_ioctl.h"
+#include "network.h"
+#include "device_ioctl.h"
+#include "std_requests.h"
+#include "happy_eyeballs.h"
+
+#include <usbip\proto_op.h>
+#include <libdrv\wait_timeout.h>
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * KeQueryInterruptTime is the local time of device_ctx::reconnect, thus a tick is 100 ns.
+ */
+enum : LONGLONG {
+        MIN_DELAY = 250*wdm::msec, // between attempts
+        MAX_DELAY = 8*wdm::second,
+        CONNECT_TIMEOUT = 5*wdm::second, // of all connection attempts to the resolved addresses
+        LAST_CONNECT_TIMEOUT = wdm::second, // of the attempt at the end of the grace period
+};
+
+inline auto now()
+{
+        return static_cast<INT64>(KeQueryInterruptTime());
+}
+
+/*
+ * @return true if detach has started
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto wait_abort(_In_ device_ctx &dev, _In_ LONGLONG ticks)
+{
+        PAGED_CODE();
+
+        auto timeout = make_timeout(ticks, wdm::period::relative);
+        return KeWaitForSingleObject(&dev.reconnect_abort, Executive, KernelMode, false, &timeout) != STATUS_TIMEOUT;
+}
+
+/*
+ * The socket of the attempt can be closed by abort_reconnect while it is published.
+ * @return false if detach has started and the socket was not published
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto set_attempt_sock(_Inout_ device_ctx &dev, _In_opt_ SOCKET *sock)
+{
+        PAGED_CODE();
+        wdf::WaitLock lck(dev.reconnect_lock);
+
+        if (sock && dev.unplugged) {
+                return false;
+        }
+
+        dev.attempt_sock = sock;
+        return true;
+}
+
+/*
+ * The same device must be exported, its devid is changed if the server has re-enumerated it.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto is_same_device(_In_ const vhci::imported_device_properties &d, _In_ const usbip_usb_device &udev)
+{
+        return  d.speed == static_cast<usb_device_speed>(udev.speed) &&
+                d.vendor == udev.idVendor &&
+                d.product == udev.idProduct;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS import_device(_In_ device_ctx &dev, _In_ SOCKET *sock, _Out_ usbip_usb_device &udev)
+{
+        PAGED_CODE();
+        auto &ext = *dev.ext;
+
+        if (auto err = vhci::import_remote_device(sock, ext, udev)) {
+                return err;
+        }
+
+        if (!is_same_device(ext.dev, udev)) {
+                Trace(TRACE_LEVEL_ERROR, "Another device is exported as busid %!USTR!, vid %#x, pid %#x",
+                                          &ext.busid, udev.idVendor, udev.idProduct);
+                return USBIP_ERROR_ST_NODEV;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * The socket of the lost session stays in device_ctx::retired_sock.
+ * @return false if detach has started, it closes device_ctx_ext::sock
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto adopt(_Inout_ device_ctx &dev, _In_ SOCKET *sock, _In_ const usbip_usb_device &udev)
+{
+        PAGED_CODE();
+        auto &ext = *dev.ext;
+
+        wdf::WaitLock lck(dev.reconnect_lock);
+        if (dev.unplugged) {
+                return false;
+        }
+
+        ext.dev.devid = make_devid(static_cast<UINT16>(udev.busnum), static_cast<UINT16>(udev.devnum));
+        InterlockedExchangePointer(reinterpret_cast<PVOID*>(&ext.sock), sock);
+
+        return true;
+}
+
+/*
+ * The address of the server is resolved again, it could be changed.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS attempt(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+        auto &ext = *dev.ext;
+
+        ADDRINFOEXW hints {
+                .ai_flags = AI_NUMERICSERV,
+                .ai_family = AF_UNSPEC,
+                .ai_socktype = SOCK_STREAM,
+                .ai_protocol = IPPROTO_TCP
+        };
+
+        ADDRINFOEXW *head{};
+        if (auto err = wsk::getaddrinfo(head, &ext.node_name, &ext.service_name, &hints)) {
+                TraceDbg("getaddrinfo %!STATUS!", err);
+                return err;
+        }
+
+        SOCKET *sock{};
+        usbip_usb_device udev;
+
+        auto timeout = get_attempt_timeout(dev.reconnect, now(), CONNECT_TIMEOUT, LAST_CONNECT_TIMEOUT); // not zero
+
+        auto st = happy_eyeballs(sock, ext, head, &dev.reconnect_abort, WDF_NO_HANDLE, timeout);
+
+        if (st) {
+                //
+        } else if (!set_attempt_sock(dev, sock)) {
+                st = STATUS_CANCELLED;
+        } else {
+                st = import_device(dev, sock, udev);
+                NT_VERIFY(set_attempt_sock(dev, nullptr));
+        }
+
+        if (st) {
+                //
+        } else if (!adopt(dev, sock, udev)) {
+                st = STATUS_CANCELLED;
+        } else {
+                sock = nullptr;
+        }
+
+        if (sock) {
+                close(sock); // can be closed by abort_reconnect already
+                wsk::free(sock);
+        }
+
+        wsk::free(head);
+        return st;
+}
+
+/*
+ * The server could reset the device when the connection was lost.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void restore_configuration(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        auto st = get_usb_state(dev);
+        if (!(st.config_known && st.configuration)) {
+                return;
+        }
+
+        device::set_configuration(device, WDF_NO_HANDLE, st.configuration);
+
+        for (UCHAR intf = 0; intf < usb_state::MAX_INTERFACES; ++intf) {
+                if (auto alt = st.alt_settings[intf]; alt && (st.alt_known & (1UL << intf))) {
+                        device::set_interface(device, WDF_NO_HANDLE, intf, alt);
+                }
+        }
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::init_reconnect(_Inout_ device_ctx &dev, _In_ ULONG grace, _In_ bool retry)
+{
+        PAGED_CODE();
+
+        init(dev.reconnect, grace*wdm::second, MIN_DELAY, MAX_DELAY);
+        dev.retry_requests = retry;
+}
+
+/*
+ * New requests are parked while reconnecting, requests that were sent over the lost connection
+ * are failed or parked too, @see device::withdraw_requests.
+ * Parked requests are resubmitted when a new session is established.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::device::reconnect(_In_ UDECXUSBDEVICE device)
+{
+        PAGED_CODE();
+
+        auto &dev = *get_device_ctx(device);
+        auto &r = dev.reconnect;
+
+        if (dev.unplugged || !on_lost(r, now())) {
+                return STATUS_NOT_SUPPORTED;
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, connection lost, reconnecting to %!USTR!:%!USTR!/%!USTR!",
+                ptr04x(device), &dev.ext->node_name, &dev.ext->service_name, &dev.ext->busid);
+
+        dev.reconnecting = true;
+
+        if (close_socket(dev.sock())) {
+                device_state_changed(dev, vhci::state::disconnected);
+        }
+
+        wsk::free(dev.retired_sock); // of the previous loss, it was replaced a whole session ago
+        dev.retired_sock = dev.sock(); // is retained alive for concurrent senders, @see close_socket
+
+        withdraw_requests(device, dev.retry_requests);
+        device_state_changed(dev, vhci::state::connecting);
+
+        auto st = run(r, STATUS_CANCELLED, now,
+                [&dev] (auto ticks) { return !(dev.unplugged || (ticks && wait_abort(dev, ticks))); },
+                [&dev] { return attempt(dev); });
+
+        if (st) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, %!UINT64! attempt(s) failed, %!STATUS!",
+                                          ptr04x(device), r.stat.attempts, st);
+                cancel_parked(device, WDF_NO_HANDLE); // the device will be detached
+                return st;
+        }
+
+        device_state_changed(dev, vhci::state::connected);
+
+        withdraw_requests(device, dev.retry_requests); // were sent before the loss was noticed
+        restore_configuration(device, dev);
+
+        auto cnt = reconnected(device);
+        device_state_changed(dev, vhci::state::plugged);
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, reconnected in %I64d ms, %lu request(s) resubmitted",
+                                        ptr04x(device), r.stat.last_latency/wdm::msec, cnt);
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * device_ctx_ext::sock can't be replaced after return.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool usbip::device::abort_reconnect(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+        NT_ASSERT(dev.unplugged);
+
+        KeSetEvent(&dev.reconnect_abort, IO_NO_INCREMENT, false);
+
+        wdf::WaitLock lck(dev.reconnect_lock);
+
+        if (auto sock = dev.attempt_sock) {
+                close_socket(sock); // pending connect or receive will fail
+        }
+
+        return dev.sock() == dev.retired_sock;
+}
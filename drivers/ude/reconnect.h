@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv/codeseg.h>
+#include <libdrv/wdf_cpp.h>
+
+#include <usb.h>
+#include <wdfusb.h>
+#include <UdeCx.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+
+/*
+ * Seconds the device stays plugged after the connection to the server was lost, zero disables reconnect.
+ * Reconnect is supported for recv_mode::thread only.
+ * It is read from the registry on device creation.
+ * @see get_parameter
+ */
+inline constexpr auto reconnect_grace_value_name = L"ReconnectGraceSeconds";
+enum : ULONG { MAX_RECONNECT_GRACE = 3600 };
+
+/*
+ * Non-zero to send requests of IN endpoints again over the new connection, otherwise they are failed.
+ * @see device::withdraw_requests
+ */
+inline constexpr auto reconnect_retry_value_name = L"ReconnectRetryRequests";
+
+/*
+ * @param grace in seconds
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void init_reconnect(_Inout_ device_ctx &dev, _In_ ULONG grace, _In_ bool retry);
+
+} // namespace usbip
+
+
+namespace usbip::device
+{
+
+/*
+ * Is called by the receive thread if the connection to the server was lost.
+ * @return STATUS_SUCCESS if a new session was established and receiving must be continued,
+ *         otherwise the device must be detached
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS reconnect(_In_ UDECXUSBDEVICE device);
+
+/*
+ * Is called by detach, interrupts reconnect if it is in progress.
+ * @return true if the socket of the device was closed by reconnect
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool abort_reconnect(_Inout_ device_ctx &dev);
+
+} // namespace usbip::device
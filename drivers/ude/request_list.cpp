@@ -15,21 +15,200 @@ namespace
 
 using namespace usbip;
 
+static_assert(!(device_ctx::REQUESTS_BUCKETS & (device_ctx::REQUESTS_BUCKETS - 1)));
+static_assert(!(device_ctx::REQUESTS_LOCKS & (device_ctx::REQUESTS_LOCKS - 1)));
+static_assert(device_ctx::REQUESTS_LOCKS <= device_ctx::REQUESTS_BUCKETS);
+
+/*
+ * Sequential seqnums of in-flight requests fall into different buckets.
+ * @see tests/request_list_bench.cpp
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto matches(_In_ WDFREQUEST request, _In_ const request_ctx &req, _In_ const device::request_search &crit)
+inline auto bucket_idx(_In_ seqnum_t seqnum)
 {
-        switch (crit.what) {
-        case crit.SEQNUM:
-                return crit.seqnum == req.seqnum;
-        case crit.REQUEST:
-                return crit.request == request;
-        case crit.ENDPOINT:
-                return crit.endpoint == req.endpoint;
+        return get_seqnum_bucket(seqnum, device_ctx::REQUESTS_BUCKETS);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& bucket(_In_ device_ctx &dev, _In_ seqnum_t seqnum)
+{
+        return dev.requests[bucket_idx(seqnum)];
+}
+
+/*
+ * Adjacent buckets are protected by different locks, thus sequential seqnums do too.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto lock_idx(_In_ seqnum_t seqnum)
+{
+        return bucket_idx(seqnum) & (device_ctx::REQUESTS_LOCKS - 1);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto bucket_lock(_In_ device_ctx &dev, _In_ seqnum_t seqnum)
+{
+        return dev.requests_locks[lock_idx(seqnum)];
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& bucket_lock_stat(_In_ device_ctx &dev, _In_ seqnum_t seqnum)
+{
+        return dev.requests_locks_stat[lock_idx(seqnum)];
+}
+
+/*
+ * The same as wdf::Lock, but accounts the time the lock was held.
+ * The statistics is updated before the release, it belongs to this lock only and does not need atomics.
+ * Lock order is device_ctx::requests_locks -> endpoint_ctx::requests_lock.
+ */
+class TimedLock
+{
+public:
+        _IRQL_requires_max_(DISPATCH_LEVEL)
+        _IRQL_raises_(DISPATCH_LEVEL)
+        TimedLock(_Inout_ lock_stat &stat, _In_ WDFSPINLOCK lock) : m_stat(stat), m_lock(lock)
+        {
+                WdfSpinLockAcquire(m_lock);
+                m_start = KeQueryPerformanceCounter(nullptr).QuadPart;
+        }
+
+        _IRQL_requires_max_(DISPATCH_LEVEL)
+        _IRQL_requires_min_(DISPATCH_LEVEL)
+        ~TimedLock()
+        {
+                auto ticks = KeQueryPerformanceCounter(nullptr).QuadPart - m_start;
+
+                ++m_stat.acquisitions;
+                m_stat.hold_ticks += ticks;
+                if (ticks > m_stat.max_hold_ticks) {
+                        m_stat.max_hold_ticks = ticks;
+                }
+
+                WdfSpinLockRelease(m_lock);
+        }
+
+        TimedLock(_In_ const TimedLock&) = delete;
+        TimedLock& operator =(_In_ const TimedLock&) = delete;
+
+private:
+        lock_stat &m_stat;
+        WDFSPINLOCK m_lock;
+        LONG64 m_start;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto find_by_seqnum(_In_ device_ctx &dev, _In_ seqnum_t seqnum) -> request_ctx*
+{
+        for (auto head = &bucket(dev, seqnum), entry = head->Flink; entry != head; entry = entry->Flink) {
+                if (auto req = CONTAINING_RECORD(entry, request_ctx, entry); req->seqnum == seqnum) {
+                        return req;
+                }
         }
 
-        Trace(TRACE_LEVEL_ERROR, "Invalid union member selector %d", crit.what);
-        return false;
+        return nullptr;
+}
+
+/*
+ * If request is already completed, its context must be used for address comparison only.
+ * Its seqnum is not trusted, thus the request is always searched by address.
+ * @param seqnum was read from the context before acquiring the lock of its bucket
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto find_by_request(_In_ device_ctx &dev, _In_ WDFREQUEST request, _In_ seqnum_t seqnum) -> request_ctx*
+{
+        auto target = get_request_ctx(request);
+
+        for (auto head = &bucket(dev, seqnum), entry = head->Flink; entry != head; entry = entry->Flink) {
+                if (CONTAINING_RECORD(entry, request_ctx, entry) == target) {
+                        return target;
+                }
+        }
+
+        return nullptr;
+}
+
+/*
+ * @return zero if the endpoint has no requests
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto first_seqnum(_In_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint)
+{
+        auto &endp = *get_endpoint_ctx(endpoint);
+        auto head = &endp.requests;
+
+        TimedLock lck(endp.requests_lock_stat, endp.requests_lock);
+        return IsListEmpty(head) ? 0 : CONTAINING_RECORD(head->Flink, request_ctx, endpoint_entry)->seqnum;
+}
+
+/*
+ * The lock of the bucket must be held.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void unlink(_Inout_ device_ctx &dev, _Inout_ request_ctx &req)
+{
+        RemoveEntryList(&req.entry);
+
+        {
+                auto &endp = *get_endpoint_ctx(req.endpoint);
+                TimedLock lck(endp.requests_lock_stat, endp.requests_lock);
+                RemoveEntryList(&req.endpoint_entry);
+        }
+
+        NT_VERIFY(InterlockedDecrement(&dev.requests_cnt) >= 0);
+}
+
+/*
+ * The lock of the bucket must be held.
+ * @return WDF_NO_HANDLE if EvtRequestCancel will be called for the request
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+WDFREQUEST remove(_Inout_ device_ctx &dev, _Inout_ request_ctx &req, _In_ bool unmark_cancelable)
+{
+        auto request = get_handle(&req);
+        unlink(dev, req);
+
+        if (!(unmark_cancelable && req.cancelable)) {
+                // not required
+        } else if (auto ret = WdfRequestUnmarkCancelable(request)) {
+                TraceDbg("%04x, unmark cancelable %!STATUS!", ptr04x(request), ret);
+                if (ret == STATUS_CANCELLED) {
+                        request = WDF_NO_HANDLE;
+                } // else EvtRequestCancel will not be called
+        }
+
+        return request;
+}
+
+/*
+ * The lock of endpoint_ctx::requests is not held while searching in buckets, otherwise lock order will be violated.
+ * A request is found by seqnum again under the lock of its bucket, it could be removed concurrently.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+WDFREQUEST remove_by_endpoint(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ bool unmark_cancelable)
+{
+        while (auto seqnum = first_seqnum(dev, endpoint)) {
+
+                TimedLock lck(bucket_lock_stat(dev, seqnum), bucket_lock(dev, seqnum));
+
+                if (auto req = find_by_seqnum(dev, seqnum); req && req->endpoint == endpoint) {
+                        if (auto request = remove(dev, *req, unmark_cancelable)) {
+                                return request;
+                        }
+                }
+        }
+
+        return WDF_NO_HANDLE;
 }
 
 _Function_class_(EVT_WDF_REQUEST_CANCEL)
@@ -62,8 +241,17 @@ void usbip::device::append_request(_Inout_ device_ctx &dev, _In_ const wsk_conte
         req.seqnum = wsk.hdr.seqnum;
         NT_ASSERT(is_valid_seqnum(req.seqnum));
 
-        wdf::Lock lck(dev.requests_lock);
-        InsertTailList(&dev.requests, &req.entry);
+        auto &endp = *get_endpoint_ctx(endpoint);
+
+        TimedLock lck(bucket_lock_stat(dev, req.seqnum), bucket_lock(dev, req.seqnum));
+        InsertTailList(&bucket(dev, req.seqnum), &req.entry);
+
+        {
+                TimedLock lck_endp(endp.requests_lock_stat, endp.requests_lock);
+                InsertTailList(&endp.requests, &req.endpoint_entry);
+        }
+
+        InterlockedIncrement(&dev.requests_cnt);
 }
 
 /*
@@ -78,21 +266,17 @@ NTSTATUS usbip::device::mark_request_cancelable(_Inout_ device_ctx &dev, _In_ se
 {
         NT_ASSERT(is_valid_seqnum(seqnum));
 
-        wdf::Lock lck(dev.requests_lock);
-
-        for (auto head = &dev.requests, entry = head->Flink; entry != head; entry = entry->Flink) {
+        TimedLock lck(bucket_lock_stat(dev, seqnum), bucket_lock(dev, seqnum));
 
-                if (auto req = CONTAINING_RECORD(entry, request_ctx, entry); req->seqnum != seqnum) {
-                        // continue;
-                } else if (auto request = get_handle(req); auto err = WdfRequestMarkCancelableEx(request, cancel_request)) {
-                        TraceDbg("%04x, %!STATUS!", ptr04x(request), err);
-                        RemoveEntryList(entry);
-                        return err; // must do the same as cancel_request after that
-                } else {
-                        req->cancelable = true;
-                        ++dev.cancelable_requests;
-                        break;
-                }
+        if (auto req = find_by_seqnum(dev, seqnum); !req) {
+                // already removed
+        } else if (auto request = get_handle(req); auto err = WdfRequestMarkCancelableEx(request, cancel_request)) {
+                TraceDbg("%04x, %!STATUS!", ptr04x(request), err);
+                unlink(dev, *req);
+                return err; // must do the same as cancel_request after that
+        } else {
+                req->cancelable = true;
+                InterlockedIncrement64(&dev.cancelable_requests);
         }
 
         return STATUS_SUCCESS;
@@ -106,34 +290,28 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 WDFREQUEST usbip::device::remove_request(
         _In_ device_ctx &dev, _In_ const request_search &crit, _In_ bool unmark_cancelable)
 {
-        wdf::Lock lck(dev.requests_lock);
-
-        for (auto head = &dev.requests, entry = head->Flink; entry != head; entry = entry->Flink) {
+        seqnum_t seqnum{};
 
-                auto req = CONTAINING_RECORD(entry, request_ctx, entry);
-                auto request = get_handle(req);
-
-                if (!matches(request, *req, crit)) {
-                        continue;
-                }
-
-                RemoveEntryList(entry);
-
-                if (!(unmark_cancelable && req->cancelable)) {
-                        // not required
-                } else if (auto ret = WdfRequestUnmarkCancelable(request)) {
-                        TraceDbg("%04x, unmark cancelable %!STATUS!", ptr04x(request), ret);
-                        if (ret != STATUS_CANCELLED) {
-                                // EvtRequestCancel will not be called
-                        } else if (crit.multimatch()) {
-                                continue;
-                        } else {
-                                request = WDF_NO_HANDLE;
-                        }
-                }
+        switch (crit.what) {
+        case crit.SEQNUM:
+                seqnum = crit.seqnum;
+                break;
+        case crit.REQUEST:
+                seqnum = get_request_ctx(crit.request)->seqnum;
+                break;
+        case crit.ENDPOINT:
+                return remove_by_endpoint(dev, crit.endpoint, unmark_cancelable);
+        default:
+                Trace(TRACE_LEVEL_ERROR, "Invalid union member selector %d", crit.what);
+                return WDF_NO_HANDLE;
+        }
 
-                return request;
+        if (!is_valid_seqnum(seqnum)) {
+                return WDF_NO_HANDLE;
         }
 
-        return WDF_NO_HANDLE;
+        TimedLock lck(bucket_lock_stat(dev, seqnum), bucket_lock(dev, seqnum));
+
+        auto req = crit.what == crit.SEQNUM ? find_by_seqnum(dev, seqnum) : find_by_request(dev, crit.request, seqnum);
+        return req ? remove(dev, *req, unmark_cancelable) : WDF_NO_HANDLE;
 }
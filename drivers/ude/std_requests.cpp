@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "std_requests.h"
+#include "trace.h"
+#include "std_requests.tmh"
+
+#include "context.h"
+
+#include <usbip\usb_state.h>
+#include <libdrv\usbd_helper.h>
+
+namespace
+{
+
+using namespace usbip;
+
+inline auto& as_setup(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        static_assert(sizeof(usb_setup) == sizeof(pkt));
+        return reinterpret_cast<const usb_setup&>(pkt);
+}
+
+/*
+ * RAII for device_ctx::std_state_lock.
+ */
+class StateLock
+{
+public:
+        _IRQL_requires_max_(DISPATCH_LEVEL)
+        StateLock(_Inout_ device_ctx &dev) { KeAcquireInStackQueuedSpinLock(&dev.std_state_lock, &m_lck); }
+
+        _IRQL_requires_(DISPATCH_LEVEL)
+        ~StateLock() { KeReleaseInStackQueuedSpinLock(&m_lck); }
+
+        StateLock(const StateLock&) = delete;
+        StateLock& operator=(const StateLock&) = delete;
+
+private:
+        KLOCK_QUEUE_HANDLE m_lck;
+};
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::init_usb_state(_Inout_ device_ctx &dev)
+{
+        KeInitializeSpinLock(&dev.std_state_lock);
+        dev.std_state = {};
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::on_select_configuration(
+        _Inout_ device_ctx &dev, _In_ UCHAR ConfigurationValue, _In_ UCHAR bmAttributes, _In_ ULONG interfaces)
+{
+        StateLock lck(dev);
+        usbip::on_select_configuration(dev.std_state, ConfigurationValue, bmAttributes, interfaces);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::on_request(_Inout_ device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        if (is_transfer_dir_out(pkt)) { // only they change the state
+                StateLock lck(dev);
+                usbip::on_request(dev.std_state, as_setup(pkt));
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::on_success(_Inout_ device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        if (is_transfer_dir_out(pkt)) {
+                StateLock lck(dev);
+                usbip::on_success(dev.std_state, as_setup(pkt));
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::on_error(_Inout_ device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        if (is_transfer_dir_out(pkt)) {
+                StateLock lck(dev);
+                usbip::on_error(dev.std_state, as_setup(pkt));
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::forget_usb_state(_Inout_ device_ctx &dev)
+{
+        StateLock lck(dev);
+        forget(dev.std_state);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+usbip::usb_state usbip::get_usb_state(_Inout_ device_ctx &dev)
+{
+        StateLock lck(dev);
+        return dev.std_state;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::answer_locally(
+        _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        if (!(is_transfer_dir_in(pkt) && pkt.bmRequestType.Type == BMREQUEST_STANDARD && pkt.wLength <= 2)) {
+                return STATUS_PENDING;
+        }
+
+        UCHAR *buf{};
+        ULONG buf_len{};
+
+        if (UdecxUrbRetrieveBuffer(request, &buf, &buf_len) || buf_len < pkt.wLength) {
+                return STATUS_PENDING;
+        }
+
+        UINT8 answer[2]{};
+        UINT16 len{};
+
+        {
+                StateLock lck(dev);
+                len = usbip::answer(dev.std_state, as_setup(pkt), dev.speed() >= USB_SPEED_SUPER, answer);
+        }
+
+        if (!len) {
+                return STATUS_PENDING;
+        }
+
+        RtlCopyMemory(buf, answer, len);
+        UdecxUrbSetBytesCompleted(request, len);
+        traffic_saved(dev, len);
+
+        TraceUrb("req %04x, bRequest %d, wIndex %d <- %!BIN!", ptr04x(request), pkt.bRequest, pkt.wIndex.W, 
+                  WppBinary(answer, len));
+
+        return STATUS_SUCCESS;
+}
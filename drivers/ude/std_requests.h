@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv/codeseg.h>
+#include <libdrv/wdf_cpp.h>
+
+#include <usbspec.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+struct usb_state;
+
+/*
+ * Standard requests GET_CONFIGURATION, GET_INTERFACE and GET_STATUS are answered locally 
+ * if the tracked state of the device is authoritative, @see usb_state.
+ */
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void init_usb_state(_Inout_ device_ctx &dev);
+
+/*
+ * SELECT_CONFIGURATION is being sent as SET_CONFIGURATION.
+ * @param interfaces bitmask of interface numbers of the configuration
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void on_select_configuration(
+        _Inout_ device_ctx &dev, _In_ UCHAR ConfigurationValue, _In_ UCHAR bmAttributes, _In_ ULONG interfaces);
+
+/*
+ * A control transfer is being sent to the device, including SELECT_INTERFACE as SET_INTERFACE.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void on_request(_Inout_ device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt);
+
+/*
+ * The server has completed a control transfer successfully.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void on_success(_Inout_ device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt);
+
+/*
+ * The server has completed a control transfer with an error.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void on_error(_Inout_ device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt);
+
+/*
+ * The state of the device is unknown, for example, after a reset.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void forget_usb_state(_Inout_ device_ctx &dev);
+
+/*
+ * @return a copy of the tracked state
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+usb_state get_usb_state(_Inout_ device_ctx &dev);
+
+/*
+ * @return STATUS_PENDING if the request must be sent to the server
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS answer_locally(_Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt);
+
+} // namespace usbip
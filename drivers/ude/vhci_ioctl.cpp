@@ -12,6 +12,8 @@
 #include "network.h"
 #include "ioctl.h"
 #include "persistent.h"
+#include "wsk_events.h"
+#include "happy_eyeballs.h"
 
 #include <usbip\proto_op.h>
 
@@ -30,7 +32,7 @@ using namespace usbip;
 static_assert(sizeof(vhci::imported_device_location::service) == NI_MAXSERV);
 static_assert(sizeof(vhci::imported_device_location::host) == NI_MAXHOST);
 
-enum { ARG_INFO, ARG_FUNCTION, ARG_AI }; // the fourth parameter is used by WSK subsystem
+enum { ARG_INFO, ARG_FUNCTION }; // the fourth parameter is used by WSK subsystem
 
 struct workitem_ctx
 {
@@ -44,14 +46,13 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(workitem_ctx, get_workitem_ctx)
 
 _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
-PAGED auto set_args(_In_ WDFREQUEST request, _In_ const char *function, _In_opt_ const ADDRINFOEXW *ai = nullptr)
+PAGED auto set_args(_In_ WDFREQUEST request, _In_ const char *function)
 {
         PAGED_CODE();
         auto irp = WdfRequestWdmGetIrp(request);
 
         libdrv::argv<ARG_INFO>(irp) = reinterpret_cast<void*>(WdfRequestGetInformation(request)); // backup
         libdrv::argv<ARG_FUNCTION>(irp) = const_cast<char*>(function);
-        libdrv::argv<ARG_AI>(irp) = const_cast<ADDRINFOEXW*>(ai);
 
         return irp;
 }
@@ -75,7 +76,7 @@ PAGED void log(_In_ const usbip_usb_device &d)
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto send_req_import(_In_ device_ctx_ext &ext)
+PAGED auto send_req_import(_In_ SOCKET *sock, _In_ const device_ctx_ext &ext)
 {
         PAGED_CODE();
 
@@ -94,21 +95,22 @@ PAGED auto send_req_import(_In_ device_ctx_ext &ext)
         byteswap(req.hdr);
         byteswap(req.body);
 
-        return send(ext.sock, memory::stack, &req, sizeof(req));
+        return send(sock, memory::stack, &req, sizeof(req));
 }
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED NTSTATUS recv_rep_import(_In_ device_ctx_ext &ext, _In_ memory pool, _Out_ op_import_reply &reply)
+PAGED NTSTATUS recv_rep_import(
+        _In_ SOCKET *sock, _In_ const device_ctx_ext &ext, _In_ memory pool, _Out_ op_import_reply &reply)
 {
         PAGED_CODE();
         RtlZeroMemory(&reply, sizeof(reply));
 
-        if (auto err = recv_op_common(ext.sock, OP_REP_IMPORT)) {
+        if (auto err = recv_op_common(sock, OP_REP_IMPORT)) {
                 return err;
         }
 
-        if (auto err = recv(ext.sock, pool, &reply, sizeof(reply))) {
+        if (auto err = recv(sock, pool, &reply, sizeof(reply))) {
                 Trace(TRACE_LEVEL_ERROR, "Receive op_import_reply %!STATUS!", err);
                 return err;
         }
@@ -132,18 +134,10 @@ PAGED auto import_remote_device(_Inout_ device_ctx_ext &ext)
 {
         PAGED_CODE();
 
-        if (auto err = send_req_import(ext)) {
-                Trace(TRACE_LEVEL_ERROR, "Send OP_REQ_IMPORT %!STATUS!", err);
-                return err;
-        }
-
-        op_import_reply reply;
-        if (auto err = recv_rep_import(ext, memory::stack, reply)) {
+        usbip_usb_device udev;
+        if (auto err = vhci::import_remote_device(ext.sock, ext, udev)) {
                 return err;
         }
- 
-        auto &udev = reply.udev; 
-        log(udev);
 
         if (auto d = &ext.dev) {
                 d->devid = make_devid(static_cast<UINT16>(udev.busnum), static_cast<UINT16>(udev.devnum));
@@ -177,6 +171,8 @@ PAGED NTSTATUS plugin(_Out_ int &port, _In_ UDECXUSBDEVICE device)
         auto &portnum = speed < USB_SPEED_SUPER ? options.Usb20PortNumber : options.Usb30PortNumber;
         portnum = port;
 
+        dev.plugin_time = KeQueryPerformanceCounter(nullptr).QuadPart; // @see device_ctx::enum_ticks
+
         if (auto err = UdecxUsbDevicePlugIn(device, &options)) {
                 Trace(TRACE_LEVEL_ERROR, "UdecxUsbDevicePlugIn %!STATUS!", err);
                 return err;
@@ -195,7 +191,7 @@ PAGED auto start_device(_Out_ int &port, _In_ UDECXUSBDEVICE device)
                 return err;
         }
 
-        return device::recv_thread_start(device);
+        return get_device_ctx(device)->recv_events ? recv_events_start(device) : device::recv_thread_start(device);
 }
 
 /*
@@ -297,87 +293,22 @@ NTSTATUS irp_complete(
         return StopCompletion;
 }
 
+/*
+ * Attempts to connect to all resolved addresses are staggered, @see happy_eyeballs.
+ * The workitem is blocked till the race is over, the request is checked for cancellation meanwhile.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto create_socket(_Inout_ wsk::SOCKET* &sock, _In_ const ADDRINFOEXW &ai)
-{
-        PAGED_CODE();
-        NT_ASSERT(!sock);
-
-        if (auto err = socket(sock, static_cast<ADDRESS_FAMILY>(ai.ai_family), 
-                                static_cast<USHORT>(ai.ai_socktype), ai.ai_protocol, 
-                                WSK_FLAG_CONNECTION_SOCKET, nullptr, nullptr)) {
-                NT_ASSERT(!sock);
-                Trace(TRACE_LEVEL_ERROR, "socket %!STATUS!", err);
-                return err;
-        }
-
-        if (auto err = set_options(sock)) {
-                return err;
-        }
-
-        SOCKADDR_INET any { // see INADDR_ANY, IN6ADDR_ANY_INIT
-                .si_family = static_cast<ADDRESS_FAMILY>(ai.ai_family)
-        };
-
-        if (auto err = bind(sock, reinterpret_cast<SOCKADDR*>(&any))) {
-                Trace(TRACE_LEVEL_ERROR, "bind %!STATUS!", err);
-                return err;
-        }
-
-        return STATUS_SUCCESS;
-}
-
-_IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto connect(
-        _In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ wsk::SOCKET* &sock, _In_ const ADDRINFOEXW &ai)
+PAGED auto connect(_In_ WDFREQUEST request, _Inout_ workitem_ctx &ctx)
 {
         PAGED_CODE();
+        auto &ext = *ctx.ext;
 
-        if (auto &sa = *reinterpret_cast<SOCKADDR_INET*>(ai.ai_addr); sa.si_family == AF_INET) {
-                auto &v4 = sa.Ipv4;
-                TraceDbg("%!IPADDR!", v4.sin_addr.s_addr);
-        } else {
-                auto &v6 = sa.Ipv6;
-                TraceDbg("%!BIN!", WppBinary(&v6.sin6_addr, sizeof(v6.sin6_addr)));
-        }
-
-        if (auto err = create_socket(sock, ai)) {
+        if (auto err = happy_eyeballs(ext.sock, ext, ctx.addrinfo, nullptr, request, 0)) {
                 return err;
         }
 
-        auto irp = set_args(request, __func__, &ai);
-        IoSetCompletionRoutine(irp, irp_complete, wi, true, true, true);
-
-        auto st = connect(sock, ai.ai_addr, irp); // completion handler will be called anyway
-        TraceDbg("%!STATUS!", st);
-
-        return STATUS_PENDING;
-}
-
-_IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto on_connect(
-        _In_ WDFREQUEST request, _In_ WDFWORKITEM wi, _Inout_ device_ctx_ext* &ext, _In_ const ADDRINFOEXW &ai)
-{
-        PAGED_CODE();
-
-        auto st = WdfRequestGetStatus(request);
-
-        if (NT_SUCCESS(st)) {
-                st = connected(request, ext);
-                NT_ASSERT(st != STATUS_PENDING);
-        } else {
-                NT_VERIFY(NT_SUCCESS(close(ext->sock)));
-                free(ext->sock);
-
-                if (st != STATUS_CANCELLED && ai.ai_next) {
-                        st = connect(request, wi, ext->sock, *ai.ai_next);
-                }
-        }
-
-        return st;
+        return connected(request, ctx.ext);
 }
 
 _Function_class_(EVT_WDF_WORKITEM)
@@ -397,18 +328,15 @@ PAGED void NTAPI complete(_In_ WDFWORKITEM wi)
         auto st = WdfRequestGetStatus(request);
         TraceDbg("%s %!STATUS!", function, st);
 
-        if (auto ai = libdrv::argv<ADDRINFOEXW*, ARG_AI>(irp)) {
-                st = on_connect(request, wi, ctx.ext, *ai);
-        } else if (NT_SUCCESS(st)) { // on_addrinfo
+        if (NT_SUCCESS(st)) { // on_addrinfo
                 NT_ASSERT(ctx.addrinfo);
-                st = connect(request, wi, ctx.ext->sock, *ctx.addrinfo);
+                st = connect(request, ctx);
+                NT_ASSERT(st != STATUS_PENDING);
         }
 
-        if (st != STATUS_PENDING) {
-                TraceDbg("req %04x, %!STATUS!", ptr04x(request), st);
-                WdfRequestComplete(request, st);
-                WdfObjectDelete(wi); // do not use ctx.request more, see workitem_cleanup
-        }
+        TraceDbg("req %04x, %!STATUS!", ptr04x(request), st);
+        WdfRequestComplete(request, st);
+        WdfObjectDelete(wi); // do not use ctx.request more, see workitem_cleanup
 }
 
 /*
@@ -848,6 +776,63 @@ PAGED void device_read(_In_ WDFQUEUE queue, _In_ WDFREQUEST request, _In_ size_t
 } // namespace
 
 
+/*
+ * Event callbacks are disabled by default, @see recv_events_start.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::vhci::create_socket(_Inout_ SOCKET* &sock, _In_ device_ctx_ext &ext, _In_ const ADDRINFOEXW &ai)
+{
+        PAGED_CODE();
+        NT_ASSERT(!sock);
+
+        if (auto err = socket(sock, static_cast<ADDRESS_FAMILY>(ai.ai_family), 
+                                static_cast<USHORT>(ai.ai_socktype), ai.ai_protocol, 
+                                WSK_FLAG_CONNECTION_SOCKET, &ext, &recv_events_dispatch)) {
+                NT_ASSERT(!sock);
+                Trace(TRACE_LEVEL_ERROR, "socket %!STATUS!", err);
+                return err;
+        }
+
+        if (auto err = set_options(sock)) {
+                return err;
+        }
+
+        SOCKADDR_INET any { // see INADDR_ANY, IN6ADDR_ANY_INIT
+                .si_family = static_cast<ADDRESS_FAMILY>(ai.ai_family)
+        };
+
+        if (auto err = bind(sock, reinterpret_cast<SOCKADDR*>(&any))) {
+                Trace(TRACE_LEVEL_ERROR, "bind %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::vhci::import_remote_device(
+        _In_ SOCKET *sock, _In_ const device_ctx_ext &ext, _Out_ usbip_usb_device &udev)
+{
+        PAGED_CODE();
+
+        if (auto err = send_req_import(sock, ext)) {
+                Trace(TRACE_LEVEL_ERROR, "Send OP_REQ_IMPORT %!STATUS!", err);
+                return err;
+        }
+
+        op_import_reply reply;
+        if (auto err = recv_rep_import(sock, ext, memory::stack, reply)) {
+                return err;
+        }
+
+        udev = reply.udev;
+        log(udev);
+
+        return STATUS_SUCCESS;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS usbip::vhci::create_queues(_In_ WDFDEVICE vhci)
@@ -6,6 +6,15 @@
 
 #include <libdrv/codeseg.h>
 #include <libdrv/wdf_cpp.h>
+#include <libdrv/wsk_cpp.h>
+
+struct usbip_usb_device;
+
+namespace usbip
+{
+        struct device_ctx_ext;
+} // namespace usbip
+
 
 namespace usbip::vhci
 {
@@ -14,4 +23,21 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS create_queues(_In_ WDFDEVICE vhci);
 
+/*
+ * Creates a socket that is bound, but not connected.
+ * The socket must be closed and freed even if an error is returned.
+ * @param ext is passed to event callbacks of the socket
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS create_socket(_Inout_ wsk::SOCKET* &sock, _In_ device_ctx_ext &ext, _In_ const ADDRINFOEXW &ai);
+
+/*
+ * Sends OP_REQ_IMPORT for ext.busid over the connected socket and receives OP_REP_IMPORT.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS import_remote_device(
+        _In_ wsk::SOCKET *sock, _In_ const device_ctx_ext &ext, _Out_ usbip_usb_device &udev);
+
 } // namespace usbip::vhci
@@ -13,9 +13,35 @@ namespace
 
 using namespace usbip;
 
+/*
+ * Contexts are size-classed by the number of preallocated isoc descriptors,
+ * this avoids their reallocation if audio and video streams are mixed.
+ */
+struct lookaside
+{
+        LOOKASIDE_LIST_EX list;
+        ULONG packets; // preallocated isoc descriptors, mdl_isoc is built for them
+
+        // statistics
+        LONG64 allocs;
+        LONG64 misses; // allocate_function_ex calls
+};
+
+const ULONG isoc_classes[] { 0, 32, 128, max_iso_packets };
+lookaside g_lookaside[ARRAYSIZE(isoc_classes)];
+
 ULONG g_tag;
 bool g_initialized;
-LOOKASIDE_LIST_EX g_lookaside;
+LONG64 g_isoc_reallocs; // by prepare_isoc
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_isoc_class(_In_ ULONG NumberOfPackets)
+{
+        UCHAR i = 0;
+        for ( ; i < ARRAYSIZE(isoc_classes) - 1 && isoc_classes[i] < NumberOfPackets; ++i);
+        return i;
+}
 
 _IRQL_requires_same_
 _Function_class_(free_function_ex)
@@ -28,6 +54,9 @@ void free_function_ex(_In_ __drv_freesMem(Mem) void *Buffer, _Inout_ LOOKASIDE_L
 
         ctx->mdl_hdr.reset();
         ctx->mdl_buf.reset();
+        ctx->mdl_inline_part.reset();
+        ctx->mdl_inline.reset();
+        ctx->mdl_isoc_part.reset();
         ctx->mdl_isoc.reset();
 
         if (auto irp = ctx->wsk_irp) {
@@ -48,12 +77,17 @@ void *allocate_function_ex(_In_ POOL_TYPE PoolType, _In_ SIZE_T NumberOfBytes, _
         NT_ASSERT(PoolType == NonPagedPoolNx);
         NT_ASSERT(Tag == g_tag);
 
+        auto &la = *CONTAINING_RECORD(list, lookaside, list);
+        InterlockedIncrement64(&la.misses);
+
         auto ctx = (wsk_context*)ExAllocatePoolZero(PoolType, NumberOfBytes, Tag);
         if (!ctx) {
                 Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", NumberOfBytes);
                 return nullptr;
         }
 
+        ctx->isoc_class = static_cast<UCHAR>(&la - g_lookaside);
+
         ctx->mdl_hdr = Mdl(&ctx->hdr, sizeof(ctx->hdr));
 
         if (auto err = ctx->mdl_hdr.prepare_nonpaged()) {
@@ -62,6 +96,21 @@ void *allocate_function_ex(_In_ POOL_TYPE PoolType, _In_ SIZE_T NumberOfBytes, _
                 return nullptr;
         }
 
+        ctx->mdl_inline = Mdl(ctx->inline_buf, sizeof(ctx->inline_buf));
+
+        if (auto err = ctx->mdl_inline.prepare_nonpaged()) {
+                Trace(TRACE_LEVEL_ERROR, "mdl_inline %!STATUS!", err);
+                free_function_ex(ctx, list);
+                return nullptr;
+        }
+
+        ctx->mdl_inline_part = Mdl(ctx->inline_buf, sizeof(ctx->inline_buf));
+        if (!ctx->mdl_inline_part) {
+                Trace(TRACE_LEVEL_ERROR, "mdl_inline_part -> NULL");
+                free_function_ex(ctx, list);
+                return nullptr;
+        }
+
         ctx->wsk_irp = IoAllocateIrp(1, false);
         if (!ctx->wsk_irp) {
                 Trace(TRACE_LEVEL_ERROR, "IoAllocateIrp -> NULL");
@@ -69,7 +118,13 @@ void *allocate_function_ex(_In_ POOL_TYPE PoolType, _In_ SIZE_T NumberOfBytes, _
                 return nullptr;
         }
 
-        TraceWSK("%04x", ptr04x(ctx));
+        if (auto err = prepare_isoc(*ctx, la.packets)) {
+                Trace(TRACE_LEVEL_ERROR, "isoc[%lu] %!STATUS!", la.packets, err);
+                free_function_ex(ctx, list);
+                return nullptr;
+        }
+
+        TraceWSK("%04x, isoc[%lu]", ptr04x(ctx), la.packets);
         return ctx;
 }
 
@@ -81,13 +136,16 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto alloc_wsk_context(_In_ ULONG NumberOfPackets)
 {
-        auto ctx = (wsk_context*)ExAllocateFromLookasideListEx(&g_lookaside);
+        auto &la = g_lookaside[get_isoc_class(NumberOfPackets)];
+        InterlockedIncrement64(&la.allocs);
+
+        auto ctx = (wsk_context*)ExAllocateFromLookasideListEx(&la.list);
 
         if (!ctx) {
                 Trace(TRACE_LEVEL_ERROR, "ExAllocateFromLookasideListEx error");
         } else if (auto err = prepare_isoc(*ctx, NumberOfPackets)) {
                 Trace(TRACE_LEVEL_ERROR, "prepare_isoc(NumberOfPackets %lu) %!STATUS!", NumberOfPackets, err);
-                free_function_ex(ctx, &g_lookaside);
+                free_function_ex(ctx, &la.list);
                 ctx = nullptr;
         }
 
@@ -110,21 +168,45 @@ NTSTATUS usbip::init_wsk_context_list(_In_ ULONG tag)
         }
 
         g_tag = tag;
-        auto err = ExInitializeLookasideListEx(&g_lookaside, allocate_function_ex, free_function_ex, 
-                                               NonPagedPoolNx, 0, sizeof(wsk_context), tag, 0);
+        g_isoc_reallocs = 0;
+
+        for (int i = 0; i < int(ARRAYSIZE(g_lookaside)); ++i) {
+                auto &la = g_lookaside[i];
+
+                la.packets = isoc_classes[i];
+                la.allocs = 0;
+                la.misses = 0;
 
-        g_initialized = !err;
-        return err;
+                if (auto err = ExInitializeLookasideListEx(&la.list, allocate_function_ex, free_function_ex, 
+                                                           NonPagedPoolNx, 0, sizeof(wsk_context), tag, 0)) {
+                        while (--i >= 0) {
+                                ExDeleteLookasideListEx(&g_lookaside[i].list);
+                        }
+                        return err;
+                }
+        }
+
+        g_initialized = true;
+        return STATUS_SUCCESS;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void usbip::delete_wsk_context_list()
 {
-        if (g_initialized) {
-                ExDeleteLookasideListEx(&g_lookaside);
-                g_initialized = false;
+        if (!g_initialized) {
+                return;
         }
+
+        for (auto &la: g_lookaside) {
+                Trace(TRACE_LEVEL_INFORMATION, "isoc[%lu]: %!UINT64! allocations, %!UINT64! misses", 
+                        la.packets, UINT64(la.allocs), UINT64(la.misses));
+
+                ExDeleteLookasideListEx(&la.list);
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "%!UINT64! reallocations of isoc", UINT64(g_isoc_reallocs));
+        g_initialized = false;
 }
 
 _IRQL_requires_same_
@@ -160,7 +242,7 @@ void usbip::free(_In_opt_ wsk_context *ctx, _In_ bool reuse_irp)
                 IoReuseIrp(ctx->wsk_irp, STATUS_SUCCESS);
         }
 
-        ExFreeToLookasideListEx(&g_lookaside, ctx);
+        ExFreeToLookasideListEx(&g_lookaside[ctx->isoc_class].list, ctx);
 }
 
 _IRQL_requires_same_
@@ -177,6 +259,10 @@ NTSTATUS usbip::prepare_isoc(_In_ wsk_context &ctx, _In_ ULONG NumberOfPackets)
         ULONG isoc_len = NumberOfPackets*sizeof(*ctx.isoc);
 
         if (ctx.isoc_alloc_cnt < NumberOfPackets) {
+                if (ctx.isoc) {
+                        InterlockedIncrement64(&g_isoc_reallocs);
+                }
+
                 auto isoc = (iso_packet_descriptor*)ExAllocatePoolZero(NonPagedPoolNx, isoc_len, g_tag);
                 if (!isoc) {
                         return STATUS_INSUFFICIENT_RESOURCES;
@@ -189,17 +275,33 @@ NTSTATUS usbip::prepare_isoc(_In_ wsk_context &ctx, _In_ ULONG NumberOfPackets)
                 ctx.isoc = isoc;
                 ctx.isoc_alloc_cnt = NumberOfPackets;
 
+                ctx.mdl_isoc_part.reset();
                 ctx.mdl_isoc.reset();
         }
 
-        if (ctx.mdl_isoc.size() != isoc_len) {
-                ctx.mdl_isoc = Mdl(ctx.isoc, isoc_len);
+        if (!ctx.mdl_isoc_part) { // is built last
+                ULONG alloc_len = ctx.isoc_alloc_cnt*sizeof(*ctx.isoc);
+
+                ctx.mdl_isoc = Mdl(ctx.isoc, alloc_len);
                 if (auto err = ctx.mdl_isoc.prepare_nonpaged()) {
                         return err;
                 }
-                NT_ASSERT(number_of_packets(ctx) == NumberOfPackets);
+
+                ctx.mdl_isoc_part = Mdl(ctx.isoc, alloc_len);
+                if (!ctx.mdl_isoc_part) {
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                }
+        }
+
+        ctx.is_isoc_part = ctx.mdl_isoc.size() != isoc_len;
+
+        if (ctx.is_isoc_part) {
+                auto part = ctx.mdl_isoc_part.get();
+                MmPrepareMdlForReuse(part);
+                IoBuildPartialMdl(ctx.mdl_isoc.get(), part, ctx.isoc, isoc_len);
         }
 
+        NT_ASSERT(number_of_packets(ctx) == NumberOfPackets);
         return STATUS_SUCCESS;
 }
 
@@ -8,20 +8,31 @@
 
 #include <usbip\proto.h>
 #include <libdrv\mdl_cpp.h>
+#include <libdrv\wsk_cpp.h>
 
 namespace usbip
 {
 
 struct device_ctx;
 
+/*
+ * Short OUT payloads are copied to wsk_context::inline_buf, @see device_ctx::inline_max.
+ */
+enum : ULONG { INLINE_BUF_SIZE = 256 };
+inline constexpr auto inline_max_value_name = L"InlineSendMax";
+
 struct wsk_context
 {
+        SLIST_ENTRY send_entry; // for device_ctx::send_queue, must be aligned on MEMORY_ALLOCATION_ALIGNMENT
         device_ctx *dev; // UDECXUSBDEVICE can be obtained from WDFREQUEST, but it is optional
 
         // transient data
 
         WDFREQUEST request; // can be WDF_NO_HANDLE
         Mdl mdl_buf; // describes URB_FROM_IRP()->TransferBuffer(MDL)
+        WSK_BUF send_buf; // for WskSend
+        wsk_context *batch_next; // next PDU sent by the same WskSend
+        bool urgent; // is sent ahead of other PDUs, @see device_ioctl.cpp, is_urgent
 
         // preallocated data
 
@@ -30,10 +41,17 @@ struct wsk_context
         Mdl mdl_hdr;
         usbip::header hdr;
 
-        Mdl mdl_isoc;
+        Mdl mdl_inline; // describes inline_buf
+        Mdl mdl_inline_part; // partial MDL of mdl_inline for the copied payload, it is reused
+        UCHAR inline_buf[INLINE_BUF_SIZE];
+
+        Mdl mdl_isoc; // describes all isoc_alloc_cnt descriptors
+        Mdl mdl_isoc_part; // partial MDL of mdl_isoc for fewer packets, it is reused
         iso_packet_descriptor *isoc;
         ULONG isoc_alloc_cnt;
+        UCHAR isoc_class; // index of the lookaside list
         bool is_isoc;
+        bool is_isoc_part; // mdl_isoc_part is used
 };
 
 
@@ -59,11 +77,18 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS prepare_isoc(_In_ wsk_context &ctx, _In_ ULONG NumberOfPackets);
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& get_isoc_mdl(_In_ const wsk_context &ctx)
+{
+        return ctx.is_isoc_part ? ctx.mdl_isoc_part : ctx.mdl_isoc;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 inline auto number_of_packets(_In_ const wsk_context &ctx)
 {
-        return ctx.mdl_isoc.size()/sizeof(*ctx.isoc);
+        return get_isoc_mdl(ctx).size()/sizeof(*ctx.isoc);
 }
 
 class wsk_context_ptr 
@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "wsk_events.h"
+#include "trace.h"
+#include "wsk_events.tmh"
+
+#include "context.h"
+#include "wsk_context.h"
+#include "wsk_receive.h"
+#include "device.h"
+#include "driver.h"
+
+#include <libdrv\wsk_cpp.h>
+#include <libdrv\irp.h>
+
+/*
+ * Data indications are always retained and parsed in place by the workitem on PASSIVE_LEVEL
+ * because completion of URBs requires it. The payload is copied right from the buffers
+ * of the transport into URB transfer buffer and isoc descriptors, @see consume.
+ * Retained data indications apply backpressure to the server.
+ */
+struct usbip::event_receiver
+{
+        UDECXUSBDEVICE device;
+        WDFWORKITEM workitem; // parses the stream
+        recv_engine engine;
+
+        KSPIN_LOCK lock; // for the members below
+        WSK_DATA_INDICATION *retained; // head
+        WSK_DATA_INDICATION *retained_tail;
+        bool parsing; // the workitem can run concurrently with itself if it was enqueued again
+        bool stopped; // do not accept data anymore
+        bool failed; // the stream is broken, discard all data
+};
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * @param f is called for each buffer of each data indication in the list
+ */
+template<typename F>
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS for_each_buffer(_In_opt_ WSK_DATA_INDICATION *di, _In_ F &&f)
+{
+        for ( ; di; di = di->Next) {
+
+                auto &buf = di->Buffer;
+                auto offset = buf.Offset;
+
+                for (auto mdl = buf.Mdl, len = buf.Length; len; mdl = mdl->Next, offset = 0) {
+                        NT_ASSERT(mdl);
+
+                        auto ptr = static_cast<char*>(MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute));
+                        if (!ptr) {
+                                return STATUS_INSUFFICIENT_RESOURCES;
+                        }
+
+                        auto cnt = min(SIZE_T(MmGetMdlByteCount(mdl) - offset), len);
+
+                        if (auto err = f(ptr + offset, cnt)) {
+                                return err;
+                        }
+
+                        len -= cnt;
+                }
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+auto retain(_Inout_ event_receiver &r, _In_ WSK_DATA_INDICATION *di)
+{
+        KLOCK_QUEUE_HANDLE lck;
+        KeAcquireInStackQueuedSpinLockAtDpcLevel(&r.lock, &lck);
+
+        auto ok = !r.stopped;
+
+        if (ok) {
+                if (r.retained) {
+                        r.retained_tail->Next = di;
+                } else {
+                        r.retained = di;
+                }
+                r.retained_tail = wsk::tail(di);
+        }
+
+        KeReleaseInStackQueuedSpinLockFromDpcLevel(&lck);
+        return ok;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_receiver(_In_ void *SocketContext)
+{
+        auto &ext = *static_cast<device_ctx_ext*>(SocketContext);
+        return ext.ctx ? ext.ctx->events : nullptr;
+}
+
+/*
+ * @param DataIndication is NULL if the remote has gracefully disconnected
+ */
+_Function_class_(PFN_WSK_RECEIVE_EVENT)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS WSKAPI on_receive(
+        _In_opt_ void *SocketContext, _In_ ULONG Flags,
+        _In_opt_ WSK_DATA_INDICATION *DataIndication, _In_ SIZE_T BytesIndicated, _Inout_ SIZE_T *BytesAccepted)
+{
+        auto r = get_receiver(SocketContext);
+        if (!r) {
+                return STATUS_DATA_NOT_ACCEPTED;
+        }
+
+        if (char buf[wsk::RECEIVE_EVENT_FLAGS_BUFBZ]; !DataIndication) {
+                TraceWSK("dev %04x, %s, disconnected", ptr04x(r->device),
+                          wsk::ReceiveEventFlags(buf, sizeof(buf), Flags));
+
+                device::async_detach_nowait(r->device);
+                return STATUS_SUCCESS;
+        } else {
+                TraceWSK("dev %04x, %s, BytesIndicated %Iu", ptr04x(r->device),
+                          wsk::ReceiveEventFlags(buf, sizeof(buf), Flags), BytesIndicated);
+        }
+
+        {
+                libdrv::RaiseIrql lvl(DISPATCH_LEVEL); // Flags & WSK_FLAG_AT_DISPATCH_LEVEL is not always set
+                if (!retain(*r, DataIndication)) {
+                        return STATUS_DATA_NOT_ACCEPTED;
+                }
+        }
+
+        WdfWorkItemEnqueue(r->workitem);
+        return STATUS_PENDING;
+}
+
+_Function_class_(PFN_WSK_DISCONNECT_EVENT)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS WSKAPI on_disconnect(_In_opt_ void *SocketContext, _In_ ULONG Flags)
+{
+        if (auto r = get_receiver(SocketContext)) {
+                TraceWSK("dev %04x, Flags %#lx", ptr04x(r->device), Flags);
+                device::async_detach_nowait(r->device);
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * @return retained data indications, the order is preserved
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto take(_Inout_ event_receiver &r, _In_ bool first)
+{
+        PAGED_CODE();
+
+        KLOCK_QUEUE_HANDLE lck;
+        KeAcquireInStackQueuedSpinLock(&r.lock, &lck);
+
+        WSK_DATA_INDICATION *di{};
+
+        if (first && r.parsing) {
+                // another instance of the workitem will parse them
+        } else if ((di = r.retained) != nullptr) {
+                r.retained = r.retained_tail = nullptr;
+                r.parsing = true;
+        } else {
+                r.parsing = false;
+        }
+
+        KeReleaseInStackQueuedSpinLock(&lck);
+        return di;
+}
+
+/*
+ * Data indications are released in one call after all their buffers were consumed.
+ * If the stream is broken, the data is discarded.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto parse(_Inout_ event_receiver &r)
+{
+        PAGED_CODE();
+
+        auto &dev = *get_device_ctx(r.device);
+        NTSTATUS st{};
+
+        for (auto first = true; auto di = take(r, first); first = false) {
+
+                if (!(st || r.failed)) {
+                        auto start = KeQueryPerformanceCounter(nullptr).QuadPart;
+                        st = for_each_buffer(di, [&r] (auto ptr, auto len) { return consume(r.engine, ptr, len); });
+                        dev.recv_ticks += KeQueryPerformanceCounter(nullptr).QuadPart - start;
+
+                        submit(dev, r.engine.completed);
+                }
+
+                NT_VERIFY(NT_SUCCESS(wsk::release(dev.sock(), di)));
+        }
+
+        return st;
+}
+
+_Function_class_(EVT_WDF_WORKITEM)
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+PAGED void NTAPI parse_workitem(_In_ WDFWORKITEM wi)
+{
+        PAGED_CODE();
+
+        auto device = static_cast<UDECXUSBDEVICE>(WdfWorkItemGetParentObject(wi));
+        auto &r = *get_device_ctx(device)->events;
+
+        if (auto err = parse(r)) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, %!STATUS!", ptr04x(device), err);
+                r.failed = true;
+                device::async_detach_nowait(device);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto create_workitem(_Out_ WDFWORKITEM &wi, _In_ UDECXUSBDEVICE device)
+{
+        PAGED_CODE();
+
+        WDF_WORKITEM_CONFIG cfg;
+        WDF_WORKITEM_CONFIG_INIT(&cfg, parse_workitem);
+        cfg.AutomaticSerialization = false;
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = device;
+
+        if (auto err = WdfWorkItemCreate(&cfg, &attr, &wi)) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, WdfWorkItemCreate %!STATUS!", ptr04x(device), err);
+                wi = WDF_NO_HANDLE;
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+} // namespace
+
+
+const WSK_CLIENT_CONNECTION_DISPATCH usbip::recv_events_dispatch
+{
+        .WskReceiveEvent = on_receive,
+        .WskDisconnectEvent = on_disconnect,
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::recv_events_start(_In_ UDECXUSBDEVICE device)
+{
+        PAGED_CODE();
+        auto &dev = *get_device_ctx(device);
+
+        NT_ASSERT(!dev.events);
+        auto r = (event_receiver*)ExAllocatePoolZero(NonPagedPoolNx, sizeof(event_receiver), pooltag);
+        if (!r) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, can't allocate %Iu bytes", ptr04x(device), sizeof(*r));
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        dev.events = r;
+
+        r->device = device;
+        KeInitializeSpinLock(&r->lock);
+
+        if (auto err = create_workitem(r->workitem, device)) {
+                return err;
+        }
+
+        r->engine.ctx = alloc_wsk_context(&dev, WDF_NO_HANDLE);
+        if (!r->engine.ctx) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        if (auto err = event_callback_control(dev.sock(), WSK_EVENT_RECEIVE | WSK_EVENT_DISCONNECT, false)) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, event_callback_control %!STATUS!", ptr04x(device), err);
+                return err;
+        }
+
+        TraceDbg("dev %04x", ptr04x(device));
+        return STATUS_SUCCESS;
+}
+
+/*
+ * Must be called before closing the socket because retained data indications must be released.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::recv_events_stop(_In_ UDECXUSBDEVICE device)
+{
+        PAGED_CODE();
+
+        auto &dev = *get_device_ctx(device);
+        auto r = dev.events;
+
+        if (!r) {
+                return;
+        }
+
+        for (auto event: {WSK_EVENT_RECEIVE, WSK_EVENT_DISCONNECT}) {
+                if (auto err = event_callback_control(dev.sock(), WSK_EVENT_DISABLE | event, true)) {
+                        Trace(TRACE_LEVEL_ERROR, "dev %04x, disable event %#x, %!STATUS!", ptr04x(device), event, err);
+                }
+        }
+
+        {
+                KLOCK_QUEUE_HANDLE lck;
+                KeAcquireInStackQueuedSpinLock(&r->lock, &lck);
+                r->stopped = true;
+                KeReleaseInStackQueuedSpinLock(&lck);
+        }
+
+        if (auto wi = r->workitem) {
+                WdfWorkItemFlush(wi); // parses and releases retained data indications
+        }
+
+        if (auto di = r->retained) { // the workitem was not created
+                r->retained = r->retained_tail = nullptr;
+                NT_VERIFY(NT_SUCCESS(wsk::release(dev.sock(), di)));
+        }
+
+        if (auto ctx = r->engine.ctx) {
+                cancel(r->engine, STATUS_CANCELLED);
+                free(ctx, true);
+                r->engine.ctx = nullptr;
+        }
+
+        flush_completion(dev);
+
+        TraceDbg("dev %04x", ptr04x(device));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::free(_In_opt_ event_receiver *r)
+{
+        if (r) {
+                NT_ASSERT(!r->engine.ctx);
+                ExFreePoolWithTag(r, pooltag);
+        }
+}
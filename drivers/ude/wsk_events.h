@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv/codeseg.h>
+#include <libdrv/wdf_cpp.h>
+
+#include <usb.h>
+#include <wdfusb.h>
+#include <UdeCx.h>
+#include <wsk.h>
+
+namespace usbip
+{
+
+struct event_receiver;
+
+/*
+ * Receive mode, it is read from the registry on device creation.
+ * @see get_parameter
+ */
+enum class recv_mode { thread, events };
+inline constexpr auto recv_mode_value_name = L"ReceiveMode";
+
+/*
+ * REG_MULTI_SZ, devices "host,service,busid" that use the other receive mode than recv_mode_value_name.
+ * @see contains_device
+ */
+inline constexpr auto recv_mode_devices_value_name = L"ReceiveModeDevices";
+
+/*
+ * Is passed to WskSocket, event callbacks are disabled until recv_events_start.
+ * SocketContext must be device_ctx_ext*.
+ */
+extern const WSK_CLIENT_CONNECTION_DISPATCH recv_events_dispatch;
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS recv_events_start(_In_ UDECXUSBDEVICE device);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void recv_events_stop(_In_ UDECXUSBDEVICE device);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free(_In_opt_ event_receiver *r);
+
+} // namespace usbip
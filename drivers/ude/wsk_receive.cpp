@@ -13,12 +13,16 @@
 #include "network.h"
 #include "driver.h"
 #include "ioctl.h"
+#include "std_requests.h"
+#include "device_ioctl.h"
+#include "reconnect.h"
 
 #include <libdrv\usbd_helper.h>
 #include <libdrv\dbgcommon.h>
 #include <libdrv\usbdsc.h>
 #include <libdrv\irp.h>
-#include <libdrv\pdu.h>
+#include <usbip\pdu.h>
+#include <usbip\move_run.h>
 #include <libdrv\ch9.h>
 
 extern "C" {
@@ -30,6 +34,11 @@ namespace
 
 using namespace usbip;
 
+enum : ULONG { 
+	RECV_BUF_SIZE = 64*1024, // for recv_chunk, allocated once per receive thread
+	RECV_DIRECT_MIN = 4*1024, // the rest of payload is received directly into URB if not less
+};
+
 constexpr auto check(_In_ ULONG TransferBufferLength, _In_ int actual_length)
 {
 	return  actual_length >= 0 && static_cast<ULONG>(actual_length) <= TransferBufferLength ? 
@@ -177,6 +186,8 @@ PAGED auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer
 	NT_ASSERT(length <= r.TransferBufferLength);
 	auto dir_out = !buffer;
 
+	move_run run{};
+
 	for (auto i = LONG64(r.NumberOfPackets) - 1; i >= 0; --i) { // set dd.Status and dd.Length
 
 		auto sd = src + i;
@@ -221,13 +232,14 @@ PAGED auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer
 			return STATUS_INVALID_PARAMETER;
 		}
 
-		if (dd->Offset > length) {
-			RtlMoveMemory(buffer + dd->Offset, buffer + length, sd->actual_length);
-		}
-
+		move(buffer, run, length, dd->Offset, sd->actual_length);
 		dd->Length = sd->actual_length;
 	}
 
+	if (!dir_out) {
+		flush(buffer, run);
+	}
+
 	if (length && !dir_out) {
 		Trace(TRACE_LEVEL_ERROR, "SUM(actual_length) != actual_length, delta is %lu", length);
 		return STATUS_INVALID_PARAMETER; 
@@ -236,6 +248,23 @@ PAGED auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer
 	return STATUS_SUCCESS;
 }
 
+/*
+ * The transfer is completed by the server after its last packet.
+ * @return number of frames the transfer spans
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+PAGED auto get_isoch_frames(_In_ const wsk_context &ctx, _In_ ULONG number_of_packets)
+{
+	PAGED_CODE();
+
+	auto &d = get_endpoint_ctx(get_request_ctx(ctx.request)->endpoint)->descriptor;
+	auto interval = 1UL << (min(max(d.bInterval, 1), 16) - 1); // frames or microframes
+
+	auto n = number_of_packets*interval; // full-speed bInterval is in microframes, @see fix_full_speed_endpoint_interval
+	return ctx.dev->speed() < USB_SPEED_FULL ? n : n/frame_clock::MICROFRAMES;
+}
+
 /*
  * Layout: transfer buffer(IN only), usbip_iso_packet_descriptor[].
  */
@@ -253,8 +282,16 @@ PAGED auto isoch_transfer(_In_ wsk_context &ctx, _In_ const header_ret_submit &r
 		r.Hdr.Status = USBD_STATUS_ISOCH_REQUEST_FAILED;
 	}
 
-	if (r.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) {
-		r.StartFrame = ret.start_frame;
+	{
+		auto &clock = ctx.dev->clock;
+		auto t = clock_now();
+		auto start_frame = from_server_frame(UINT32(ret.start_frame), usb_device_speed(ctx.dev->speed()));
+
+		sync(clock, t, start_frame + get_isoch_frames(ctx, r.NumberOfPackets));
+
+		if (r.TransferFlags & USBD_START_ISO_TRANSFER_ASAP) {
+			r.StartFrame = to_clock_frame(clock, start_frame, t);
+		}
 	}
 
 	if (cnt >= 0 && ULONG(cnt) == r.NumberOfPackets) {
@@ -280,16 +317,16 @@ PAGED auto isoch_transfer(_In_ wsk_context &ctx, _In_ const header_ret_submit &r
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void complete_and_set_null(_Inout_ WDFREQUEST &request, _In_ NTSTATUS status)
+PAGED void complete_and_set_null(_Inout_ recv_engine &e, _Inout_ WDFREQUEST &request, _In_ NTSTATUS status)
 {
 	PAGED_CODE();
-	complete(request, status);
+	complete(*e.ctx->dev, e.completed, request, status);
 	request = WDF_NO_HANDLE;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void post_control_transfer(_In_ const device_ctx &dev, _In_ const _URB_CONTROL_TRANSFER &r, _In_ void *TransferBuffer)
+PAGED void post_control_transfer(_Inout_ device_ctx &dev, _In_ const _URB_CONTROL_TRANSFER &r, _In_ void *TransferBuffer)
 {
 	PAGED_CODE();
 
@@ -327,11 +364,15 @@ PAGED void post_control_transfer(_In_ const device_ctx &dev, _In_ const _URB_CON
 		}
 		break;
 	}
+
+	if (USBD_SUCCESS(r.Hdr.Status)) {
+		insert(dev.descriptors, get_setup_packet(r), dsc, dsc_len); // after fix_full_speed_endpoint_interval
+	}
 }
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void post_process_transfer_buffer(_In_ const device_ctx &dev, _In_ const URB &urb, _In_ void *TransferBuffer)
+PAGED void post_process_transfer_buffer(_Inout_ device_ctx &dev, _In_ const URB &urb, _In_ void *TransferBuffer)
 {
 	PAGED_CODE();
 
@@ -350,6 +391,14 @@ PAGED auto ret_submit_urb(_Inout_ wsk_context &ctx, _In_ const header_ret_submit
 	PAGED_CODE();
 	urb.UrbHeader.Status = ret.status ? to_windows_status(ret.status) : USBD_STATUS_SUCCESS;
 
+	if (auto f = urb.UrbHeader.Function; f == URB_FUNCTION_CONTROL_TRANSFER || f == URB_FUNCTION_CONTROL_TRANSFER_EX) {
+		if (auto &pkt = get_setup_packet(urb.UrbControlTransfer); ret.status) { // @see answer_locally
+			on_error(*ctx.dev, pkt);
+		} else {
+			on_success(*ctx.dev, pkt);
+		}
+	}
+
 	if (is_isoch(urb)) {
 		return isoch_transfer(ctx, ret, urb);
 	}
@@ -384,6 +433,10 @@ PAGED auto ret_submit(_Inout_ wsk_context &ctx)
 	auto &ret = get_ret_submit(ctx);
 	auto urb = try_get_urb(ctx.request); // IOCTL_INTERNAL_USB_SUBMIT_URB
 
+	if (auto dev = ctx.dev; dev->suspended) {
+		device::signal_wake(get_handle(dev));
+	}
+
 	return  urb ? ret_submit_urb(ctx, ret, *urb) :
 		ret.status ? STATUS_UNSUCCESSFUL : 
 		STATUS_SUCCESS;
@@ -401,10 +454,10 @@ PAGED auto make_mdl_chain(_In_ wsk_context &ctx)
 		NT_ASSERT(!head->Next);
 	} else if (auto &chain = ctx.mdl_buf) { // isoch IN
 		auto t = tail(chain);
-		t->Next = ctx.mdl_isoc.get();
+		t->Next = get_isoc_mdl(ctx).get();
 		head = chain.get();
 	} else { // isoch OUT or IN with zero actual_length
-		head = ctx.mdl_isoc.get();
+		head = get_isoc_mdl(ctx).get();
 	}
 
 	return head;
@@ -472,183 +525,285 @@ PAGED auto prepare_wsk_mdl(_Out_ MDL* &mdl, _Inout_ wsk_context &ctx, _Inout_ UR
 	return STATUS_SUCCESS;
 }
 
+/*
+ * For RET_UNLINK irp was completed right after CMD_UNLINK was issued.
+ * @see send_cmd_unlink
+ *
+ * USBIP_RET_UNLINK
+ * 1) if UNLINK is successful, status is -ECONNRESET
+ * 2) if USBIP_CMD_UNLINK is after USBIP_RET_SUBMIT status is 0
+ * See: <kernel>/Documentation/usb/usbip_protocol.rst
+ */
 _IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto receive(_Inout_ wsk_context &ctx, _Inout_ WSK_BUF &buf)
+_IRQL_requires_max_(PASSIVE_LEVEL)
+PAGED auto ret_command(_Inout_ wsk_context &ctx)
 {
 	PAGED_CODE();
+	auto &hdr = ctx.hdr;
 
-	auto &dev = *ctx.dev;
-	NT_ASSERT(verify(buf, ctx.is_isoc));
-
-	SIZE_T actual{};
-	auto st = receive(dev.sock(), &buf, WSK_FLAG_WAITALL, &actual);
+	auto request = hdr.command == RET_SUBMIT ? // request must be completed
+		       device::remove_request(*ctx.dev, hdr.seqnum) : WDF_NO_HANDLE;
 
-	TraceWSK("req %04x, %!STATUS!, %Iu byte(s)", ptr04x(ctx.request), st, actual);
+	char buf[DBG_USBIP_HDR_BUFSZ];
+	TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "req %04x <- %Iu%s", ptr04x(request), 
+		    get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, false));
 
-	return  NT_ERROR(st) ? st :
-		actual == buf.Length ? STATUS_SUCCESS :
-		actual ? STATUS_RECEIVE_PARTIAL : 
-		STATUS_CONNECTION_DISCONNECTED; // EOF
+	return request;
 }
 
+/*
+ * @param payload_size is set if the header is valid
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto drain_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
+PAGED auto validate_header(_Inout_ header &hdr, _Out_ size_t &payload_size)
 {
 	PAGED_CODE();
 
-	if (ULONG(length) != length) {
-		Trace(TRACE_LEVEL_ERROR, "Buffer size truncation: ULONG(%lu) != size_t(%Iu)", ULONG(length), length);
-		return STATUS_INVALID_PARAMETER;
+	switch (decode_response(hdr, payload_size)) {
+	case decode_error::none:
+		return true;
+	case decode_error::command:
+		Trace(TRACE_LEVEL_ERROR, "USBIP_RET_* expected, got %!usbip_request_type!", static_cast<request_type>(hdr.command));
+		break;
+	case decode_error::number_of_packets:
+		Trace(TRACE_LEVEL_ERROR, "number_of_packets(%d) is out of range", hdr.ret_submit.number_of_packets);
+		break;
+	case decode_error::actual_length:
+		Trace(TRACE_LEVEL_ERROR, "actual_length(%d) is negative", hdr.ret_submit.actual_length);
+		break;
+	case decode_error::seqnum:
+		Trace(TRACE_LEVEL_ERROR, "Invalid seqnum %u", hdr.seqnum);
+		break;
 	}
 
-	unique_ptr payload(libdrv::uninitialized, NonPagedPoolNx, length);
+	return false;
+}
 
-	if (auto ptr = payload.get()) {
-		ctx.mdl_buf = Mdl(ptr, ULONG(length));
-	} else {
-		Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", length);
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
+/*
+ * Completes the request of current PDU and prepares to receive next one, the stream is reset by the caller.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void finish(_Inout_ recv_engine &e)
+{
+	PAGED_CODE();
+	auto &ctx = *e.ctx;
 
-	if (auto err = ctx.mdl_buf.prepare_nonpaged()) {
-		Trace(TRACE_LEVEL_ERROR, "prepare_nonpaged %!STATUS!", err);
-		return err;
+	if (auto &req = ctx.request) {
+		auto st = e.status ? e.status : ret_submit(ctx);
+		complete_and_set_null(e, req, st);
 	}
 
-	WSK_BUF buf{ .Mdl = ctx.mdl_buf.get(), .Length = length };
-	return receive(ctx, buf);
+	ctx.mdl_buf.reset();
+	ctx.mdl_hdr.next(nullptr);
+
+	e.payload = nullptr;
+	e.status = STATUS_SUCCESS;
 }
 
+/*
+ * If the payload can't be put into URB, it is discarded and the request is completed with an error.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto recv_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
+PAGED auto on_header(_Inout_ recv_engine &e)
 {
 	PAGED_CODE();
+	auto &ctx = *e.ctx;
+
+	if (!validate_header(ctx.hdr, e.stream.payload_len)) {
+		return STATUS_INVALID_PARAMETER;
+	}
 
-	auto &urb = get_urb(ctx.request); // only IOCTL_INTERNAL_USB_SUBMIT_URB has payload
-	WSK_BUF buf{ .Length = length };
+	NT_ASSERT(!ctx.request); // must be completed and zeroed for every PDU
+	ctx.request = ret_command(ctx);
 
-	if (auto err = prepare_wsk_mdl(buf.Mdl, ctx, urb)) {
-		Trace(TRACE_LEVEL_ERROR, "prepare_wsk_mdl %!STATUS!", err);
-		return err;
+	if (auto request = ctx.request; request && e.stream.payload_len) { // otherwise feed calls finish
+		auto &urb = get_urb(request); // only IOCTL_INTERNAL_USB_SUBMIT_URB has payload
+		if (auto err = prepare_wsk_mdl(e.payload, ctx, urb)) {
+			Trace(TRACE_LEVEL_ERROR, "prepare_wsk_mdl %!STATUS!", err);
+			e.payload = nullptr;
+			e.status = err;
+		} else {
+			NT_ASSERT(e.stream.payload_len <= size(e.payload));
+		}
 	}
 
-	return receive(ctx, buf);
+	return STATUS_SUCCESS;
 }
 
 /*
- * For RET_UNLINK irp was completed right after CMD_UNLINK was issued.
- * @see send_cmd_unlink
- *
- * USBIP_RET_UNLINK
- * 1) if UNLINK is successful, status is -ECONNRESET
- * 2) if USBIP_CMD_UNLINK is after USBIP_RET_SUBMIT status is 0
- * See: <kernel>/Documentation/usb/usbip_protocol.rst
+ * @return STATUS_SUCCESS if at least one byte was received
  */
 _IRQL_requires_same_
-_IRQL_requires_max_(PASSIVE_LEVEL)
-PAGED auto ret_command(_Inout_ wsk_context &ctx)
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto receive(_Inout_ device_ctx &dev, _Inout_ WSK_BUF &buf, _In_ ULONG flags, _Out_ SIZE_T &actual)
 {
 	PAGED_CODE();
-	auto &hdr = ctx.hdr;
 
-	auto request = hdr.command == RET_SUBMIT ? // request must be completed
-		       device::remove_request(*ctx.dev, hdr.seqnum) : WDF_NO_HANDLE;
+	actual = 0;
+	auto st = receive(dev.sock(), &buf, flags, &actual);
 
-	char buf[DBG_USBIP_HDR_BUFSZ];
-	TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "req %04x <- %Iu%s", ptr04x(request), 
-		    get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, false));
+	TraceWSK("dev %04x, %!STATUS!, %Iu of %Iu byte(s)", ptr04x(get_handle(&dev)), st, actual, buf.Length);
 
-	return request;
+	return  NT_ERROR(st) ? st :
+		actual ? STATUS_SUCCESS : 
+		STATUS_CONNECTION_DISCONNECTED; // EOF
 }
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto validate_header(_Inout_ header &hdr)
+PAGED auto receive_all(_Inout_ device_ctx &dev, _Inout_ WSK_BUF &buf)
 {
 	PAGED_CODE();
-	byteswap_header(hdr, swap_dir::net2host);
-
-	auto cmd = static_cast<request_type>(hdr.command);
-
-	switch (cmd) {
-	case RET_SUBMIT: {
-		auto &ret = hdr.ret_submit;
-		if (ret.number_of_packets == number_of_packets_non_isoch) {
-			ret.number_of_packets = 0;
-		} else if (!is_valid_number_of_packets(ret.number_of_packets)) {
-			Trace(TRACE_LEVEL_ERROR, "number_of_packets(%d) is out of range", ret.number_of_packets);
-			return false;
-		}
-	}	break;
-	case RET_UNLINK:
-		break;
-	default:
-		Trace(TRACE_LEVEL_ERROR, "USBIP_RET_* expected, got %!usbip_request_type!", cmd);
-		return false;
-	}
-
-	auto ok = is_valid_seqnum(hdr.seqnum);
+	SIZE_T actual;
 
-	if (ok) {
-		hdr.direction = extract_dir(hdr.seqnum); // always zero in server response
-	} else {
-		Trace(TRACE_LEVEL_ERROR, "Invalid seqnum %u", hdr.seqnum);
+	if (auto err = receive(dev, buf, WSK_FLAG_WAITALL, actual)) {
+		return err;
 	}
 
-	return ok;
+	return actual == buf.Length ? STATUS_SUCCESS : STATUS_RECEIVE_PARTIAL;
 }
 
+/*
+ * Receive the rest of the payload right into URB transfer buffer and isoc descriptors.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto recv_usbip_header(_Inout_ wsk_context &ctx)
+PAGED auto recv_payload(_Inout_ device_ctx &dev, _Inout_ recv_engine &e)
 {
 	PAGED_CODE();
 
-	ctx.mdl_buf.reset();
-	ctx.mdl_hdr.next(nullptr);
-
-	WSK_BUF buf{ .Mdl = ctx.mdl_hdr.get(), .Length = sizeof(ctx.hdr) };
+	size_t offset = e.stream.payload_done;
+	WSK_BUF buf{ .Mdl = seek(e.payload, offset), .Offset = static_cast<ULONG>(offset), .Length = payload_left(e.stream) };
+	NT_ASSERT(buf.Mdl);
 
-	if (auto err = receive(ctx, buf)) {
+	if (auto err = receive_all(dev, buf)) {
 		return err;
 	}
 
-	return validate_header(ctx.hdr) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+	auto start = KeQueryPerformanceCounter(nullptr).QuadPart;
+	advance(e, buf.Length);
+	dev.recv_ticks += KeQueryPerformanceCounter(nullptr).QuadPart - start;
+
+	return STATUS_SUCCESS;
 }
 
+/*
+ * Receive as much as available, it can be the tail of current PDU and any number of following PDUs.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void recv_loop(_Inout_ device_ctx &dev, _Inout_ wsk_context &ctx)
+PAGED auto recv_chunk(_Inout_ device_ctx &dev, _Inout_ recv_engine &e, _In_ const Mdl &chunk)
 {
 	PAGED_CODE();
 
-	for (NTSTATUS status{}; !(status || dev.unplugged || recv_usbip_header(ctx)); ) {
+	WSK_BUF buf{ .Mdl = chunk.get(), .Length = chunk.size() };
+	SIZE_T actual;
 
-		NT_ASSERT(!ctx.request); // must be completed and zeroed on every loop
-		ctx.request = ret_command(ctx);
+	if (auto err = receive(dev, buf, 0, actual)) {
+		return err;
+	}
+
+	auto start = KeQueryPerformanceCounter(nullptr).QuadPart;
+	auto st = consume(e, chunk.vaddr(), actual);
+	dev.recv_ticks += KeQueryPerformanceCounter(nullptr).QuadPart - start;
+
+	return st;
+}
+
+/*
+ * Large payloads are received right into their destination. 
+ * Small ones are received into the buffer along with following PDUs and copied, 
+ * this saves a lot of receive calls for short transfers.
+ * 
+ * The payload that nobody wants (the request was cancelled or unlinked) is received into the same 
+ * buffer in chunks and discarded by consume, thus it does not cause pool allocations.
+ *
+ * If completion is deferred, requests received by each call are passed to the completion stage at once.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto recv_loop(_Inout_ device_ctx &dev, _Inout_ recv_engine &e, _In_ const Mdl &chunk)
+{
+	PAGED_CODE();
+	NTSTATUS status{};
 
-		if (auto sz = get_payload_size(ctx.hdr); !sz) {
-			//
-		} else if (dev.unplugged) {
-			status = STATUS_CANCELLED; // do not receive payload
+	while (!(status || dev.unplugged)) {
+		if (header_received(e.stream) && e.payload && payload_left(e.stream) >= RECV_DIRECT_MIN) {
+			status = recv_payload(dev, e);
 		} else {
-			auto f = ctx.request ? recv_payload : drain_payload;
-			status = f(ctx, sz);
+			status = recv_chunk(dev, e, chunk);
 		}
 
-		if (auto &req = ctx.request) {
-			auto st = status ? status : ret_submit(ctx);
-			complete_and_set_null(req, st);
-		}
+		submit(dev, e.completed);
 	}
+
+	return status ? status : STATUS_CANCELLED;
 }
 
 } // namespace
 
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::consume(_Inout_ recv_engine &e, _In_reads_bytes_(len) const void *data, _In_ size_t len)
+{
+	PAGED_CODE();
+
+	auto on_payload = [&e] (auto src, auto cnt)
+	{
+		if (!e.payload) {
+			// discard
+		} else if (auto err = copy(e.payload, e.stream.payload_done, src, cnt)) {
+			Trace(TRACE_LEVEL_ERROR, "copy %!STATUS!", err);
+			e.payload = nullptr;
+			e.status = err;
+		}
+	};
+
+	return feed(e.stream, e.ctx->hdr, data, len, [&e] { return on_header(e); }, on_payload, [&e] { finish(e); });
+}
+
+/*
+ * @param len bytes of the payload were put to the destination 
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::advance(_Inout_ recv_engine &e, _In_ size_t len)
+{
+	PAGED_CODE();
+	NT_ASSERT(header_received(e.stream));
+	NT_ASSERT(len <= payload_left(e.stream));
+
+	if (advance(e.stream, len)) {
+		finish(e);
+		e.stream = {};
+	}
+}
+
+/*
+ * Complete the request of incompletely received PDU.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::cancel(_Inout_ recv_engine &e, _In_ NTSTATUS status)
+{
+	PAGED_CODE();
+	NT_ASSERT(status);
+
+	if (auto &req = e.ctx->request) {
+		TraceDbg("req %04x, %!STATUS!", ptr04x(req), status);
+		complete_and_set_null(e, req, status);
+	}
+
+	submit(*e.ctx->dev, e.completed);
+
+	e.ctx->mdl_buf.reset();
+	e.ctx->mdl_hdr.next(nullptr);
+}
+
 _IRQL_requires_same_
 _Function_class_(KSTART_ROUTINE)
 PAGED void usbip::recv_thread_function(_In_ void *context)
@@ -661,9 +816,23 @@ PAGED void usbip::recv_thread_function(_In_ void *context)
 	//KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
 	auto dev = get_device_ctx(device);
 
-	if (auto ctx = alloc_wsk_context(dev, WDF_NO_HANDLE)) {
-		recv_loop(*dev, *ctx);
-		NT_ASSERT(!ctx->request);
+	unique_ptr buf(libdrv::uninitialized, NonPagedPoolNx, RECV_BUF_SIZE);
+	Mdl chunk;
+
+	if (buf) {
+		chunk = Mdl(buf.get(), RECV_BUF_SIZE);
+	}
+
+	if (auto err = chunk.prepare_nonpaged()) {
+		Trace(TRACE_LEVEL_ERROR, "dev %04x, can't allocate receive buffer, %!STATUS!", ptr04x(device), err);
+	} else if (auto ctx = alloc_wsk_context(dev, WDF_NO_HANDLE)) {
+		do { // a session per iteration
+			recv_engine e{ .ctx = ctx };
+			auto st = recv_loop(*dev, e, chunk);
+			cancel(e, st);
+			NT_ASSERT(!ctx->request);
+			flush_completion(*dev);
+		} while (!(dev->unplugged || device::reconnect(device)));
 		free(ctx, true);
 	}
 
@@ -7,9 +7,41 @@
 #include <libdrv/codeseg.h>
 #include <libdrv/wdf_cpp.h>
 
+#include <usbip/pdu_stream.h>
+
+#include "completion.h"
+
 namespace usbip
 {
 
+struct wsk_context;
+
+/*
+ * Incremental parser of the stream of USBIP_RET_* PDUs, framing is done by pdu_stream.
+ * A payload is copied right into URB transfer buffer and isoc descriptors (if any).
+ */
+struct recv_engine
+{
+        wsk_context *ctx; // ctx->hdr is being received, ctx->request is the current request
+        pdu_stream stream;
+
+        MDL *payload; // where to put the payload of current PDU, nullptr - discard it
+        NTSTATUS status; // to complete ctx->request with
+        completion_list completed; // received requests if completion is deferred, @see submit
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS consume(_Inout_ recv_engine &e, _In_reads_bytes_(len) const void *data, _In_ size_t len);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void advance(_Inout_ recv_engine &e, _In_ size_t len);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void cancel(_Inout_ recv_engine &e, _In_ NTSTATUS status);
+
 _IRQL_requires_same_
 _Function_class_(KSTART_ROUTINE)
 PAGED void recv_thread_function(_In_ void *context);
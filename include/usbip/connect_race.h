@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+#include <sal.h>
+
+/*
+ * Staggered parallel connection attempts across all resolved addresses, it does not depend on WDK.
+ * @see RFC 8305 Happy Eyeballs Version 2: Better Connectivity Using Concurrency
+ *
+ * The next attempt is started when the previous one has failed or the delay has elapsed,
+ * pending attempts are not cancelled. The first successful attempt wins, the others must be cancelled.
+ */
+
+namespace usbip
+{
+
+struct connect_race
+{
+	INT64 delay; // between the starts of attempts, "Connection Attempt Delay"
+	INT64 begin; // local time when the race has started
+	INT64 last; // local time when the last attempt was started
+
+	int total; // of addresses
+	int started;
+	int failed;
+};
+
+/*
+ * Time is measured in ticks of any monotonic source.
+ * @param total number of addresses
+ */
+constexpr void init(_Out_ connect_race &r, _In_ int total, _In_ INT64 delay, _In_ INT64 now)
+{
+	r = {};
+	r.delay = delay > 0 ? delay : 0;
+	r.begin = now;
+	r.last = now;
+	r.total = total > 0 ? total : 0;
+}
+
+constexpr auto get_pending(_In_ const connect_race &r) { return r.started - r.failed; }
+
+/*
+ * @return true if all attempts have failed
+ */
+constexpr auto is_lost(_In_ const connect_race &r) { return r.failed == r.total; }
+
+/*
+ * @return ticks to wait before the next attempt, zero to start it now, negative if all attempts were started
+ */
+constexpr INT64 get_wait(_In_ const connect_race &r, _In_ INT64 now)
+{
+	if (r.started == r.total) {
+		return -1;
+	}
+
+	if (!get_pending(r)) { // the first one or all previous have failed
+		return 0;
+	}
+
+	auto next = r.last + r.delay;
+	return next > now ? next - now : 0;
+}
+
+constexpr void on_started(_Inout_ connect_race &r, _In_ INT64 now)
+{
+	++r.started;
+	r.last = now;
+}
+
+constexpr void on_failed(_Inout_ connect_race &r) { ++r.failed; }
+
+/*
+ * @return ticks from the start of the race, connect latency
+ */
+constexpr auto get_latency(_In_ const connect_race &r, _In_ INT64 now) { return now - r.begin; }
+
+/*
+ * Orders the list of ADDRINFOEX(W) so that address families alternate, the first family goes first.
+ * The list itself is not modified, it can be freed by FreeAddrInfoEx or WskFreeAddressInfo only.
+ * @return number of addresses in the result
+ */
+template<typename T>
+constexpr int interleave(_In_opt_ T *head, _Out_writes_to_(max, return) T* *result, _In_ int max)
+{
+	int cnt = 0;
+
+	auto first = head; // of the first family
+	auto other = head;
+
+	auto next_first = [head] (auto ai) { for ( ; ai && ai->ai_family != head->ai_family; ai = ai->ai_next); return ai; };
+	auto next_other = [head] (auto ai) { for ( ; ai && ai->ai_family == head->ai_family; ai = ai->ai_next); return ai; };
+
+	if (head) {
+		other = next_other(head);
+	}
+
+	for (bool turn = true; (first || other) && cnt < max; turn = !turn) {
+		if (auto &ai = turn ? first : other) {
+			result[cnt++] = ai;
+			ai = turn ? next_first(ai->ai_next) : next_other(ai->ai_next);
+		}
+	}
+
+	return cnt;
+}
+
+} // namespace usbip
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+#include <sal.h>
+
+#include "ch9.h"
+
+/*
+ * Virtual (micro)frame clock of the server's host controller, it does not depend on WDK.
+ * Local time of any monotonic source is converted to the server's frame numbers.
+ * The clock is synchronized by start_frame of completed isoch transfers, @see sync.
+ *
+ * Host controllers of the server can report only the lowest 11 bits of a frame number (as in SOF packet),
+ * the clock provides 32-bit frame numbers with the same lowest bits.
+ */
+
+namespace usbip
+{
+
+struct frame_clock_stat
+{
+	UINT64 samples; // calls of sync
+	UINT64 resyncs; // the error was too large, the clock was set
+	INT64 last_error; // in ticks, observed minus predicted time of the middle of the frame
+	INT64 max_error; // absolute value
+	UINT64 sum_error; // of absolute values, sum_error/samples is the average jitter
+	INT64 correction; // sum of adjustments of the origin, correction/(last - first) is the drift
+	INT64 first; // time of the first sample
+	INT64 last; // time of the last sample
+};
+
+struct frame_clock
+{
+	enum {
+		GAIN_SHIFT = 3, // the origin is adjusted by 1/8 of the error
+		RESYNC_FRAMES = 64, // the clock is set if the error is greater
+		MICROFRAMES = 8, // per frame
+		FRAME_BITS = 11, // are significant in frame numbers of the server
+	};
+
+	INT64 ticks_per_frame; // zero if the clock is not initialized
+	INT64 origin; // local time of server's frame zero (modulo 2^32 frames)
+	bool synced;
+
+	frame_clock_stat stat;
+};
+
+namespace frame_clock_impl
+{
+
+constexpr auto abs(_In_ INT64 v) { return v < 0 ? -v : v; }
+
+/*
+ * @return unwrapped frame number that is the nearest to the expected one
+ */
+constexpr INT64 unwrap(_In_ INT64 expected, _In_ UINT32 frame)
+{
+	constexpr UINT32 mask = (1U << frame_clock::FRAME_BITS) - 1;
+
+	auto diff = (frame - static_cast<UINT32>(expected)) & mask;
+	return expected + (diff > mask/2 ? static_cast<INT64>(diff) - (mask + 1) : diff);
+}
+
+} // namespace frame_clock_impl
+
+
+/*
+ * @param ticks_per_frame local time units per 1 ms
+ */
+constexpr void init(_Out_ frame_clock &c, _In_ INT64 ticks_per_frame)
+{
+	c = {};
+	c.ticks_per_frame = ticks_per_frame;
+}
+
+constexpr auto is_synced(_In_ const frame_clock &c) { return c.synced; }
+
+/*
+ * 64-bit origin is read once, this is atomic on x64 and ARM64.
+ * @return 32-bit server's frame number at local time now
+ */
+constexpr UINT32 get_frame(_In_ const frame_clock &c, _In_ INT64 now)
+{
+	auto origin = c.origin;
+	return c.ticks_per_frame ? static_cast<UINT32>((now - origin)/c.ticks_per_frame) : 0;
+}
+
+/*
+ * The lowest 3 bits are the current 125 us microframe, the upper 29 bits are the frame number.
+ */
+constexpr UINT32 get_microframe(_In_ const frame_clock &c, _In_ INT64 now)
+{
+	auto origin = c.origin;
+	return c.ticks_per_frame ? static_cast<UINT32>((now - origin)*frame_clock::MICROFRAMES/c.ticks_per_frame) : 0;
+}
+
+/*
+ * @param now local time when the server was in this frame
+ * @param frame server's frame number, for example, start_frame plus the duration of the transfer
+ */
+constexpr void sync(_Inout_ frame_clock &c, _In_ INT64 now, _In_ UINT32 frame)
+{
+	using namespace frame_clock_impl;
+
+	auto tpf = c.ticks_per_frame;
+	if (!tpf) {
+		return;
+	}
+
+	auto &st = c.stat;
+	if (!st.samples++) {
+		st.first = now;
+	}
+	st.last = now;
+
+	auto expected = (now - c.origin)/tpf;
+	auto observed = unwrap(expected, frame);
+
+	auto mid = observed*tpf + tpf/2; // now is somewhere inside the frame
+	auto err = (now - c.origin) - mid; // positive if the clock is behind
+	st.last_error = err;
+
+	if (!c.synced || abs(err) > frame_clock::RESYNC_FRAMES*tpf) {
+		c.origin = now - mid;
+		c.synced = true;
+		++st.resyncs;
+		return;
+	}
+
+	auto abs_err = abs(err);
+	st.sum_error += abs_err;
+	if (abs_err > st.max_error) {
+		st.max_error = abs_err;
+	}
+
+	auto adj = err/(1 << frame_clock::GAIN_SHIFT);
+	c.origin += adj;
+	st.correction += adj;
+}
+
+/*
+ * @return the drift of the local clock relative to the server's one, in parts per million,
+ *         it is negative if the server's clock is faster
+ */
+constexpr INT64 get_drift_ppm(_In_ const frame_clock_stat &st)
+{
+	auto elapsed = st.last - st.first;
+	return elapsed > 0 ? st.correction*1'000'000/elapsed : 0;
+}
+
+/*
+ * @param frame server's frame number, only FRAME_BITS are significant
+ * @return 32-bit frame number of the clock that is the nearest to the frame
+ */
+constexpr UINT32 to_clock_frame(_In_ const frame_clock &c, _In_ UINT32 frame, _In_ INT64 now)
+{
+	return static_cast<UINT32>(frame_clock_impl::unwrap(get_frame(c, now), frame));
+}
+
+/*
+ * Linux EHCI and xHCI count start_frame of isoch transfers of high-speed and faster devices in microframes,
+ * full-speed ones in frames. The clock and URB StartFrame count frames.
+ * @see tests/frame_clock_test.cpp
+ */
+constexpr auto server_counts_microframes(_In_ usb_device_speed speed) { return speed >= USB_SPEED_HIGH; }
+
+/*
+ * @param frame start_frame of the server's response
+ * @return frame number, only FRAME_BITS are significant
+ */
+constexpr UINT32 from_server_frame(_In_ UINT32 frame, _In_ usb_device_speed speed)
+{
+	return server_counts_microframes(speed) ? frame/frame_clock::MICROFRAMES : frame;
+}
+
+/*
+ * @return start_frame for CMD_SUBMIT
+ */
+constexpr UINT32 to_server_frame(_In_ UINT32 frame, _In_ usb_device_speed speed)
+{
+	return server_counts_microframes(speed) ? frame*frame_clock::MICROFRAMES : frame;
+}
+
+/*
+ * @param frame requested by a client driver
+ * @param now local time
+ * @param min_lead the frame must be ahead of the current one at least by this number of frames
+ * @return true if the frame is in the future, but not too far to be ambiguous for the server
+ */
+constexpr bool is_schedulable(_In_ const frame_clock &c, _In_ UINT32 frame, _In_ INT64 now, _In_ UINT32 min_lead)
+{
+	auto lead = static_cast<INT32>(frame - get_frame(c, now));
+	return c.synced && lead >= static_cast<INT32>(min_lead) && lead < (1 << frame_clock::FRAME_BITS)/2;
+}
+
+} // namespace usbip
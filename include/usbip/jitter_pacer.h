@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+#include <sal.h>
+
+#include "ch9.h"
+
+/*
+ * Pacing of completed isoch IN transfers, it does not depend on WDK.
+ * Transfers that arrive in bursts are held until the buffer has target microframes of data,
+ * after that they are released at the nominal cadence: each transfer is released when
+ * the previous one has been "played", i.e. after the microframes it spans.
+ * If the buffer runs dry, it is filled up to the target again.
+ */
+
+namespace usbip
+{
+
+struct jitter_stat
+{
+	UINT64 held; // transfers
+	UINT64 released; // transfers
+	UINT64 cancelled; // transfers that were held and will not be released
+	UINT64 underruns; // the buffer ran dry, playback was stopped until it is refilled
+	UINT64 late_microframes; // the buffer was empty for, sum for all underruns
+	UINT64 sum_depth; // in microframes before each release, sum_depth/released is the average depth
+	UINT32 max_depth; // in microframes
+};
+
+struct jitter_pacer
+{
+	INT64 ticks_per_microframe;
+	UINT32 target; // microframes to accumulate before releasing
+	UINT32 depth; // microframes of data are held
+	INT64 due; // local time when the next transfer must be released
+	bool playing;
+
+	jitter_stat stat;
+};
+
+/*
+ * @param target microframes to accumulate
+ */
+constexpr void init(_Out_ jitter_pacer &p, _In_ INT64 ticks_per_microframe, _In_ UINT32 target)
+{
+	p = {};
+	p.ticks_per_microframe = ticks_per_microframe;
+	p.target = target;
+}
+
+/*
+ * A transfer has been completed by the server and is held.
+ * @param microframes the transfer spans
+ */
+constexpr void on_hold(_Inout_ jitter_pacer &p, _In_ INT64 now, _In_ UINT32 microframes)
+{
+	auto &st = p.stat;
+	++st.held;
+
+	if (p.playing && !p.depth && now > p.due) { // underrun
+		++st.underruns;
+		st.late_microframes += static_cast<UINT64>((now - p.due)/p.ticks_per_microframe);
+		p.playing = false;
+	}
+
+	p.depth += microframes;
+	if (p.depth > st.max_depth) {
+		st.max_depth = p.depth;
+	}
+
+	if (!p.playing && p.depth >= p.target) {
+		p.playing = true;
+		p.due = now;
+	}
+}
+
+/*
+ * @return true if the oldest held transfer must be released now
+ */
+constexpr bool is_due(_In_ const jitter_pacer &p, _In_ INT64 now)
+{
+	return p.playing && p.depth && now >= p.due;
+}
+
+/*
+ * The oldest held transfer was released.
+ * @param microframes the transfer spans, as for on_hold
+ */
+constexpr void on_release(_Inout_ jitter_pacer &p, _In_ UINT32 microframes)
+{
+	auto &st = p.stat;
+	++st.released;
+	st.sum_depth += p.depth;
+
+	p.depth = microframes < p.depth ? p.depth - microframes : 0;
+	p.due += microframes*p.ticks_per_microframe;
+}
+
+/*
+ * A held transfer was cancelled, it will not be released.
+ * @param microframes the transfer spans, as for on_hold
+ */
+constexpr void on_cancel(_Inout_ jitter_pacer &p, _In_ UINT32 microframes)
+{
+	++p.stat.cancelled;
+	p.depth = microframes < p.depth ? p.depth - microframes : 0;
+}
+
+/*
+ * All held transfers were released regardless of the cadence, for example, on endpoint purge.
+ */
+constexpr void on_flush(_Inout_ jitter_pacer &p)
+{
+	p.depth = 0;
+	p.playing = false;
+}
+
+/*
+ * @return ticks till the next release, negative if nothing to wait for
+ */
+constexpr INT64 get_timeout(_In_ const jitter_pacer &p, _In_ INT64 now)
+{
+	if (!(p.playing && p.depth)) {
+		return -1;
+	}
+
+	return p.due > now ? p.due - now : 0;
+}
+
+/*
+ * @param speed full-speed or faster, bInterval is in microframes, otherwise in frames;
+ *        bInterval of full-speed endpoints is patched to high-speed encoding by the driver
+ * @return number of microframes that the isoch transfer spans
+ */
+constexpr UINT32 get_isoch_microframes(_In_ usb_device_speed speed, _In_ UINT8 bInterval, _In_ UINT32 number_of_packets)
+{
+	auto exp = bInterval < 1 ? 0 : bInterval > 16 ? 15 : bInterval - 1;
+	auto n = number_of_packets << exp;
+
+	return speed < USB_SPEED_FULL ? 8*n : n;
+}
+
+} // namespace usbip
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+#include <sal.h>
+#include <string.h>
+
+/*
+ * Isoc descriptors follow the data in the stream, so the data of isoch IN transfer can't be received
+ * right to the packets' offsets. The compacted buffer from the server is expanded in place,
+ * adjacent packets that must be shifted by the same distance are moved at once.
+ * @see tests/move_run_test.cpp, tests/move_run_bench.cpp
+ */
+
+namespace usbip
+{
+
+struct move_run
+{
+	UINT32 src;
+	UINT32 dst;
+	UINT32 len;
+};
+
+inline void flush(_Inout_ UINT8 *buffer, _Inout_ move_run &m)
+{
+	if (m.len && m.dst != m.src) {
+		memmove(buffer + m.dst, buffer + m.src, m.len);
+	}
+
+	m.len = 0;
+}
+
+/*
+ * Packets must be passed in reverse order, flush must be called after the first one.
+ */
+inline void move(_Inout_ UINT8 *buffer, _Inout_ move_run &m, _In_ UINT32 src, _In_ UINT32 dst, _In_ UINT32 len)
+{
+	if (m.len && src + len == m.src && dst - src == m.dst - m.src) {
+		m.src = src;
+		m.dst = dst;
+		m.len += len;
+	} else {
+		flush(buffer, m);
+		m = { .src = src, .dst = dst, .len = len };
+	}
+}
+
+} // namespace usbip
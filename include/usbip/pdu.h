@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2022-2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "proto.h"
+
+#include <sal.h>
+#include <stddef.h>
+
+#if defined(_MSC_VER)
+  #include <intrin.h>
+#endif
+
+/*
+ * SSE2 and NEON are baseline for x64 and ARM64, so there is no runtime dispatch.
+ * AVX2 is not used, kernel code would have to save the extended processor state for it.
+ */
+#if defined(_M_X64) || defined(__SSE2__)
+  #define USBIP_PDU_SSE2
+  #include <emmintrin.h>
+#elif defined(_M_ARM64)
+  #define USBIP_PDU_NEON
+  #include <arm64_neon.h>
+#elif defined(__ARM_NEON)
+  #define USBIP_PDU_NEON
+  #include <arm_neon.h>
+#endif
+
+/*
+ * Header-only codec of USB/IP PDUs, it is shared by the driver and libusbip.
+ * Encode and decode are byteswap_header/byteswap_payload with swap_dir, server's responses are
+ * decoded and validated by decode_response, sizes are computed by get_total_size and get_payload_size.
+ *
+ * It does not depend on WDK, only on basetsd.h, sal.h and PSHPACK1.H/POPPACK.H of Windows SDK.
+ * Elsewhere they are substituted by tests/shim, @see tests/pdu_codec_bench.cpp.
+ */
+
+namespace usbip
+{
+
+enum class swap_dir { host2net, net2host };
+
+namespace pdu
+{
+
+static_assert(sizeof(header_basic) == 5*sizeof(UINT32));
+static_assert(offsetof(header, cmd_submit.setup) == sizeof(header_basic) + 5*sizeof(UINT32));
+static_assert(sizeof(header_ret_submit) == 5*sizeof(UINT32));
+static_assert(sizeof(iso_packet_descriptor) == 4*sizeof(UINT32));
+
+inline UINT16 bswap(_In_ UINT16 v)
+{
+#if defined(_MSC_VER)
+	static_assert(sizeof(v) == sizeof(unsigned short));
+	return _byteswap_ushort(v);
+#else
+	return __builtin_bswap16(v);
+#endif
+}
+
+inline UINT32 bswap(_In_ UINT32 v)
+{
+#if defined(_MSC_VER)
+	static_assert(sizeof(v) == sizeof(unsigned long));
+	return _byteswap_ulong(v);
+#else
+	return __builtin_bswap32(v);
+#endif
+}
+
+/*
+ * The reference implementation of bswap, the result must be bit-identical.
+ */
+inline void bswap_scalar(_Inout_updates_(cnt) UINT32 *v, _In_ size_t cnt)
+{
+	for ( ; cnt; --cnt, ++v) {
+		*v = bswap(*v);
+	}
+}
+
+/*
+ * All PDU fields that need swapping are 32-bit and contiguous.
+ * Four of them are swapped at once, the tail is swapped by scalar code.
+ * @see tests/pdu_bswap_test.cpp, tests/pdu_bswap_bench.cpp
+ */
+inline void bswap(_Inout_updates_(cnt) UINT32 *v, _In_ size_t cnt)
+{
+#if defined(USBIP_PDU_SSE2)
+	for ( ; cnt >= 4; cnt -= 4, v += 4) {
+		auto p = reinterpret_cast<__m128i*>(v);
+		auto x = _mm_loadu_si128(p);
+
+		x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1)); // swap 16-bit halves of each dword
+		x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8)); // swap bytes of each word
+
+		_mm_storeu_si128(p, x);
+	}
+#elif defined(USBIP_PDU_NEON)
+	for ( ; cnt >= 4; cnt -= 4, v += 4) {
+		auto p = reinterpret_cast<UINT8*>(v);
+		vst1q_u8(p, vrev32q_u8(vld1q_u8(p)));
+	}
+#endif
+	bswap_scalar(v, cnt);
+}
+
+/*
+ * Compile-time description of a command, @see decode_response.
+ */
+struct command_desc
+{
+	UINT8 swap_fields; // number of 32-bit fields from the beginning of the header, setup packet is not swapped
+	bool response; // USBIP_RET_*
+	bool submit; // has number_of_packets and payload
+};
+
+inline constexpr command_desc basic_desc{ sizeof(header_basic)/sizeof(UINT32), false, false }; // unknown command
+
+inline constexpr command_desc commands[] // indexed by request_type - 1
+{
+	{ basic_desc.swap_fields + 5, false, true }, // CMD_SUBMIT
+	{ basic_desc.swap_fields + 1, false, false }, // CMD_UNLINK, seqnum
+	{ basic_desc.swap_fields + 5, true, true }, // RET_SUBMIT
+	{ basic_desc.swap_fields + 1, true, false }, // RET_UNLINK, status
+};
+
+static_assert(sizeof(commands)/sizeof(*commands) == RET_UNLINK);
+static_assert(commands[CMD_SUBMIT - 1].swap_fields*sizeof(UINT32) == offsetof(header, cmd_submit.setup));
+static_assert(commands[RET_SUBMIT - 1].swap_fields*sizeof(UINT32) == sizeof(header_basic) + sizeof(header_ret_submit));
+
+/*
+ * @param command in host byte order
+ */
+constexpr auto& get_desc(_In_ UINT32 command)
+{
+	auto idx = command - 1; // zero becomes out of range
+	return idx < sizeof(commands)/sizeof(*commands) ? commands[idx] : basic_desc;
+}
+
+} // namespace pdu
+
+
+inline void byteswap_header(_Inout_ header &hdr, _In_ swap_dir dir)
+{
+	auto cmd = dir == swap_dir::net2host ? pdu::bswap(hdr.command) : hdr.command;
+	pdu::bswap(&hdr.command, pdu::get_desc(cmd).swap_fields);
+}
+
+enum class decode_error { none, command, number_of_packets, actual_length, seqnum };
+
+/*
+ * Decodes server's response in one pass: byteswap, validation, direction and payload size.
+ * Direction is restored from seqnum, @see extract_dir.
+ * @param payload_size is set if the result is decode_error::none, @see get_payload_size
+ */
+inline auto decode_response(_Inout_ header &hdr, _Out_ size_t &payload_size)
+{
+	payload_size = 0;
+
+	auto &d = pdu::get_desc(pdu::bswap(hdr.command));
+	pdu::bswap(&hdr.command, d.swap_fields);
+
+	if (!d.response) {
+		return decode_error::command;
+	}
+
+	if (!is_valid_seqnum(hdr.seqnum)) {
+		return decode_error::seqnum;
+	}
+
+	hdr.direction = extract_dir(hdr.seqnum); // always zero in server response
+
+	if (!d.submit) {
+		return decode_error::none;
+	}
+
+	auto &ret = hdr.ret_submit;
+
+	if (ret.number_of_packets == number_of_packets_non_isoch) {
+		ret.number_of_packets = 0;
+	} else if (!is_valid_number_of_packets(ret.number_of_packets)) {
+		return decode_error::number_of_packets;
+	}
+
+	if (ret.actual_length < 0) {
+		return decode_error::actual_length;
+	}
+
+	payload_size = (hdr.direction == direction::in ? size_t(ret.actual_length) : 0) + 
+			ret.number_of_packets*sizeof(iso_packet_descriptor);
+
+	return decode_error::none;
+}
+
+inline void byteswap(_Inout_updates_(cnt) iso_packet_descriptor *d, _In_ size_t cnt)
+{
+	pdu::bswap(&d->offset, cnt*sizeof(*d)/sizeof(d->offset));
+}
+
+/*
+ * Server's responses always have zeroes in usbip_header_basic's devid, direction, ep.
+ * See: <linux>/Documentation/usb/usbip_protocol.rst, usbip_header_basic.
+ *
+ * For a server's response, set hdr.base.direction to the value from the corresponding request,
+ * otherwise the result will be incorrect.
+ */
+inline size_t get_isoc_descr(_Out_ iso_packet_descriptor* &isoc, _In_ header &hdr)
+{
+	auto dir_out = hdr.direction == direction::out;
+
+	auto buf_end = reinterpret_cast<char*>(&hdr + 1);
+	INT32 cnt = 0;
+
+	switch (hdr.command) {
+	case CMD_SUBMIT:
+		buf_end += dir_out ? hdr.cmd_submit.transfer_buffer_length : 0;
+		cnt = hdr.cmd_submit.number_of_packets;
+		break;
+	case RET_SUBMIT:
+		buf_end += dir_out ? 0 : hdr.ret_submit.actual_length; // harmless if direction was not corrected
+		cnt = hdr.ret_submit.number_of_packets;
+		break;
+	case CMD_UNLINK:
+	case RET_UNLINK:
+		break; // invalid command otherwise, wrong endianness?
+	}
+
+	isoc = reinterpret_cast<iso_packet_descriptor*>(buf_end);
+	return cnt == number_of_packets_non_isoch ? 0 : cnt;
+}
+
+inline void byteswap_payload(_Inout_ header &hdr)
+{
+	if (iso_packet_descriptor *isoc{}; auto cnt = get_isoc_descr(isoc, hdr)) {
+		byteswap(isoc, cnt);
+	}
+}
+
+inline size_t get_total_size(_In_ const header &hdr)
+{
+	iso_packet_descriptor *isoc{};
+	auto cnt = get_isoc_descr(isoc, const_cast<header&>(hdr));
+
+	return reinterpret_cast<char*>(isoc + cnt) - reinterpret_cast<const char*>(&hdr);
+}
+
+inline size_t get_payload_size(_In_ const header &hdr)
+{
+	return get_total_size(hdr) - sizeof(hdr);
+}
+
+} // namespace usbip
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "proto.h"
+
+#include <sal.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Framing of the stream of PDUs, the state machine of the receive engine of the driver.
+ * Data can be fed by chunks of any size, a header or payload can span several chunks.
+ * What to do with a header and the payload is decided by the callbacks.
+ * @see tests/pdu_stream_test.cpp, tests/pdu_stream_bench.cpp
+ */
+
+namespace usbip
+{
+
+struct pdu_stream
+{
+	UINT32 hdr_len; // received bytes of the header
+	size_t payload_len; // must be set by on_header, @see feed
+	size_t payload_done; // received bytes of the payload
+};
+
+inline auto header_received(_In_ const pdu_stream &s) { return s.hdr_len == sizeof(header); }
+inline auto payload_left(_In_ const pdu_stream &s) { return s.payload_len - s.payload_done; }
+
+/*
+ * @param len bytes of the payload were received
+ * @return true if the payload was received completely
+ */
+inline auto advance(_Inout_ pdu_stream &s, _In_ size_t len)
+{
+	return (s.payload_done += len) == s.payload_len;
+}
+
+/*
+ * @param hdr is being received, it is in network byte order when on_header is called
+ * @param on_header() is called when the header was received, it must set s.payload_len;
+ *        nonzero result stops parsing and is returned
+ * @param on_payload(src, cnt) is called for each piece of the payload, s.payload_done is its offset
+ * @param on_pdu() is called when the PDU was received completely, the stream is reset after it
+ * @return zero or the result of on_header
+ */
+template<typename H, typename P, typename F>
+inline auto feed(
+	_Inout_ pdu_stream &s, _Inout_ header &hdr, _In_reads_bytes_(len) const void *data, _In_ size_t len,
+	_In_ H &&on_header, _In_ P &&on_payload, _In_ F &&on_pdu)
+{
+	using result = decltype(on_header());
+
+	auto finish = [&s, &on_pdu]
+	{
+		on_pdu();
+		s = {};
+	};
+
+	for (auto src = static_cast<const char*>(data); len; ) {
+
+		if (!header_received(s)) {
+			auto cnt = sizeof(hdr) - s.hdr_len;
+			if (cnt > len) {
+				cnt = len;
+			}
+
+			memcpy(reinterpret_cast<char*>(&hdr) + s.hdr_len, src, cnt);
+
+			src += cnt;
+			len -= cnt;
+
+			if ((s.hdr_len += UINT32(cnt)) == sizeof(hdr)) {
+				if (auto err = on_header()) {
+					return err;
+				} else if (!s.payload_len) {
+					finish();
+				}
+			}
+
+			continue;
+		}
+
+		auto cnt = payload_left(s);
+		if (cnt > len) {
+			cnt = len;
+		}
+
+		on_payload(src, cnt);
+
+		src += cnt;
+		len -= cnt;
+
+		if (advance(s, cnt)) {
+			finish();
+		}
+	}
+
+	return result{};
+}
+
+} // namespace usbip
@@ -32,6 +32,20 @@ constexpr auto is_valid_number_of_packets(int number_of_packets)
 	return number_of_packets >= 0 && number_of_packets <= max_iso_packets;
 }
 
+/*
+ * The client puts the direction of a transfer into the least significant bit of seqnum
+ * because the server responses have zero in usbip_header_basic.direction.
+ */
+constexpr auto extract_num(seqnum_t seqnum) { return seqnum >> 1; }
+constexpr auto extract_dir(seqnum_t seqnum) { return direction(seqnum & 1); }
+constexpr bool is_valid_seqnum(seqnum_t seqnum) { return extract_num(seqnum); }
+
+/*
+ * Index of a bucket of the hash table of in-flight requests, sequential seqnums fall into different buckets.
+ * @param buckets must be a power of two
+ */
+constexpr auto get_seqnum_bucket(seqnum_t seqnum, UINT32 buckets) { return extract_num(seqnum) & (buckets - 1); }
+
 #include <PSHPACK1.H>
 
 struct header_basic 
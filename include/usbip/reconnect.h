@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+#include <sal.h>
+
+/*
+ * State machine of a transparent reconnect, it does not depend on WDK.
+ * If the connection to the server is lost, the device stays plugged for a grace period while
+ * attempts to establish a new session with the same busid are made.
+ * The first attempt is immediate, the delay before each next one is doubled from min_delay up to max_delay.
+ * The last attempt is made at the end of the grace period, after that the device must be detached.
+ * @see tests/reconnect_test.cpp
+ */
+
+namespace usbip
+{
+
+enum class reconnect_state { connected, reconnecting, expired };
+
+struct reconnect_stat
+{
+	UINT64 losses; // of the connection
+	UINT64 attempts; // to establish a new session
+	UINT64 reconnects; // successful
+	UINT64 expirations; // of the grace period, the device was detached
+	INT64 last_latency; // from the loss till the new session
+	INT64 max_latency;
+	INT64 sum_latency; // sum_latency/reconnects is the average latency
+};
+
+struct reconnector
+{
+	INT64 grace; // zero if reconnect is disabled
+	INT64 min_delay;
+	INT64 max_delay;
+
+	reconnect_state state;
+	INT64 lost; // local time when the connection was lost
+	INT64 delay; // before the next attempt, zero for the first one
+	INT64 next; // local time of the next attempt
+
+	reconnect_stat stat;
+};
+
+/*
+ * Time is measured in ticks of any monotonic source.
+ * @param grace zero disables reconnect
+ */
+constexpr void init(_Out_ reconnector &r, _In_ INT64 grace, _In_ INT64 min_delay, _In_ INT64 max_delay)
+{
+	r = {};
+	r.grace = grace > 0 ? grace : 0;
+	r.min_delay = min_delay > 0 ? min_delay : 1;
+	r.max_delay = max_delay > r.min_delay ? max_delay : r.min_delay;
+}
+
+constexpr auto is_enabled(_In_ const reconnector &r) { return r.grace > 0; }
+constexpr auto is_reconnecting(_In_ const reconnector &r) { return r.state == reconnect_state::reconnecting; }
+
+/*
+ * @return false if reconnect is disabled or is already in progress, the device must be detached
+ */
+constexpr bool on_lost(_Inout_ reconnector &r, _In_ INT64 now)
+{
+	if (!is_enabled(r) || is_reconnecting(r)) {
+		return false;
+	}
+
+	++r.stat.losses;
+
+	r.state = reconnect_state::reconnecting;
+	r.lost = now;
+	r.delay = 0;
+	r.next = now;
+
+	return true;
+}
+
+/*
+ * @return ticks to wait before the next attempt, negative if the grace period has expired
+ */
+constexpr INT64 get_wait(_In_ const reconnector &r, _In_ INT64 now)
+{
+	if (!is_reconnecting(r)) {
+		return -1;
+	}
+
+	auto deadline = r.lost + r.grace;
+	auto next = r.next < deadline ? r.next : deadline;
+
+	return next > now ? next - now : 0;
+}
+
+/*
+ * @return ticks left till the end of the grace period, for a timeout of the attempt
+ */
+constexpr INT64 get_remaining(_In_ const reconnector &r, _In_ INT64 now)
+{
+	auto left = r.lost + r.grace - now;
+	return left > 0 ? left : 0;
+}
+
+/*
+ * @param max_timeout of an attempt
+ * @param min_timeout the last attempt is made at the end of the grace period, it must have time to connect
+ * @return timeout for the attempt
+ */
+constexpr INT64 get_attempt_timeout(
+	_In_ const reconnector &r, _In_ INT64 now, _In_ INT64 max_timeout, _In_ INT64 min_timeout)
+{
+	auto left = get_remaining(r, now);
+	return left < min_timeout ? min_timeout : left < max_timeout ? left : max_timeout;
+}
+
+constexpr void on_attempt_failed(_Inout_ reconnector &r, _In_ INT64 now)
+{
+	++r.stat.attempts;
+
+	if (now >= r.lost + r.grace) {
+		r.state = reconnect_state::expired;
+		++r.stat.expirations;
+		return;
+	}
+
+	auto delay = r.delay ? 2*r.delay : r.min_delay;
+	r.delay = delay < r.max_delay ? delay : r.max_delay;
+
+	r.next = now + r.delay;
+}
+
+constexpr void on_connected(_Inout_ reconnector &r, _In_ INT64 now)
+{
+	auto &st = r.stat;
+
+	++st.attempts;
+	++st.reconnects;
+
+	st.last_latency = now - r.lost;
+	st.sum_latency += st.last_latency;
+
+	if (st.last_latency > st.max_latency) {
+		st.max_latency = st.last_latency;
+	}
+
+	r.state = reconnect_state::connected;
+}
+
+/*
+ * Makes attempts until one succeeds or the grace period expires, on_lost must be called before.
+ * @param aborted is returned if wait returns false
+ * @param now() returns local time
+ * @param wait(ticks) waits before the next attempt, ticks can be zero; returns false if reconnect must be aborted
+ * @param attempt() returns zero if a new session was established, otherwise an error
+ * @return zero or the error of the last attempt or aborted
+ */
+template<typename S, typename N, typename W, typename A>
+inline S run(_Inout_ reconnector &r, _In_ S aborted, _In_ N &&now, _In_ W &&wait, _In_ A &&attempt)
+{
+	S st = aborted;
+
+	for (INT64 ticks; (ticks = get_wait(r, now())) >= 0; ) {
+		if (!wait(ticks)) {
+			return aborted;
+		}
+
+		st = attempt();
+		if (!st) {
+			on_connected(r, now());
+			break;
+		}
+
+		on_attempt_failed(r, now());
+	}
+
+	return st;
+}
+
+} // namespace usbip
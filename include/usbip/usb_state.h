@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <basetsd.h>
+#include <sal.h>
+
+/*
+ * Tracking of the standard state of a device, it does not depend on WDK.
+ * GET_CONFIGURATION, GET_INTERFACE and GET_STATUS (device, interface) can be answered locally
+ * if the state was set by requests that the client has seen, otherwise they must be sent to the device.
+ * Endpoint's GET_STATUS is never answered because a halt is set by the device itself.
+ *
+ * A request that changes the state makes it unknown when it is sent, the new state is applied
+ * when the device has completed the request successfully. Thus a cancelled or unlinked request
+ * leaves the state unknown.
+ * @see tests/usb_state_test.cpp
+ */
+
+namespace usbip
+{
+
+/*
+ * Binary compatible with USB_DEFAULT_PIPE_SETUP_PACKET.
+ */
+struct usb_setup
+{
+	UINT8 bmRequestType;
+	UINT8 bRequest;
+	UINT16 wValue;
+	UINT16 wIndex;
+	UINT16 wLength;
+};
+static_assert(sizeof(usb_setup) == 8);
+
+struct usb_state
+{
+	enum { MAX_INTERFACES = 32 };
+
+	bool config_known;
+	UINT8 configuration; // bConfigurationValue, zero if unconfigured
+
+	bool attributes_known;
+	bool self_powered; // from bmAttributes of the configuration descriptor, GET_STATUS is not answered if set
+
+	bool remote_wakeup_known;
+	bool remote_wakeup; // DEVICE_REMOTE_WAKEUP feature
+
+	UINT32 interfaces; // bitmask of interface numbers of the configuration
+	UINT32 alt_known; // bitmask
+	UINT8 alt_settings[MAX_INTERFACES];
+
+	struct {
+		bool valid; // SELECT_CONFIGURATION was sent as SET_CONFIGURATION, @see on_select_configuration
+		UINT8 configuration;
+		UINT8 bmAttributes;
+		UINT32 interfaces;
+	} pending;
+
+	UINT64 avoided; // round trips, requests were answered locally
+};
+
+namespace usb_state_impl
+{
+
+enum : UINT8 {
+	DIR_IN = 0x80,
+	TYPE_MASK = 0x60, TYPE_STANDARD = 0,
+	RECIP_MASK = 0x1F, RECIP_DEVICE = 0, RECIP_INTERFACE = 1, RECIP_ENDPOINT = 2,
+};
+
+enum : UINT8 { // bRequest
+	GET_STATUS = 0, CLEAR_FEATURE = 1, SET_FEATURE = 3, 
+	GET_CONFIGURATION = 8, SET_CONFIGURATION = 9, GET_INTERFACE = 10, SET_INTERFACE = 11,
+};
+
+enum : UINT16 { DEVICE_REMOTE_WAKEUP = 1 }; // feature selector
+enum : UINT8 { SELF_POWERED = 0x40 }; // bmAttributes of the configuration descriptor
+
+constexpr auto is_standard(_In_ const usb_setup &s, _In_ UINT8 recipient)
+{
+	return (s.bmRequestType & (TYPE_MASK | RECIP_MASK)) == (TYPE_STANDARD | recipient);
+}
+
+constexpr auto is_in(_In_ const usb_setup &s) { return s.bmRequestType & DIR_IN; }
+
+constexpr UINT32 bit(_In_ UINT32 n) { return n < usb_state::MAX_INTERFACES ? 1U << n : 0; }
+
+constexpr void unknown_configuration(_Inout_ usb_state &st)
+{
+	st.config_known = false;
+	st.attributes_known = false;
+	st.interfaces = st.alt_known = 0;
+	st.pending.valid = false;
+}
+
+/*
+ * All interfaces of the configuration are in the alternate setting zero.
+ * @param configuration zero if unconfigured
+ * @param interfaces bitmask of interface numbers
+ */
+constexpr void set_configuration(
+	_Inout_ usb_state &st, _In_ UINT8 configuration, _In_ UINT8 bmAttributes, _In_ UINT32 interfaces)
+{
+	st.config_known = true;
+	st.configuration = configuration;
+
+	st.attributes_known = configuration;
+	st.self_powered = bmAttributes & SELF_POWERED;
+
+	st.interfaces = configuration ? interfaces : 0;
+	st.alt_known = st.interfaces;
+
+	for (auto &alt: st.alt_settings) {
+		alt = 0;
+	}
+}
+
+constexpr void set_interface(_Inout_ usb_state &st, _In_ UINT16 intf, _In_ UINT8 alt)
+{
+	if (auto b = bit(intf); b & st.interfaces) {
+		st.alt_settings[intf] = alt;
+		st.alt_known |= b;
+	}
+}
+
+} // namespace usb_state_impl
+
+
+/*
+ * The state is unknown, for example, after a reset of the device.
+ */
+constexpr void forget(_Inout_ usb_state &st)
+{
+	auto avoided = st.avoided;
+	st = {};
+	st.avoided = avoided;
+}
+
+/*
+ * A control request is being sent to the device, the state it changes is unknown until on_success.
+ * SELECT_INTERFACE is sent as SET_INTERFACE, SELECT_CONFIGURATION uses on_select_configuration instead.
+ */
+constexpr void on_request(_Inout_ usb_state &st, _In_ const usb_setup &s)
+{
+	using namespace usb_state_impl;
+
+	if (is_in(s)) {
+		//
+	} else if (is_standard(s, RECIP_DEVICE)) {
+		switch (s.bRequest) {
+		case SET_CONFIGURATION:
+			unknown_configuration(st);
+			break;
+		case SET_FEATURE:
+		case CLEAR_FEATURE:
+			if (s.wValue == DEVICE_REMOTE_WAKEUP) {
+				st.remote_wakeup_known = false;
+			}
+			break;
+		}
+	} else if (is_standard(s, RECIP_INTERFACE) && s.bRequest == SET_INTERFACE) {
+		st.alt_known &= ~bit(s.wIndex);
+	}
+}
+
+/*
+ * SELECT_CONFIGURATION is being sent as SET_CONFIGURATION, the interfaces and attributes it carries
+ * are applied by on_success.
+ * @param configuration zero if unconfigured
+ * @param interfaces bitmask of interface numbers
+ */
+constexpr void on_select_configuration(
+	_Inout_ usb_state &st, _In_ UINT8 configuration, _In_ UINT8 bmAttributes, _In_ UINT32 interfaces)
+{
+	usb_state_impl::unknown_configuration(st);
+	st.pending = { 
+		.valid = true, 
+		.configuration = configuration, 
+		.bmAttributes = bmAttributes, 
+		.interfaces = interfaces 
+	};
+}
+
+/*
+ * The device has completed a control request successfully.
+ */
+constexpr void on_success(_Inout_ usb_state &st, _In_ const usb_setup &s)
+{
+	using namespace usb_state_impl;
+
+	if (is_in(s)) {
+		//
+	} else if (is_standard(s, RECIP_DEVICE)) {
+		switch (s.bRequest) {
+		case SET_CONFIGURATION:
+			if (auto &p = st.pending; p.valid && p.configuration == s.wValue) {
+				set_configuration(st, p.configuration, p.bmAttributes, p.interfaces);
+			} else { // interfaces are unknown
+				unknown_configuration(st);
+				st.config_known = true;
+				st.configuration = static_cast<UINT8>(s.wValue);
+			}
+			st.pending.valid = false;
+			break;
+		case SET_FEATURE:
+		case CLEAR_FEATURE:
+			if (s.wValue == DEVICE_REMOTE_WAKEUP) {
+				st.remote_wakeup_known = true;
+				st.remote_wakeup = s.bRequest == SET_FEATURE;
+			}
+			break;
+		}
+	} else if (is_standard(s, RECIP_INTERFACE) && s.bRequest == SET_INTERFACE) {
+		set_interface(st, s.wIndex, static_cast<UINT8>(s.wValue));
+	}
+}
+
+/*
+ * A control request has failed, the state it changes is unknown now.
+ */
+constexpr void on_error(_Inout_ usb_state &st, _In_ const usb_setup &s)
+{
+	using namespace usb_state_impl;
+
+	if (is_in(s)) {
+		//
+	} else if (is_standard(s, RECIP_DEVICE)) {
+		switch (s.bRequest) {
+		case SET_CONFIGURATION:
+			forget(st);
+			break;
+		case SET_FEATURE:
+		case CLEAR_FEATURE:
+			if (s.wValue == DEVICE_REMOTE_WAKEUP) {
+				st.remote_wakeup_known = false;
+			}
+			break;
+		}
+	} else if (is_standard(s, RECIP_INTERFACE) && s.bRequest == SET_INTERFACE) {
+		st.alt_known &= ~bit(s.wIndex);
+	}
+}
+
+/*
+ * @param super_speed or faster, GET_STATUS has bits for U1, U2, LTM and function remote wake that are not tracked
+ * @param buf receives the answer if the result is not zero
+ * @return number of bytes of the answer, zero if the request must be sent to the device
+ */
+constexpr UINT16 answer(
+	_Inout_ usb_state &st, _In_ const usb_setup &s, _In_ bool super_speed, _Out_writes_bytes_(2) UINT8 *buf)
+{
+	using namespace usb_state_impl;
+
+	if (!(is_in(s) && s.wLength)) {
+		return 0;
+	}
+
+	UINT16 len = 0;
+
+	if (is_standard(s, RECIP_DEVICE)) {
+		switch (s.bRequest) {
+		case GET_CONFIGURATION:
+			if (st.config_known && !s.wValue && !s.wIndex && s.wLength == 1) {
+				buf[0] = st.configuration;
+				len = 1;
+			}
+			break;
+		case GET_STATUS: // a self-powered device can also be bus-powered, the current source is known to it only
+			if (!super_speed && st.attributes_known && !st.self_powered && st.remote_wakeup_known && 
+			    !s.wValue && !s.wIndex && s.wLength == 2) {
+				buf[0] = static_cast<UINT8>(st.remote_wakeup << 1);
+				buf[1] = 0;
+				len = 2;
+			}
+			break;
+		}
+	} else if (is_standard(s, RECIP_INTERFACE) && st.config_known && st.configuration && 
+		   (bit(s.wIndex) & st.interfaces) && !s.wValue) {
+		switch (s.bRequest) {
+		case GET_INTERFACE:
+			if (bit(s.wIndex) & st.alt_known && s.wLength == 1) {
+				buf[0] = st.alt_settings[s.wIndex];
+				len = 1;
+			}
+			break;
+		case GET_STATUS:
+			if (!super_speed && s.wLength == 2) {
+				buf[0] = buf[1] = 0; // reserved
+				len = 2;
+			}
+			break;
+		}
+	}
+
+	if (len) {
+		++st.avoided;
+	}
+
+	return len;
+}
+
+} // namespace usbip
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * Minimal checks and timing for the portable tests, they do not need any framework.
+ * A benchmark runs shortly if it is passed --quick, ctest does that.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+namespace test
+{
+
+inline int failures;
+
+inline void fail(const char *expr, const char *file, int line)
+{
+	fprintf(stderr, "%s(%d): CHECK(%s) failed\n", file, line, expr);
+	++failures;
+}
+
+#define CHECK(expr) ((expr) ? (void)0 : test::fail(#expr, __FILE__, __LINE__))
+
+/*
+ * @return exit code of main
+ */
+inline int result(const char *name)
+{
+	if (failures) {
+		fprintf(stderr, "%s: %d check(s) failed\n", name, failures);
+	} else {
+		printf("%s: passed\n", name);
+	}
+
+	return failures != 0;
+}
+
+inline bool quick(int argc, char *argv[])
+{
+	return argc > 1 && !strcmp(argv[1], "--quick");
+}
+
+/*
+ * Prevents the compiler from discarding a computation.
+ */
+inline volatile char sink;
+
+template<typename T>
+inline void keep(const T &val)
+{
+	sink = *reinterpret_cast<const volatile char*>(&val);
+}
+
+/*
+ * @return nanoseconds per call of f
+ */
+template<typename F>
+inline double measure(size_t calls, F &&f)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < calls; ++i) {
+		f();
+	}
+
+	std::chrono::duration<double, std::nano> d = std::chrono::steady_clock::now() - start;
+	return calls ? d.count()/calls : 0;
+}
+
+} // namespace test
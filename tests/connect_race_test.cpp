@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * usbip::connect_race and usbip::interleave.
+ * The race is run over loopback TCP against live, refusing and black-holed listeners.
+ * A black hole is a listener whose accept queue is full, the kernel drops SYNs to it silently
+ * as a firewall or a dead host does. The loop mirrors drivers/ude/happy_eyeballs.cpp, run
+ * and userspace/libusbip/src/remote.cpp, race.
+ */
+
+#include "check.h"
+
+#include <usbip/connect_race.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+enum { DELAY = 100 }; // ms, "Connection Attempt Delay"
+
+inline INT64 now()
+{
+	using namespace std::chrono;
+	return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Fake ADDRINFOEX for interleave.
+ */
+struct fake_ai
+{
+	int ai_family;
+	fake_ai *ai_next;
+	int id;
+};
+
+/*
+ * @param families of the list, '4' or '6'
+ * @return ids of the result, the families follow them
+ */
+std::string interleaved(const char *families, int max = 16)
+{
+	std::vector<fake_ai> v;
+	for (auto f = families; *f; ++f) {
+		v.push_back({*f == '4' ? AF_INET : AF_INET6, nullptr, int(f - families)});
+	}
+
+	for (size_t i = 0; i + 1 < v.size(); ++i) {
+		v[i].ai_next = &v[i + 1];
+	}
+
+	fake_ai* result[16]{};
+	auto cnt = interleave(v.empty() ? nullptr : v.data(), result, max);
+
+	std::string s;
+	for (int i = 0; i < cnt; ++i) {
+		s += families[result[i]->id];
+		s += char('0' + result[i]->id);
+	}
+	return s;
+}
+
+void check_interleave()
+{
+	CHECK(interleaved("") == "");
+	CHECK(interleaved("4") == "40");
+	CHECK(interleaved("6") == "60");
+	CHECK(interleaved("444") == "404142");
+	CHECK(interleaved("6644") == "60426143");
+	CHECK(interleaved("4666") == "40616263");
+	CHECK(interleaved("6464") == "60416243");
+	CHECK(interleaved("66644") == "6043614462");
+	CHECK(interleaved("46") == "4061");
+	CHECK(interleaved("6644", 3) == "604261"); // the rest is ignored
+	CHECK(interleaved("6644", 0) == "");
+}
+
+void check_state()
+{
+	connect_race r;
+	init(r, 3, DELAY, 1000);
+
+	CHECK(!get_wait(r, 1000)); // the first attempt is immediate
+	on_started(r, 1000);
+
+	CHECK(get_wait(r, 1000) == DELAY);
+	CHECK(get_wait(r, 1000 + DELAY/2) == DELAY/2);
+	CHECK(!get_wait(r, 1000 + 2*DELAY)); // late
+	on_started(r, 1000 + DELAY);
+	CHECK(get_pending(r) == 2);
+
+	on_failed(r);
+	on_failed(r);
+	CHECK(!get_pending(r));
+	CHECK(!get_wait(r, 1000 + DELAY + 1)); // no need to wait if nothing is pending
+	CHECK(!is_lost(r));
+
+	on_started(r, 1000 + DELAY + 1);
+	CHECK(get_wait(r, 1000 + DELAY + 1) < 0); // all were started
+	on_failed(r);
+	CHECK(is_lost(r));
+	CHECK(get_latency(r, 1500) == 500);
+
+	init(r, 0, -1, 0);
+	CHECK(is_lost(r));
+	CHECK(get_wait(r, 0) < 0);
+	CHECK(!r.delay);
+}
+
+/*
+ * Listening socket on the loopback.
+ */
+struct listener
+{
+	int fd = -1;
+	sockaddr_storage addr{};
+	std::vector<int> fillers; // connections that fill the accept queue
+
+	listener(int family, bool black_hole)
+	{
+		fd = socket(family, SOCK_STREAM, 0);
+		CHECK(fd >= 0);
+
+		socklen_t len;
+
+		if (family == AF_INET) {
+			auto &a = reinterpret_cast<sockaddr_in&>(addr);
+			a.sin_family = AF_INET;
+			a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			len = sizeof(a);
+		} else {
+			auto &a = reinterpret_cast<sockaddr_in6&>(addr);
+			a.sin6_family = AF_INET6;
+			a.sin6_addr = in6addr_loopback;
+			len = sizeof(a);
+		}
+
+		CHECK(!bind(fd, reinterpret_cast<sockaddr*>(&addr), len));
+		CHECK(!getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len));
+		CHECK(!listen(fd, black_hole ? 0 : 16));
+
+		if (black_hole) { // the queue of zero length holds one connection
+			auto s = socket(family, SOCK_STREAM, 0);
+			CHECK(!connect(s, reinterpret_cast<sockaddr*>(&addr), len));
+			fillers.push_back(s);
+		}
+	}
+
+	~listener()
+	{
+		for (auto s: fillers) {
+			close(s);
+		}
+		close(fd);
+	}
+
+	/*
+	 * The port is closed, connect is refused.
+	 */
+	void shutdown()
+	{
+		close(fd);
+		fd = -1;
+	}
+};
+
+auto get_len(const sockaddr_storage &a)
+{
+	return socklen_t(a.ss_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6));
+}
+
+struct result
+{
+	int winner = -1; // index of the address
+	int started;
+	int failed;
+	INT64 latency; // ms
+	bool timed_out;
+};
+
+struct attempt
+{
+	int fd = -1;
+	bool pending;
+};
+
+/*
+ * @return zero, EINPROGRESS or an error
+ */
+int start(attempt &a, const sockaddr_storage &addr)
+{
+	a.fd = socket(addr.ss_family, SOCK_STREAM, 0);
+	fcntl(a.fd, F_SETFL, fcntl(a.fd, F_GETFL) | O_NONBLOCK);
+
+	auto err = connect(a.fd, reinterpret_cast<const sockaddr*>(&addr), get_len(addr)) ? errno : 0;
+	a.pending = err == EINPROGRESS;
+	return err;
+}
+
+/*
+ * @return index of the completed attempt, -1 if timed out
+ */
+int wait(std::vector<attempt> &v, INT64 timeout)
+{
+	std::vector<pollfd> fds;
+	std::vector<int> index;
+
+	for (int i = 0; i < int(v.size()); ++i) {
+		if (v[i].pending) {
+			fds.push_back({v[i].fd, POLLOUT, 0});
+			index.push_back(i);
+		}
+	}
+
+	CHECK(!fds.empty());
+
+	if (poll(fds.data(), fds.size(), int(timeout)) > 0) {
+		for (size_t i = 0; i < fds.size(); ++i) {
+			if (fds[i].revents) {
+				return index[i];
+			}
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * @param timeout of the race in ms, zero means infinite
+ */
+result race(const std::vector<const sockaddr_storage*> &addrs, INT64 timeout = 0)
+{
+	int total = int(addrs.size());
+	std::vector<attempt> v(total);
+
+	connect_race r;
+	init(r, total, DELAY, now());
+
+	result res{};
+
+	while (!is_lost(r)) {
+		auto t = now();
+
+		if (timeout && get_latency(r, t) >= timeout) {
+			res.timed_out = true;
+			break;
+		}
+
+		int idx;
+		int err;
+
+		if (auto w = get_wait(r, t); !w) {
+			idx = r.started;
+			on_started(r, t);
+
+			if (err = start(v[idx], *addrs[idx]); err == EINPROGRESS) {
+				continue;
+			}
+		} else {
+			if (timeout) {
+				auto left = timeout - get_latency(r, t);
+				w = w < 0 || left < w ? left : w;
+			}
+
+			if (idx = wait(v, w); idx < 0) {
+				continue;
+			}
+
+			socklen_t len = sizeof(err);
+			getsockopt(v[idx].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			v[idx].pending = false;
+		}
+
+		if (!err) {
+			res.winner = idx;
+			break;
+		}
+
+		on_failed(r);
+		close(v[idx].fd);
+		v[idx].fd = -1;
+	}
+
+	res.started = r.started;
+	res.failed = r.failed;
+	res.latency = get_latency(r, now());
+
+	for (auto &a: v) { // the losers are cancelled
+		if (a.fd >= 0) {
+			close(a.fd);
+		}
+	}
+
+	return res;
+}
+
+void check_live()
+{
+	listener live(AF_INET, false);
+
+	auto res = race({&live.addr});
+	CHECK(res.winner == 0);
+	CHECK(res.started == 1);
+	CHECK(res.latency < DELAY);
+}
+
+/*
+ * A refused attempt does not cost the delay.
+ */
+void check_refused()
+{
+	listener live(AF_INET, false);
+	listener dead(AF_INET, false); // after live, its port can't be reused by live
+	dead.shutdown();
+
+	auto res = race({&dead.addr, &dead.addr, &live.addr});
+	CHECK(res.winner == 2);
+	CHECK(res.started == 3);
+	CHECK(res.failed == 2);
+	CHECK(res.latency < DELAY);
+
+	res = race({&dead.addr, &dead.addr});
+	CHECK(res.winner < 0);
+	CHECK(res.failed == 2);
+	CHECK(!res.timed_out);
+}
+
+/*
+ * A black-holed address costs the delay rather than a TCP timeout.
+ */
+void check_black_hole(int holes)
+{
+	listener hole(AF_INET, true);
+	listener live(AF_INET, false);
+
+	std::vector<const sockaddr_storage*> addrs(holes, &hole.addr);
+	addrs.push_back(&live.addr);
+
+	auto res = race(addrs);
+	CHECK(res.winner == holes);
+	CHECK(res.started == holes + 1);
+	CHECK(!res.failed); // the black-holed attempts are still pending
+	CHECK(res.latency >= holes*DELAY);
+	CHECK(res.latency < holes*DELAY + 1000);
+
+	printf("%d black hole(s): connected in %lld ms\n", holes, (long long)res.latency);
+}
+
+void check_timeout()
+{
+	listener hole(AF_INET, true);
+
+	auto res = race({&hole.addr, &hole.addr}, 3*DELAY);
+	CHECK(res.winner < 0);
+	CHECK(res.timed_out);
+	CHECK(res.started == 2);
+	CHECK(!res.failed);
+	CHECK(res.latency >= 3*DELAY);
+}
+
+/*
+ * IPv6 is black-holed, IPv4 works. Thanks to interleave the IPv4 address goes second
+ * and the connection is established after one delay, whatever the number of IPv6 addresses is.
+ */
+void check_interleaved_race()
+{
+	listener hole6(AF_INET6, true);
+	listener live4(AF_INET, false);
+
+	struct node
+	{
+		int ai_family;
+		node *ai_next;
+		const sockaddr_storage *addr;
+	};
+
+	node n[4] {
+		{AF_INET6, &n[1], &hole6.addr},
+		{AF_INET6, &n[2], &hole6.addr},
+		{AF_INET6, &n[3], &hole6.addr},
+		{AF_INET, nullptr, &live4.addr},
+	};
+
+	node* order[4]{};
+	auto cnt = interleave(n, order, 4);
+	CHECK(cnt == 4);
+
+	std::vector<const sockaddr_storage*> addrs;
+	for (int i = 0; i < cnt; ++i) {
+		addrs.push_back(order[i]->addr);
+	}
+
+	auto res = race(addrs);
+	CHECK(res.winner == 1);
+	CHECK(res.started == 2);
+	CHECK(res.latency >= DELAY);
+	CHECK(res.latency < 2*DELAY + 1000);
+}
+
+} // namespace
+
+
+int main()
+{
+	check_interleave();
+	check_state();
+
+	check_live();
+	check_refused();
+
+	for (int holes: {1, 2, 3}) {
+		check_black_hole(holes);
+	}
+
+	check_timeout();
+	check_interleaved_race();
+
+	return test::result("connect_race_test");
+}
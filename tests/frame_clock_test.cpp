@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * usbip::frame_clock against a simulated server's host controller whose clock drifts
+ * and reports only the lowest bits of its (micro)frame counter, as Linux EHCI and xHCI do.
+ */
+
+#include "check.h"
+
+#include <usbip/frame_clock.h>
+
+#include <random>
+
+namespace
+{
+
+using namespace usbip;
+
+constexpr INT64 TICKS_PER_FRAME = 10'000; // 100 ns units as KeQueryPerformanceCounter at 10 MHz
+
+struct server
+{
+	INT64 origin; // local time of frame zero
+	double ppm; // positive if the server's clock is slower
+
+	auto frame(INT64 now) const
+	{
+		return UINT32((now - origin)/(TICKS_PER_FRAME*(1 + ppm/1e6)));
+	}
+
+	/*
+	 * @return start_frame as it is reported, (micro)frame counter has 11 or 14 significant bits
+	 */
+	auto start_frame(INT64 now, usb_device_speed speed) const
+	{
+		auto f = frame(now);
+		return server_counts_microframes(speed) ? (f*frame_clock::MICROFRAMES & 0x3FFF) : (f & 0x7FF);
+	}
+};
+
+void check_units()
+{
+	static_assert(!server_counts_microframes(USB_SPEED_FULL));
+	static_assert(server_counts_microframes(USB_SPEED_HIGH));
+	static_assert(server_counts_microframes(USB_SPEED_SUPER));
+
+	static_assert(from_server_frame(800, USB_SPEED_HIGH) == 100);
+	static_assert(from_server_frame(807, USB_SPEED_HIGH) == 100); // any microframe of the frame
+	static_assert(from_server_frame(800, USB_SPEED_FULL) == 800);
+
+	static_assert(to_server_frame(100, USB_SPEED_HIGH) == 800);
+	static_assert(to_server_frame(100, USB_SPEED_FULL) == 100);
+	static_assert(from_server_frame(to_server_frame(12345, USB_SPEED_SUPER), USB_SPEED_SUPER) == 12345);
+}
+
+/*
+ * The clock is synchronized by completed transfers and must predict the server's frame.
+ */
+void check_tracking(usb_device_speed speed, double ppm)
+{
+	server srv{ .origin = -123'456'789, .ppm = ppm };
+
+	frame_clock c;
+	init(c, TICKS_PER_FRAME);
+	CHECK(!is_synced(c));
+
+	std::mt19937 rnd(static_cast<UINT32>(speed));
+	INT64 now = 1'000'000;
+
+	for (int i = 0; i < 20'000; ++i) { // about 20 seconds, the 11-bit counter wraps ten times
+		now += TICKS_PER_FRAME + rnd() % 200; // a transfer per frame, plus network jitter
+		auto frame = from_server_frame(srv.start_frame(now, speed), speed);
+		sync(c, now, frame);
+
+		if (i > 100) {
+			auto diff = INT32(get_frame(c, now) - to_clock_frame(c, frame, now));
+			CHECK(diff >= -1 && diff <= 1);
+		}
+	}
+
+	CHECK(is_synced(c));
+	CHECK(c.stat.resyncs == 1);
+
+	auto drift = get_drift_ppm(c.stat);
+	CHECK(drift > ppm - 50 && drift < ppm + 50);
+
+	auto f = get_frame(c, now);
+	CHECK(UINT32(f & 0x7FF) == (srv.frame(now) & 0x7FF) || UINT32((f + 1) & 0x7FF) == (srv.frame(now) & 0x7FF) ||
+	      UINT32((f - 1) & 0x7FF) == (srv.frame(now) & 0x7FF));
+
+	CHECK(is_schedulable(c, f + 16, now, 16));
+	CHECK(!is_schedulable(c, f + 15, now, 16));
+	CHECK(!is_schedulable(c, f + 1024, now, 16)); // ambiguous for the server
+	CHECK(!is_schedulable(c, f - 1, now, 0)); // in the past
+
+	CHECK(get_microframe(c, now)/frame_clock::MICROFRAMES == f);
+}
+
+/*
+ * Microframes of high-speed devices taken as frames make the clock run eight times faster,
+ * it lags behind by 56 frames constantly, this is what from_server_frame prevents.
+ */
+void check_unnormalized()
+{
+	server srv{ .origin = 0, .ppm = 0 };
+
+	frame_clock c;
+	init(c, TICKS_PER_FRAME);
+
+	INT64 now = 0;
+	for (int i = 0; i < 1000; ++i) {
+		now += TICKS_PER_FRAME;
+		sync(c, now, srv.start_frame(now, USB_SPEED_HIGH));
+	}
+
+	CHECK(get_drift_ppm(c.stat) < -800'000);
+	CHECK(c.stat.last_error < -50*TICKS_PER_FRAME);
+}
+
+void check_resync()
+{
+	frame_clock c;
+	init(c, TICKS_PER_FRAME);
+
+	INT64 now = 0;
+	for (UINT32 f = 0; f < 100; ++f, now += TICKS_PER_FRAME) {
+		sync(c, now, f);
+	}
+	CHECK(c.stat.resyncs == 1);
+
+	sync(c, now, 100 + 500); // the server's controller was restarted
+	CHECK(c.stat.resyncs == 2);
+	CHECK((get_frame(c, now) & 0x7FF) == 600);
+}
+
+} // namespace
+
+
+int main()
+{
+	check_units();
+
+	for (auto speed: {USB_SPEED_FULL, USB_SPEED_HIGH, USB_SPEED_SUPER}) {
+		for (double ppm: {0.0, 100.0, -300.0}) {
+			check_tracking(speed, ppm);
+		}
+	}
+
+	check_unnormalized();
+	check_resync();
+
+	return test::result("frame_clock_test");
+}
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * usbip::jitter_pacer driven as jitter_buffer does: transfers are held on completion,
+ * released by a timer that is set to get_timeout, some of them are cancelled while held.
+ */
+
+#include "check.h"
+
+#include <usbip/jitter_pacer.h>
+
+#include <deque>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+constexpr INT64 TICKS_PER_MICROFRAME = 1250; // 100 ns units
+
+struct buffer
+{
+	jitter_pacer p;
+	std::deque<UINT32> held; // microframes of each transfer
+	std::vector<INT64> released; // local time of each release
+
+	void take_due(INT64 now)
+	{
+		while (is_due(p, now)) {
+			CHECK(!held.empty());
+			on_release(p, held.front());
+			held.pop_front();
+			released.push_back(now);
+		}
+	}
+
+	void hold(INT64 now, UINT32 microframes)
+	{
+		held.push_back(microframes);
+		on_hold(p, now, microframes);
+		take_due(now);
+	}
+
+	/*
+	 * Fires the timer till the time.
+	 */
+	void run(INT64 from, INT64 until)
+	{
+		for (INT64 now = from; ; ) {
+			auto timeout = get_timeout(p, now);
+			if (timeout < 0 || (now += timeout) > until) {
+				break;
+			}
+			take_due(now);
+		}
+	}
+
+	auto sum_held() const
+	{
+		UINT32 n = 0;
+		for (auto m: held) {
+			n += m;
+		}
+		return n;
+	}
+};
+
+void check_isoch_microframes()
+{
+	CHECK(get_isoch_microframes(USB_SPEED_FULL, 4, 8) == 64); // bInterval is patched to 2^(4-1) microframes
+	CHECK(get_isoch_microframes(USB_SPEED_HIGH, 1, 8) == 8);
+	CHECK(get_isoch_microframes(USB_SPEED_HIGH, 2, 8) == 16);
+	CHECK(get_isoch_microframes(USB_SPEED_HIGH, 0, 8) == 8);
+	CHECK(get_isoch_microframes(USB_SPEED_HIGH, 17, 1) == 1U << 15);
+	CHECK(get_isoch_microframes(USB_SPEED_SUPER, 1, 32) == 32);
+	CHECK(get_isoch_microframes(USB_SPEED_LOW, 1, 2) == 16);
+}
+
+/*
+ * Nothing is released until the target is accumulated, after that the transfers are released
+ * exactly at the cadence, i.e. each one after the microframes the previous one spans.
+ */
+void check_cadence()
+{
+	enum { TARGET = 64, XFER = 8 };
+
+	buffer b;
+	init(b.p, TICKS_PER_MICROFRAME, TARGET);
+
+	INT64 now = 0;
+	for (int i = 0; i < TARGET/XFER - 1; ++i) {
+		b.hold(now, XFER);
+		CHECK(b.released.empty());
+		CHECK(get_timeout(b.p, now) < 0);
+	}
+
+	b.hold(now, XFER); // the target is reached
+	CHECK(b.released.size() == 1);
+	CHECK(b.p.depth == TARGET - XFER);
+
+	b.run(0, TARGET*TICKS_PER_MICROFRAME);
+	CHECK(b.held.empty());
+	CHECK(b.released.size() == TARGET/XFER);
+
+	for (size_t i = 1; i < b.released.size(); ++i) {
+		CHECK(b.released[i] - b.released[i - 1] == XFER*TICKS_PER_MICROFRAME);
+	}
+
+	auto &st = b.p.stat;
+	CHECK(st.held == TARGET/XFER);
+	CHECK(st.released == st.held);
+	CHECK(st.max_depth == TARGET);
+	CHECK(!st.underruns);
+	CHECK(get_timeout(b.p, b.released.back()) < 0);
+}
+
+/*
+ * The server delivers transfers in bursts with random delays, the average rate matches the cadence.
+ * Releases are never earlier than the cadence and the depth stays around the target.
+ */
+void check_bursts(unsigned seed)
+{
+	enum { XFER = 8, BURST = 4, TARGET = BURST*XFER + 2*XFER, CNT = 4000 }; // the target covers a burst and the jitter
+
+	buffer b;
+	init(b.p, TICKS_PER_MICROFRAME, TARGET);
+
+	std::mt19937 rnd(seed);
+	std::uniform_int_distribution<INT64> delay(0, XFER*TICKS_PER_MICROFRAME); // up to one transfer late
+
+	INT64 now = 0;
+	for (int i = 0; i < CNT; i += BURST) {
+		auto arrival = i*XFER*TICKS_PER_MICROFRAME + delay(rnd);
+		b.run(now, arrival);
+		now = arrival;
+
+		for (int j = 0; j < BURST; ++j) {
+			b.hold(now, XFER);
+		}
+	}
+
+	b.run(now, now + INT64(CNT)*XFER*TICKS_PER_MICROFRAME);
+	CHECK(b.held.empty());
+	CHECK(b.released.size() == CNT);
+
+	for (size_t i = 1; i < b.released.size(); ++i) {
+		CHECK(b.released[i] - b.released[i - 1] >= XFER*TICKS_PER_MICROFRAME || b.p.stat.underruns);
+	}
+
+	auto &st = b.p.stat;
+	CHECK(st.released == CNT);
+	CHECK(!st.underruns);
+	CHECK(st.sum_depth/st.released >= XFER);
+	CHECK(st.max_depth <= TARGET + BURST*XFER);
+}
+
+/*
+ * The buffer runs dry if the server is late, playback stops until the buffer is refilled.
+ */
+void check_underrun()
+{
+	enum { TARGET = 16, XFER = 8 };
+
+	buffer b;
+	init(b.p, TICKS_PER_MICROFRAME, TARGET);
+
+	b.hold(0, XFER);
+	b.hold(0, XFER);
+	b.run(0, TARGET*TICKS_PER_MICROFRAME);
+	CHECK(b.released.size() == 2);
+	CHECK(!b.p.depth);
+
+	auto late = 5*XFER*TICKS_PER_MICROFRAME; // after the buffer was "played"
+	b.hold(late, XFER);
+
+	auto &st = b.p.stat;
+	CHECK(st.underruns == 1);
+	CHECK(st.late_microframes == UINT64(late - 2*XFER*TICKS_PER_MICROFRAME)/TICKS_PER_MICROFRAME);
+	CHECK(b.released.size() == 2); // refilling
+	CHECK(get_timeout(b.p, late) < 0);
+
+	b.hold(late, XFER);
+	CHECK(b.released.size() == 3);
+	CHECK(b.released.back() == late);
+}
+
+/*
+ * A cancelled transfer is removed from the buffer, it does not shift the cadence of the rest.
+ */
+void check_cancel()
+{
+	enum { TARGET = 32, XFER = 8 };
+
+	buffer b;
+	init(b.p, TICKS_PER_MICROFRAME, TARGET);
+
+	for (int i = 0; i < TARGET/XFER; ++i) {
+		b.hold(0, XFER);
+	}
+	CHECK(b.released.size() == 1);
+
+	auto due = b.p.due;
+	b.held.pop_back();
+	on_cancel(b.p, XFER);
+
+	CHECK(b.p.stat.cancelled == 1);
+	CHECK(b.p.depth == b.sum_held());
+	CHECK(b.p.due == due);
+	CHECK(get_timeout(b.p, 0) == XFER*TICKS_PER_MICROFRAME);
+
+	while (!b.held.empty()) { // all are cancelled
+		b.held.pop_front();
+		on_cancel(b.p, XFER);
+	}
+
+	CHECK(!b.p.depth);
+	CHECK(get_timeout(b.p, 0) < 0); // the timer is not set again
+	CHECK(b.p.stat.cancelled == TARGET/XFER - 1);
+	CHECK(b.p.stat.released == 1);
+
+	on_cancel(b.p, XFER); // must not wrap
+	CHECK(!b.p.depth);
+}
+
+void check_flush()
+{
+	enum { TARGET = 32, XFER = 8 };
+
+	buffer b;
+	init(b.p, TICKS_PER_MICROFRAME, TARGET);
+
+	for (int i = 0; i < TARGET/XFER; ++i) {
+		b.hold(0, XFER);
+	}
+	CHECK(b.p.playing);
+
+	b.held.clear();
+	on_flush(b.p);
+
+	CHECK(!b.p.depth);
+	CHECK(!b.p.playing);
+	CHECK(get_timeout(b.p, 0) < 0);
+
+	b.hold(100*TICKS_PER_MICROFRAME, XFER); // is held till the target again, this is not an underrun
+	CHECK(b.released.size() == 1);
+	CHECK(!b.p.stat.underruns);
+}
+
+} // namespace
+
+
+int main()
+{
+	check_isoch_microframes();
+	check_cadence();
+
+	for (unsigned seed: {1U, 2U, 3U}) {
+		check_bursts(seed);
+	}
+
+	check_underrun();
+	check_cancel();
+	check_flush();
+
+	return test::result("jitter_pacer_test");
+}
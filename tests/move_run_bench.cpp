@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Expansion of the compacted buffer of isoch IN transfer of 8, 32, 128 and 1024 packets of 3 KiB:
+ * move runs versus memmove of each packet to its offset that fill_isoc_data did before.
+ * Short packets are rare for a camera (a frame ends), so 1 of 8 packets is short and the rest are full.
+ */
+
+#include "check.h"
+
+#include <usbip/move_run.h>
+
+#include <random>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+constexpr UINT32 MAX_LEN = 3*1024;
+
+struct packet
+{
+	UINT32 offset;
+	UINT32 actual_length;
+};
+
+void per_packet(UINT8 *buffer, const std::vector<packet> &packets, UINT32 length)
+{
+	for (auto i = packets.size(); i--; ) {
+		auto &p = packets[i];
+		length -= p.actual_length;
+
+		if (p.actual_length && p.offset != length) {
+			memmove(buffer + p.offset, buffer + length, p.actual_length);
+		}
+	}
+}
+
+void receive_only(UINT8*, const std::vector<packet>&, UINT32) {}
+
+void runs(UINT8 *buffer, const std::vector<packet> &packets, UINT32 length)
+{
+	move_run run{};
+
+	for (auto i = packets.size(); i--; ) {
+		auto &p = packets[i];
+		length -= p.actual_length;
+
+		if (p.actual_length) {
+			move(buffer, run, length, p.offset, p.actual_length);
+		}
+	}
+
+	flush(buffer, run);
+}
+
+using expand_f = void(UINT8*, const std::vector<packet>&, UINT32);
+
+double run(size_t cnt, size_t calls, expand_f *expand)
+{
+	std::mt19937 rnd(cnt);
+
+	std::vector<packet> packets(cnt);
+	UINT32 length = 0;
+
+	for (size_t i = 0; i < cnt; ++i) {
+		auto &p = packets[i];
+		p.offset = UINT32(i*MAX_LEN);
+		p.actual_length = rnd() % 8 ? MAX_LEN : rnd() % MAX_LEN;
+		length += p.actual_length;
+	}
+
+	std::vector<UINT8> compact(length);
+	for (auto &v: compact) {
+		v = UINT8(rnd());
+	}
+
+	std::vector<UINT8> buffer(cnt*MAX_LEN);
+
+	auto ns = test::measure(calls, [&] {
+		std::copy(compact.begin(), compact.end(), buffer.begin()); // receive
+		expand(buffer.data(), packets, length);
+		test::keep(buffer[0]);
+	});
+
+	UINT32 pos = 0;
+	for (auto &p: packets) {
+		if (expand == receive_only) {
+			break;
+		}
+		CHECK(std::equal(compact.begin() + pos, compact.begin() + pos + p.actual_length, buffer.begin() + p.offset));
+		pos += p.actual_length;
+	}
+
+	return ns;
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+	auto quick = test::quick(argc, argv);
+	printf("%8s %16s %16s\n", "packets", "memmove, us", "runs, us"); // excluding the copy of received data
+
+	for (size_t cnt: {8, 32, 128, 1024}) {
+		size_t calls = quick ? 2 : 200'000/cnt;
+
+		auto recv = run(cnt, calls, receive_only);
+		auto mm = run(cnt, calls, per_packet) - recv;
+		auto rn = run(cnt, calls, runs) - recv;
+
+		printf("%8zu %16.2f %16.2f\n", cnt, mm/1e3, rn/1e3);
+	}
+
+	return test::result("move_run_bench");
+}
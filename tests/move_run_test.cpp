@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * The compacted buffer of isoch IN transfer is expanded in place by move runs as fill_isoc_data does,
+ * the result must be the same as if each packet was copied to its offset from a separate buffer.
+ */
+
+#include "check.h"
+
+#include <usbip/move_run.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+struct packet
+{
+	UINT32 offset;
+	UINT32 actual_length;
+};
+
+/*
+ * @return number of runs
+ */
+auto expand(UINT8 *buffer, const std::vector<packet> &packets, UINT32 length)
+{
+	move_run run{};
+	int runs = 0;
+
+	for (auto i = packets.size(); i--; ) {
+		auto &p = packets[i];
+		if (!p.actual_length) {
+			continue;
+		}
+
+		length -= p.actual_length;
+		move(buffer, run, length, p.offset, p.actual_length);
+
+		runs += run.len == p.actual_length; // a new run was started
+	}
+
+	flush(buffer, run);
+
+	CHECK(!length);
+	return runs;
+}
+
+/*
+ * @param full_pct percentage of packets of max length
+ */
+void check(size_t cnt, UINT32 max_len, int full_pct, std::mt19937 &rnd)
+{
+	std::vector<packet> packets(cnt);
+	std::vector<UINT8> compact;
+
+	for (size_t i = 0; i < cnt; ++i) {
+		auto &p = packets[i];
+		p.offset = UINT32(i*max_len);
+		p.actual_length = int(rnd() % 100) < full_pct ? max_len : rnd() % max_len; // can be zero
+
+		for (UINT32 j = 0; j < p.actual_length; ++j) {
+			compact.push_back(UINT8(rnd()));
+		}
+	}
+
+	std::vector<UINT8> expected(cnt*max_len, 0xCC);
+	std::vector<UINT8> buffer = expected;
+
+	UINT32 pos = 0;
+	for (auto &p: packets) {
+		std::copy_n(compact.data() + pos, p.actual_length, expected.data() + p.offset);
+		pos += p.actual_length;
+	}
+
+	std::copy(compact.begin(), compact.end(), buffer.begin()); // as received
+	expand(buffer.data(), packets, UINT32(compact.size()));
+
+	for (auto &p: packets) { // padding between packets is garbage
+		CHECK(std::equal(expected.begin() + p.offset, expected.begin() + p.offset + p.actual_length, 
+				 buffer.begin() + p.offset));
+	}
+}
+
+void check_runs()
+{
+	std::vector<packet> packets;
+	std::vector<UINT8> buf(8*1024);
+
+	for (UINT32 i = 0; i < 8; ++i) {
+		packets.push_back({ .offset = i*1024, .actual_length = 1024 });
+	}
+	CHECK(expand(buf.data(), packets, 8*1024) == 1); // is not moved, the distance is zero
+
+	packets[0].actual_length = 1000; // 1..7 are shifted by 24 bytes at once
+	CHECK(expand(buf.data(), packets, 7*1024 + 1000) == 2);
+
+	packets[4].actual_length = 1000; // 5..7 are shifted by 48 bytes, 1..4 by 24
+	CHECK(expand(buf.data(), packets, 6*1024 + 2*1000) == 3);
+}
+
+} // namespace
+
+
+int main()
+{
+	std::mt19937 rnd(5);
+
+	for (size_t cnt: {1, 2, 8, 32, 128, 1024}) {
+		for (int full_pct: {0, 50, 90, 100}) {
+			check(cnt, 3*1024, full_pct, rnd);
+			check(cnt, 192, full_pct, rnd);
+		}
+	}
+
+	check_runs();
+	return test::result("move_run_test");
+}
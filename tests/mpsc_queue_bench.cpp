@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Throughput of libdrv::mpsc_queue with 1-16 producers versus a queue protected by a mutex,
+ * as send_lock serialized WskSend before. Consumption does a little work per item
+ * and per batch to stand in for building and issuing a WskSend.
+ */
+
+#include "check.h"
+
+#include <libdrv/mpsc_queue.h>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+struct item
+{
+	SLIST_ENTRY entry;
+	UINT64 payload;
+};
+
+using queue = libdrv::mpsc_queue<item, &item::entry>;
+
+std::atomic<UINT64> g_sum;
+
+inline void work(UINT64 &acc, UINT64 val)
+{
+	for (int i = 0; i < 16; ++i) {
+		acc = acc*6364136223846793005ULL + val;
+	}
+}
+
+template<typename F>
+double run(int producers, int items, F &&produce)
+{
+	std::vector<std::unique_ptr<item[]>> data;
+	for (int p = 0; p < producers; ++p) {
+		auto &v = data.emplace_back(std::make_unique<item[]>(items));
+		for (int i = 0; i < items; ++i) {
+			v[i].payload = i;
+		}
+	}
+
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+
+	for (int p = 0; p < producers; ++p) {
+		threads.emplace_back([&, p] { produce(data[p].get(), items); });
+	}
+
+	for (auto &t: threads) {
+		t.join();
+	}
+
+	std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+	return producers*double(items)/d.count()/1e6;
+}
+
+double run_mpsc(int producers, int items)
+{
+	queue q;
+	q.init();
+	std::atomic<UINT64> consumed{};
+
+	auto mops = run(producers, items, [&q, &consumed] (item *v, int cnt)
+	{
+		for (int i = 0; i < cnt; ++i) {
+			if (!q.push(v[i])) {
+				continue;
+			}
+
+			UINT64 acc = 0, n = 0;
+			q.drain([&] (auto &it) { work(acc, it.payload); ++n; }, [&acc] { work(acc, 1); });
+
+			consumed += n;
+			g_sum += acc;
+		}
+	});
+
+	CHECK(q.empty());
+	CHECK(consumed == UINT64(producers)*items);
+	return mops;
+}
+
+double run_mutex(int producers, int items)
+{
+	std::mutex m;
+	UINT64 consumed{};
+
+	auto mops = run(producers, items, [&m, &consumed] (item *v, int cnt)
+	{
+		for (int i = 0; i < cnt; ++i) {
+			UINT64 acc = 0;
+			std::lock_guard lck(m);
+			work(acc, v[i].payload);
+			work(acc, 1);
+			++consumed;
+			g_sum += acc;
+		}
+	});
+
+	CHECK(consumed == UINT64(producers)*items);
+	return mops;
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+	int items = test::quick(argc, argv) ? 10'000 : 2'000'000;
+	printf("%9s %16s %16s\n", "producers", "mpsc, Mitems/s", "mutex, Mitems/s");
+
+	for (int producers: {1, 2, 4, 8, 16}) {
+		auto mpsc = run_mpsc(producers, items);
+		auto mtx = run_mutex(producers, items);
+		printf("%9d %16.2f %16.2f\n", producers, mpsc, mtx);
+	}
+
+	test::keep(g_sum);
+	return test::result("mpsc_queue_bench");
+}
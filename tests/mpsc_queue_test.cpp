@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Stress test of libdrv::mpsc_queue: every pushed item is consumed exactly once, items of the same
+ * producer are consumed in the order of pushes, there is at most one consumer at a time and
+ * items pushed by the consumer while draining are consumed by the same drain.
+ */
+
+#include "check.h"
+
+#include <libdrv/mpsc_queue.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+struct item
+{
+	SLIST_ENTRY entry;
+	int producer; // -1 if it was pushed by the consumer
+	int seq;
+	bool consumed;
+};
+
+using queue = libdrv::mpsc_queue<item, &item::entry>;
+
+struct state
+{
+	queue q;
+	std::atomic<int> consumers;
+	std::atomic<long> consumed;
+	std::atomic<long> batches;
+	std::vector<int> last; // seq per producer, accessed by the consumer only
+	std::unique_ptr<item[]> followups; // pushed by the consumer
+	std::atomic<int> followups_used;
+	int followups_cnt;
+};
+
+void consume(state &st, item &it)
+{
+	CHECK(!it.consumed);
+	it.consumed = true;
+	++st.consumed;
+
+	if (it.producer < 0) {
+		return;
+	}
+
+	auto &last = st.last[it.producer];
+	CHECK(it.seq == last + 1);
+	last = it.seq;
+
+	if (!(it.seq % 97)) { // as a synchronous completion routine does
+		if (auto i = st.followups_used.fetch_add(1); i < st.followups_cnt) {
+			CHECK(!st.q.push(st.followups[i])); // the caller is the consumer already
+		}
+	}
+}
+
+/*
+ * The next consumer can start as soon as the previous one has consumed the last item,
+ * i.e. before drain returns, so exclusiveness is checked around the callback.
+ */
+void drain(state &st)
+{
+	st.q.drain([&st] (auto &it)
+	{
+		CHECK(st.consumers.fetch_add(1) == 0);
+		consume(st, it);
+		CHECK(st.consumers.fetch_sub(1) == 1);
+	},
+	[&st] { ++st.batches; });
+}
+
+void run(int producers, int items)
+{
+	state st;
+	st.q.init();
+	st.last.assign(producers, -1);
+
+	st.followups_cnt = producers*items/97 + producers;
+	st.followups = std::make_unique<item[]>(st.followups_cnt);
+	for (int i = 0; i < st.followups_cnt; ++i) {
+		st.followups[i].producer = -1;
+	}
+
+	std::vector<std::unique_ptr<item[]>> data;
+	data.reserve(producers); // threads refer to the elements
+
+	std::vector<std::thread> threads;
+
+	for (int p = 0; p < producers; ++p) {
+		auto &v = data.emplace_back(std::make_unique<item[]>(items));
+		threads.emplace_back([&st, &v, p, items]
+		{
+			for (int i = 0; i < items; ++i) {
+				auto &it = v[i];
+				it.producer = p;
+				it.seq = i;
+
+				if (st.q.push(it)) {
+					drain(st);
+				}
+			}
+		});
+	}
+
+	for (auto &t: threads) {
+		t.join();
+	}
+
+	CHECK(st.q.empty());
+
+	int used = std::min(st.followups_used.load(), st.followups_cnt);
+	CHECK(st.consumed == long(producers)*items + used);
+
+	for (int p = 0; p < producers; ++p) {
+		CHECK(st.last[p] == items - 1);
+	}
+
+	printf("%2d producer(s): %ld items in %ld batch(es), %d pushed while draining\n",
+		producers, st.consumed.load(), st.batches.load(), used);
+}
+
+} // namespace
+
+
+int main()
+{
+	for (int producers: {1, 2, 4, 8, 16}) {
+		run(producers, 100'000);
+	}
+
+	return test::result("mpsc_queue_test");
+}
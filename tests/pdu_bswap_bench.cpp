@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Byteswap of isoc descriptors of 8, 32, 128 and 1024 packets and of the header:
+ * pdu::bswap versus pdu::bswap_scalar. Each isoch URB is swapped twice, on send and on receive.
+ */
+
+#include "check.h"
+
+#include <usbip/pdu.h>
+
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * The scalar loop must not be vectorized by the compiler, otherwise both columns measure the same.
+ */
+#if defined(__GNUC__)
+__attribute__((noinline, optimize("no-tree-vectorize")))
+#endif
+void scalar(UINT32 *v, size_t cnt)
+{
+	pdu::bswap_scalar(v, cnt);
+}
+
+void run_descriptors(bool quick)
+{
+	printf("%8s %14s %14s\n", "packets", "simd, ns", "scalar, ns");
+
+	for (size_t packets: {8, 32, 128, 1024}) {
+		std::vector<iso_packet_descriptor> v(packets);
+		for (UINT32 i = 0; i < packets; ++i) {
+			v[i] = { .offset = i*3072, .length = 3072, .actual_length = i, .status = 0 };
+		}
+
+		auto ref = v;
+		size_t calls = quick ? 100 : 200'000'000/(packets + 16);
+
+		auto simd = test::measure(calls, [&v] { byteswap(v.data(), v.size()); test::keep(v[0]); });
+		auto fields = packets*sizeof(v[0])/sizeof(UINT32);
+		auto sc = test::measure(calls, [&v, fields] { scalar(&v[0].offset, fields); test::keep(v[0]); });
+
+		CHECK(!memcmp(v.data(), ref.data(), packets*sizeof(v[0]))); // even number of swaps in total
+		printf("%8zu %14.1f %14.1f\n", packets, simd, sc);
+	}
+}
+
+void run_header(bool quick)
+{
+	header hdr{};
+	hdr.command = RET_SUBMIT;
+	hdr.seqnum = 0x100;
+	hdr.ret_submit.actual_length = 512;
+
+	size_t calls = quick ? 1000 : 100'000'000;
+	auto fields = pdu::get_desc(RET_SUBMIT).swap_fields;
+
+	auto simd = test::measure(calls, [&hdr] { byteswap_header(hdr, swap_dir::host2net); test::keep(hdr.seqnum); });
+	auto sc = test::measure(calls, [&hdr, fields] { scalar(&hdr.command, fields); test::keep(hdr.seqnum); });
+
+	printf("%8s %14.1f %14.1f\n", "header", simd, sc);
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+	auto quick = test::quick(argc, argv);
+
+	run_descriptors(quick);
+	run_header(quick);
+
+	return test::result("pdu_bswap_bench");
+}
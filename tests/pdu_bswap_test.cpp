@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * The vectorized pdu::bswap must be bit-identical to pdu::bswap_scalar for any length and alignment,
+ * byteswap_header and byteswap of isoc descriptors must be reversible.
+ */
+
+#include "check.h"
+
+#include <usbip/pdu.h>
+
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+void check_value()
+{
+	CHECK(pdu::bswap(UINT32(0x01020304)) == 0x04030201);
+
+	UINT32 v[] { 0x01020304, 0xA1B2C3D4, 0, 0xFFFFFFFF, 0x80000001 };
+	pdu::bswap(v, std::size(v));
+
+	UINT32 expected[] { 0x04030201, 0xD4C3B2A1, 0, 0xFFFFFFFF, 0x01000080 };
+	CHECK(!memcmp(v, expected, sizeof(v)));
+}
+
+void check_identical()
+{
+	std::mt19937 rnd(7);
+	std::vector<UINT32> src(300 + 1);
+
+	for (auto &v: src) {
+		v = rnd();
+	}
+
+	for (size_t offset = 0; offset < 4; ++offset) { // in bytes, loads and stores are unaligned
+		for (size_t cnt = 0; cnt <= 256; ++cnt) {
+
+			std::vector<unsigned char> a(cnt*sizeof(UINT32) + offset);
+			memcpy(a.data() + offset, src.data(), cnt*sizeof(UINT32));
+			auto b = a;
+
+			pdu::bswap(reinterpret_cast<UINT32*>(a.data() + offset), cnt);
+			pdu::bswap_scalar(reinterpret_cast<UINT32*>(b.data() + offset), cnt);
+
+			CHECK(a == b);
+		}
+	}
+}
+
+void check_descriptors()
+{
+	iso_packet_descriptor d[13]{};
+	for (UINT32 i = 0; i < std::size(d); ++i) {
+		d[i] = { .offset = i*1024, .length = 1024, .actual_length = i, .status = UINT32(-i) };
+	}
+
+	auto orig = d[5];
+	byteswap(d, std::size(d));
+	CHECK(d[5].length == pdu::bswap(UINT32(1024)));
+
+	byteswap(d, std::size(d));
+	CHECK(!memcmp(&d[5], &orig, sizeof(orig)));
+}
+
+void check_header()
+{
+	header hdr{};
+	hdr.command = CMD_SUBMIT;
+	hdr.seqnum = 0x12345678;
+	hdr.devid = 0x10002;
+	hdr.direction = direction::in;
+	hdr.ep = 1;
+	hdr.cmd_submit.transfer_buffer_length = 4096;
+	hdr.cmd_submit.number_of_packets = 8;
+	for (int i = 0; i < 8; ++i) {
+		hdr.cmd_submit.setup[i] = UINT8(i + 1);
+	}
+
+	auto orig = hdr;
+
+	byteswap_header(hdr, swap_dir::host2net);
+	CHECK(hdr.command == pdu::bswap(UINT32(CMD_SUBMIT)));
+	CHECK(hdr.cmd_submit.transfer_buffer_length == INT32(pdu::bswap(UINT32(4096))));
+	CHECK(!memcmp(hdr.cmd_submit.setup, orig.cmd_submit.setup, sizeof(orig.cmd_submit.setup))); // is not swapped
+
+	byteswap_header(hdr, swap_dir::net2host);
+	CHECK(!memcmp(&hdr, &orig, sizeof(hdr)));
+}
+
+} // namespace
+
+
+int main()
+{
+	check_value();
+	check_identical();
+	check_descriptors();
+	check_header();
+
+	return test::result("pdu_bswap_test");
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Throughput of the codec of include/usbip/pdu.h: encode of CMD_SUBMIT, decode_response of RET_SUBMIT,
+ * get_total_size and get_isoc_descr, for non-isoch PDUs and isoch ones with 8 and 32 packets.
+ * Results of each call are verified too.
+ */
+
+#include "check.h"
+
+#include <usbip/pdu.h>
+
+#include <cstring>
+#include <memory>
+
+namespace
+{
+
+using namespace usbip;
+
+enum { TRANSFER_LEN = 3072 };
+
+struct pdu_buf
+{
+	std::unique_ptr<char[]> buf;
+	header &hdr;
+
+	explicit pdu_buf(INT32 packets) :
+		buf(std::make_unique<char[]>(sizeof(header) + TRANSFER_LEN + (packets > 0 ? packets : 0)*sizeof(iso_packet_descriptor))),
+		hdr(*reinterpret_cast<header*>(buf.get())) {}
+};
+
+/*
+ * @param packets number_of_packets_non_isoch or the number of isoc packets
+ */
+void make_cmd_submit(header &hdr, INT32 packets)
+{
+	hdr = {};
+	hdr.command = CMD_SUBMIT;
+	hdr.seqnum = 0x20;
+	hdr.devid = 0x10002;
+	hdr.direction = direction::out;
+	hdr.ep = 2;
+	hdr.cmd_submit.transfer_buffer_length = TRANSFER_LEN;
+	hdr.cmd_submit.number_of_packets = packets;
+}
+
+/*
+ * Makes the server's response to IN request in wire format.
+ */
+void make_ret_submit(header &hdr, INT32 packets)
+{
+	hdr = {};
+	hdr.command = RET_SUBMIT;
+	hdr.seqnum = 0x21; // IN
+	hdr.ret_submit.actual_length = TRANSFER_LEN;
+	hdr.ret_submit.number_of_packets = packets;
+
+	if (packets > 0) {
+		iso_packet_descriptor *isoc{};
+		hdr.direction = direction::in; // for get_isoc_descr
+		get_isoc_descr(isoc, hdr);
+
+		for (INT32 i = 0; i < packets; ++i) {
+			isoc[i] = { .offset = UINT32(i*TRANSFER_LEN/packets), .length = UINT32(TRANSFER_LEN/packets),
+				    .actual_length = 0, .status = 0 };
+		}
+
+		byteswap(isoc, packets);
+		hdr.direction = 0; // always zero in server response
+	}
+
+	byteswap_header(hdr, swap_dir::host2net);
+}
+
+void run(INT32 packets, size_t calls)
+{
+	auto isoc_cnt = packets > 0 ? size_t(packets) : 0;
+
+	pdu_buf cmd(packets);
+	make_cmd_submit(cmd.hdr, packets);
+	auto total = sizeof(header) + TRANSFER_LEN + isoc_cnt*sizeof(iso_packet_descriptor); // OUT
+
+	auto encode = test::measure(calls, [&cmd] {
+		byteswap_payload(cmd.hdr); // before the header, it reads the header in host byte order
+		byteswap_header(cmd.hdr, swap_dir::host2net);
+
+		byteswap_header(cmd.hdr, swap_dir::net2host); // back, to encode the same PDU next time
+		byteswap_payload(cmd.hdr);
+	});
+
+	CHECK(cmd.hdr.cmd_submit.transfer_buffer_length == TRANSFER_LEN);
+
+	pdu_buf ret(packets);
+	make_ret_submit(ret.hdr, packets);
+	header wire = ret.hdr;
+
+	size_t payload_size{};
+	bool ok = true;
+
+	auto decode = test::measure(calls, [&] {
+		ret.hdr = wire;
+		ok &= decode_response(ret.hdr, payload_size) == decode_error::none;
+		byteswap_payload(ret.hdr);
+		test::keep(ret.hdr.ret_submit.status);
+	});
+
+	CHECK(ok);
+	CHECK(payload_size == TRANSFER_LEN + isoc_cnt*sizeof(iso_packet_descriptor));
+	CHECK(get_payload_size(ret.hdr) == payload_size);
+
+	size_t sizes = 0;
+	auto size = test::measure(calls, [&] {
+		iso_packet_descriptor *isoc{};
+		sizes += get_total_size(cmd.hdr) + get_isoc_descr(isoc, ret.hdr);
+		test::keep(isoc);
+	});
+
+	CHECK(sizes == calls*(total + isoc_cnt));
+
+	printf("%8d %12.1f %12.1f %12.1f\n", packets, encode/2, decode, size/2);
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+	size_t calls = test::quick(argc, argv) ? 1000 : 50'000'000;
+	printf("%8s %12s %12s %12s\n", "packets", "encode, ns", "decode, ns", "size, ns"); // -1 is non-isoch
+
+	for (INT32 packets: {INT32(number_of_packets_non_isoch), 8, 32}) {
+		run(packets, calls);
+	}
+
+	return test::result("pdu_codec_bench");
+}
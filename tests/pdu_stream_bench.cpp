@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * Parsing of a stream of short server's responses by usbip::feed, as recv_chunk of the driver does it:
+ * the stream is fed by chunks of one TCP segment, 16 KiB and 64 KiB (RECV_BUF_SIZE).
+ * The number of receive calls is compared with two calls per PDU with payload (header, then payload)
+ * that were made before the stream was parsed incrementally.
+ */
+
+#include "check.h"
+
+#include <usbip/pdu.h>
+#include <usbip/pdu_stream.h>
+
+#include <random>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+struct session
+{
+	std::vector<char> stream;
+	size_t pdus;
+	size_t receives; // header and payload are received by separate calls
+};
+
+auto make_session(size_t pdus)
+{
+	session s{ .stream = {}, .pdus = pdus, .receives = 0 };
+	std::mt19937 rnd(3);
+
+	for (UINT32 num = 1; num <= pdus; ++num) {
+		auto dir = rnd() % 4 ? direction::in : direction::out;
+		INT32 len = rnd() % 2 ? 8 : 64*(1 + rnd() % 8); // interrupt or short bulk
+
+		header h{};
+		h.command = RET_SUBMIT;
+		h.seqnum = num << 1 | dir;
+		h.ret_submit.actual_length = len;
+		h.ret_submit.number_of_packets = number_of_packets_non_isoch;
+		byteswap_header(h, swap_dir::host2net);
+
+		auto ptr = reinterpret_cast<char*>(&h);
+		s.stream.insert(s.stream.end(), ptr, ptr + sizeof(h));
+		++s.receives;
+
+		if (dir == direction::in) {
+			s.stream.insert(s.stream.end(), len, char(num));
+			++s.receives;
+		}
+	}
+
+	return s;
+}
+
+struct parser
+{
+	pdu_stream s{};
+	header hdr;
+	char buf[4096]; // URB transfer buffer
+	size_t pdus;
+
+	int feed(const void *data, size_t len)
+	{
+		return usbip::feed(s, hdr, data, len,
+			[this] { return decode_response(hdr, s.payload_len) == decode_error::none ? 0 : -1; },
+			[this] (auto src, auto cnt) { memcpy(buf + s.payload_done, src, cnt); },
+			[this] { ++pdus; });
+	}
+};
+
+void run(const session &ses, size_t chunk, size_t rounds)
+{
+	parser p{};
+	bool ok = true;
+
+	auto ns = test::measure(rounds, [&] {
+		for (size_t pos = 0; pos < ses.stream.size(); pos += chunk) {
+			ok &= !p.feed(ses.stream.data() + pos, std::min(chunk, ses.stream.size() - pos));
+		}
+	});
+
+	CHECK(ok);
+	CHECK(p.pdus == rounds*ses.pdus);
+	test::keep(p.buf[0]);
+
+	auto receives = (ses.stream.size() + chunk - 1)/chunk;
+	auto mbps = ses.stream.size()/ns*1e3;
+
+	printf("%8zu %10.0f %10.1f %12zu %12zu\n", chunk, mbps, ns/ses.pdus, ses.receives, receives);
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+	auto quick = test::quick(argc, argv);
+	auto ses = make_session(10'000);
+
+	printf("%zu PDUs, %zu bytes\n", ses.pdus, ses.stream.size());
+	printf("%8s %10s %10s %12s %12s\n", "chunk", "MB/s", "ns/PDU", "recv before", "recv now");
+
+	for (size_t chunk: {1460, 16*1024, 64*1024}) {
+		run(ses, chunk, quick ? 1 : 500);
+	}
+
+	return test::result("pdu_stream_bench");
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * The stream of server's responses is fed to usbip::feed by chunks of different sizes,
+ * the result must not depend on how the stream is split. A parser does what the receive engine
+ * of the driver does: decodes the header by decode_response and collects the payload.
+ */
+
+#include "check.h"
+
+#include <usbip/pdu.h>
+#include <usbip/pdu_stream.h>
+
+#include <cstring>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * Byte for byte what usbip-host sends for RET_SUBMIT of GET_DESCRIPTOR(DEVICE), RET_UNLINK (-ECONNRESET)
+ * and RET_SUBMIT of a bulk OUT transfer of 512 bytes.
+ */
+const unsigned char recorded[]
+{
+	0x00, 0x00, 0x00, 0x03,  0x00, 0x00, 0x00, 0x03,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x12,  0x00, 0x00, 0x00, 0x00,
+	0xff, 0xff, 0xff, 0xff,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,
+	0x12, 0x01, 0x00, 0x02,  0x00, 0x00, 0x00, 0x40,  0x6b, 0x1d, 0x02, 0x00,  0x10, 0x05, 0x03, 0x02,
+	0x01, 0x01,
+
+	0x00, 0x00, 0x00, 0x04,  0x00, 0x00, 0x00, 0x0a,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00,  0xff, 0xff, 0xff, 0x98,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,
+
+	0x00, 0x00, 0x00, 0x03,  0x00, 0x00, 0x00, 0x0c,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x02, 0x00,  0x00, 0x00, 0x00, 0x00,
+	0xff, 0xff, 0xff, 0xff,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,
+};
+
+struct pdu
+{
+	header hdr; // in host byte order
+	std::vector<char> payload;
+
+	bool operator ==(const pdu &p) const
+	{
+		return !memcmp(&hdr, &p.hdr, sizeof(hdr)) && payload == p.payload;
+	}
+};
+
+struct parser
+{
+	pdu_stream s{};
+	header hdr;
+	pdu cur;
+	std::vector<pdu> result;
+
+	int feed(const void *data, size_t len)
+	{
+		return usbip::feed(s, hdr, data, len,
+			[this] {
+				if (decode_response(hdr, s.payload_len) != decode_error::none) {
+					return -1;
+				}
+				cur = { .hdr = hdr, .payload = {} };
+				cur.payload.reserve(s.payload_len);
+				return 0;
+			},
+			[this] (auto src, auto cnt) {
+				CHECK(cur.payload.size() == s.payload_done);
+				cur.payload.insert(cur.payload.end(), src, src + cnt);
+			},
+			[this] {
+				CHECK(cur.payload.size() == s.payload_len);
+				result.push_back(std::move(cur));
+			});
+	}
+};
+
+/*
+ * @param chunk zero means random sizes
+ */
+auto parse(const std::vector<char> &stream, size_t chunk, std::mt19937 &rnd)
+{
+	parser p;
+
+	for (size_t pos = 0; pos < stream.size(); ) {
+		auto cnt = chunk ? chunk : 1 + rnd() % 200;
+		cnt = std::min(cnt, stream.size() - pos);
+
+		CHECK(!p.feed(stream.data() + pos, cnt));
+		pos += cnt;
+	}
+
+	CHECK(!p.s.hdr_len); // nothing is left
+	return p.result;
+}
+
+void append_ret_submit(std::vector<char> &stream, std::vector<pdu> &expected, 
+	UINT32 num, direction dir, INT32 actual_length, INT32 packets)
+{
+	pdu p{};
+
+	auto &h = p.hdr;
+	h.command = RET_SUBMIT;
+	h.seqnum = num << 1 | dir;
+	h.ret_submit.actual_length = actual_length;
+	h.ret_submit.number_of_packets = packets;
+
+	if (dir == direction::in) {
+		for (INT32 i = 0; i < actual_length; ++i) {
+			p.payload.push_back(char(num + i));
+		}
+	}
+
+	std::vector<iso_packet_descriptor> isoc(packets > 0 ? packets : 0);
+	for (size_t i = 0; i < isoc.size(); ++i) {
+		auto len = UINT32(actual_length/isoc.size());
+		isoc[i] = { .offset = UINT32(i*len), .length = len, .actual_length = len, .status = 0 };
+	}
+
+	auto wire = h;
+	byteswap_header(wire, swap_dir::host2net);
+
+	auto ptr = reinterpret_cast<char*>(&wire);
+	stream.insert(stream.end(), ptr, ptr + sizeof(wire));
+	stream.insert(stream.end(), p.payload.begin(), p.payload.end());
+
+	if (!isoc.empty()) {
+		auto d = reinterpret_cast<char*>(isoc.data());
+		auto bytes = isoc.size()*sizeof(isoc[0]);
+
+		byteswap(isoc.data(), isoc.size()); // as received, descriptors are swapped by ret_submit
+		stream.insert(stream.end(), d, d + bytes);
+		p.payload.insert(p.payload.end(), d, d + bytes);
+	}
+
+	h.direction = dir; // restored by decode_response
+	if (packets == number_of_packets_non_isoch) {
+		h.ret_submit.number_of_packets = 0;
+	}
+
+	expected.push_back(std::move(p));
+}
+
+void check_recorded()
+{
+	std::vector<char> stream(recorded, recorded + sizeof(recorded));
+	std::mt19937 rnd(1);
+
+	for (size_t chunk: {1, 2, 3, 47, 48, 49, 66, 4096}) {
+		auto r = parse(stream, chunk, rnd);
+		CHECK(r.size() == 3);
+		if (r.size() != 3) {
+			continue;
+		}
+
+		CHECK(r[0].hdr.command == RET_SUBMIT);
+		CHECK(r[0].hdr.direction == direction::in);
+		CHECK(r[0].payload.size() == 18);
+		CHECK(r[0].payload[0] == 0x12 && r[0].payload[1] == 0x01); // bLength, bDescriptorType
+
+		CHECK(r[1].hdr.command == RET_UNLINK);
+		CHECK(r[1].hdr.ret_unlink.status == -104);
+		CHECK(r[1].payload.empty());
+
+		CHECK(r[2].hdr.command == RET_SUBMIT);
+		CHECK(r[2].hdr.direction == direction::out);
+		CHECK(r[2].hdr.ret_submit.actual_length == 512);
+		CHECK(r[2].payload.empty()); // OUT
+	}
+}
+
+void check_session()
+{
+	std::vector<char> stream;
+	std::vector<pdu> expected;
+
+	std::mt19937 rnd(2);
+	UINT32 num = 0;
+
+	for (int i = 0; i < 500; ++i) {
+		switch (rnd() % 5) {
+		case 0:
+			append_ret_submit(stream, expected, ++num, direction::in, rnd() % 1024, number_of_packets_non_isoch);
+			break;
+		case 1:
+			append_ret_submit(stream, expected, ++num, direction::out, rnd() % 1024, number_of_packets_non_isoch);
+			break;
+		case 2:
+			append_ret_submit(stream, expected, ++num, direction::in, 0, number_of_packets_non_isoch);
+			break;
+		case 3:
+			append_ret_submit(stream, expected, ++num, direction::in, 3*1024, 1 + rnd() % 32);
+			break;
+		case 4:
+			append_ret_submit(stream, expected, ++num, direction::in, 0, 8); // descriptors only
+			break;
+		}
+	}
+
+	for (size_t chunk: {0, 1, 7, 48, 1460, 64*1024}) {
+		CHECK(parse(stream, chunk, rnd) == expected);
+	}
+}
+
+void check_invalid()
+{
+	header h{};
+	h.command = CMD_SUBMIT; // a client's command
+	h.seqnum = 2;
+	byteswap_header(h, swap_dir::host2net);
+
+	parser p;
+	CHECK(p.feed(&h, sizeof(h) - 1) == 0);
+	CHECK(!header_received(p.s));
+	CHECK(p.feed(reinterpret_cast<char*>(&h) + sizeof(h) - 1, 1) == -1);
+	CHECK(p.result.empty());
+}
+
+} // namespace
+
+
+int main()
+{
+	check_recorded();
+	check_session();
+	check_invalid();
+
+	return test::result("pdu_stream_test");
+}
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * usbip::run of usbip::reconnector against a stand-in server on a simulated clock.
+ * The server can refuse connections, black-hole them (an attempt lasts till its timeout),
+ * accept them before the busid is exported again, or be back at a given time.
+ * Attempts are timed as in drivers/ude/reconnect.cpp, attempt.
+ */
+
+#include "check.h"
+
+#include <usbip/reconnect.h>
+
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+constexpr INT64 MSEC = 10'000; // 100 ns units as KeQueryInterruptTime
+constexpr INT64 SECOND = 1000*MSEC;
+
+constexpr INT64 MIN_DELAY = 250*MSEC;
+constexpr INT64 MAX_DELAY = 8*SECOND;
+constexpr INT64 CONNECT_TIMEOUT = 5*SECOND;
+constexpr INT64 LAST_CONNECT_TIMEOUT = SECOND;
+
+constexpr INT64 RTT = 2*MSEC; // of the local network
+
+enum status : int { SUCCESS, REFUSED, TIMEOUT, NOT_EXPORTED, CANCELLED };
+
+struct server
+{
+	INT64 up_at = INT64(1) << 62; // local time when it listens again, never by default
+	INT64 exported_at = 0; // the busid is exported again
+	bool black_hole = false; // connections are not refused while it is down
+};
+
+struct client
+{
+	const server &srv;
+	reconnector r{};
+	INT64 clock = 0;
+	INT64 abort_at = INT64(1) << 62; // detach
+
+	struct attempt_rec
+	{
+		INT64 start;
+		INT64 timeout;
+		status st;
+	};
+	std::vector<attempt_rec> attempts;
+
+	client(const server &s, INT64 grace) : srv(s) { init(r, grace, MIN_DELAY, MAX_DELAY); }
+
+	bool wait(INT64 ticks)
+	{
+		if (clock + ticks >= abort_at) {
+			clock = abort_at;
+			return false;
+		}
+
+		clock += ticks;
+		return true;
+	}
+
+	status attempt()
+	{
+		auto timeout = get_attempt_timeout(r, clock, CONNECT_TIMEOUT, LAST_CONNECT_TIMEOUT);
+		CHECK(timeout > 0); // zero means no timeout for the race
+
+		auto &a = attempts.emplace_back(attempt_rec{clock, timeout, SUCCESS});
+
+		if (clock + RTT < srv.up_at) {
+			if (srv.black_hole) {
+				clock += timeout;
+				a.st = TIMEOUT;
+			} else {
+				clock += RTT;
+				a.st = REFUSED;
+			}
+		} else {
+			clock += 2*RTT; // connect and OP_REQ_IMPORT
+			a.st = clock < srv.exported_at ? NOT_EXPORTED : SUCCESS;
+		}
+
+		return a.st;
+	}
+
+	status reconnect()
+	{
+		if (!on_lost(r, clock)) {
+			return CANCELLED;
+		}
+
+		attempts.clear();
+
+		return run(r, CANCELLED,
+			[this] { return clock; },
+			[this] (auto ticks) { return wait(ticks); },
+			[this] { return attempt(); });
+	}
+};
+
+/*
+ * The first attempt is immediate, each next delay is doubled up to MAX_DELAY.
+ */
+void check_backoff(const client &c)
+{
+	auto &v = c.attempts;
+	CHECK(!v.empty() && v[0].start == c.r.lost);
+
+	INT64 delay = 0;
+
+	for (size_t i = 1; i < v.size(); ++i) {
+		delay = delay ? 2*delay : MIN_DELAY;
+		if (delay > MAX_DELAY) {
+			delay = MAX_DELAY;
+		}
+
+		auto &prev = v[i - 1];
+		auto end = prev.start + (prev.st == TIMEOUT ? prev.timeout : prev.st == REFUSED ? RTT : 2*RTT);
+		auto deadline = c.r.lost + c.r.grace;
+
+		auto expected = end + delay < deadline ? end + delay : deadline;
+		CHECK(v[i].start == (expected > end ? expected : end));
+	}
+}
+
+void check_restart(INT64 down)
+{
+	server srv{ .up_at = 5*SECOND + down };
+	client c(srv, 30*SECOND);
+
+	c.clock = 5*SECOND;
+	CHECK(c.reconnect() == SUCCESS);
+	check_backoff(c);
+
+	auto &st = c.r.stat;
+	CHECK(st.losses == 1);
+	CHECK(st.reconnects == 1);
+	CHECK(st.attempts == c.attempts.size());
+	CHECK(!st.expirations);
+	CHECK(!is_reconnecting(c.r));
+
+	CHECK(st.last_latency >= down);
+	CHECK(st.last_latency <= down + MAX_DELAY + 3*RTT); // the server is found by the next attempt
+
+	for (size_t i = 0; i + 1 < c.attempts.size(); ++i) {
+		CHECK(c.attempts[i].st == REFUSED);
+	}
+
+	printf("server is down %5lld ms: reconnected in %5lld ms, %2zu attempt(s)\n",
+		(long long)(down/MSEC), (long long)(st.last_latency/MSEC), c.attempts.size());
+}
+
+/*
+ * A black-holed attempt lasts till its timeout, the grace period is exceeded by the last attempt only.
+ */
+void check_black_hole(INT64 grace)
+{
+	server srv{ .black_hole = true };
+	client c(srv, grace);
+
+	CHECK(c.reconnect() == TIMEOUT);
+	check_backoff(c);
+
+	auto &st = c.r.stat;
+	CHECK(st.expirations == 1);
+	CHECK(!st.reconnects);
+	CHECK(c.r.state == reconnect_state::expired);
+
+	auto deadline = c.r.lost + grace;
+	CHECK(c.clock >= deadline);
+	CHECK(c.clock <= deadline + LAST_CONNECT_TIMEOUT);
+
+	for (auto &a: c.attempts) {
+		CHECK(a.start <= deadline);
+		CHECK(a.timeout <= CONNECT_TIMEOUT);
+		CHECK(a.start + a.timeout <= deadline || &a == &c.attempts.back());
+	}
+
+	printf("black hole, grace %2lld s: %2zu attempt(s)\n", (long long)(grace/SECOND), c.attempts.size());
+}
+
+/*
+ * The last attempt is made at the end of the grace period and can succeed.
+ */
+void check_last_attempt(bool up)
+{
+	constexpr auto grace = 30*SECOND;
+
+	server srv{ .up_at = up ? grace : grace + LAST_CONNECT_TIMEOUT };
+	client c(srv, grace);
+
+	CHECK(c.reconnect() == (up ? SUCCESS : REFUSED));
+	check_backoff(c);
+
+	auto &last = c.attempts.back();
+	CHECK(last.start == c.r.lost + grace);
+	CHECK(last.timeout == LAST_CONNECT_TIMEOUT);
+
+	if (up) {
+		CHECK(c.r.stat.reconnects == 1);
+	} else {
+		CHECK(c.r.state == reconnect_state::expired);
+	}
+}
+
+void check_black_hole_then_up()
+{
+	server srv{ .up_at = 12*SECOND, .black_hole = true };
+	client c(srv, 30*SECOND);
+
+	CHECK(c.reconnect() == SUCCESS);
+	check_backoff(c);
+
+	CHECK(c.attempts.front().st == TIMEOUT);
+	CHECK(c.r.stat.last_latency >= 12*SECOND);
+	CHECK(c.r.stat.last_latency <= 12*SECOND + CONNECT_TIMEOUT + MAX_DELAY);
+}
+
+/*
+ * usbipd is up, but the device is not bound yet, OP_REP_IMPORT fails.
+ */
+void check_not_exported()
+{
+	server srv{ .up_at = SECOND, .exported_at = 4*SECOND };
+	client c(srv, 30*SECOND);
+
+	CHECK(c.reconnect() == SUCCESS);
+	check_backoff(c);
+
+	size_t not_exported = 0;
+	for (auto &a: c.attempts) {
+		not_exported += a.st == NOT_EXPORTED;
+	}
+
+	CHECK(not_exported);
+	CHECK(c.r.stat.last_latency >= 4*SECOND);
+}
+
+/*
+ * Detach interrupts the wait, no attempts are made after that.
+ */
+void check_abort()
+{
+	server srv{};
+	client c(srv, 30*SECOND);
+	c.abort_at = 3*SECOND;
+
+	CHECK(c.reconnect() == CANCELLED);
+	CHECK(c.clock == c.abort_at);
+
+	for (auto &a: c.attempts) {
+		CHECK(a.start < c.abort_at);
+	}
+}
+
+void check_disabled()
+{
+	server srv{ .up_at = 0 };
+	client c(srv, 0);
+
+	CHECK(c.reconnect() == CANCELLED);
+	CHECK(c.attempts.empty());
+	CHECK(!c.r.stat.losses);
+}
+
+/*
+ * The connection is lost again after the device was reconnected, the backoff starts over.
+ */
+void check_repeated_losses()
+{
+	server srv{ .up_at = 2*SECOND };
+	client c(srv, 30*SECOND);
+
+	CHECK(c.reconnect() == SUCCESS);
+	auto first = c.r.stat.last_latency;
+
+	c.clock = 100*SECOND;
+	srv.up_at = 101*SECOND;
+
+	CHECK(c.reconnect() == SUCCESS);
+	check_backoff(c);
+
+	auto &st = c.r.stat;
+	CHECK(st.losses == 2);
+	CHECK(st.reconnects == 2);
+	CHECK(st.sum_latency == first + st.last_latency);
+	CHECK(st.max_latency == (first > st.last_latency ? first : st.last_latency));
+}
+
+/*
+ * on_lost is ignored while reconnecting, a concurrent loss must not restart the grace period.
+ */
+void check_lost_while_reconnecting()
+{
+	reconnector r;
+	init(r, 30*SECOND, MIN_DELAY, MAX_DELAY);
+
+	CHECK(on_lost(r, 0));
+	CHECK(!on_lost(r, 10*SECOND));
+	CHECK(r.lost == 0);
+	CHECK(get_remaining(r, 10*SECOND) == 20*SECOND);
+}
+
+} // namespace
+
+
+int main()
+{
+	for (auto down: {0*MSEC, 100*MSEC, 3*SECOND, 20*SECOND}) {
+		check_restart(down);
+	}
+
+	for (auto grace: {SECOND, 7*SECOND, 30*SECOND}) {
+		check_black_hole(grace);
+	}
+
+	check_last_attempt(true);
+	check_last_attempt(false);
+	check_black_hole_then_up();
+	check_not_exported();
+	check_abort();
+	check_disabled();
+	check_repeated_losses();
+	check_lost_while_reconnecting();
+
+	return test::result("reconnect_test");
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * In-flight requests: the single list that was walked by every lookup versus the hash table
+ * by seqnum of drivers/ude/request_list.cpp. Each operation is what a request costs:
+ * append, lookup of the newest one (mark_request_cancelable) and lookup with removal
+ * of a random one (RET_SUBMIT of another endpoint).
+ */
+
+#include "check.h"
+
+#include <wdm.h>
+#include <usbip/proto.h>
+
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace
+{
+
+using namespace usbip;
+
+enum { REQUESTS_BUCKETS = 512 }; // device_ctx::REQUESTS_BUCKETS
+
+struct request
+{
+	LIST_ENTRY entry;
+	seqnum_t seqnum;
+};
+
+auto find(LIST_ENTRY *head, seqnum_t seqnum) -> request*
+{
+	for (auto entry = head->Flink; entry != head; entry = entry->Flink) {
+		if (auto req = CONTAINING_RECORD(entry, request, entry); req->seqnum == seqnum) {
+			return req;
+		}
+	}
+
+	return nullptr;
+}
+
+struct list_table
+{
+	LIST_ENTRY head;
+
+	list_table() { InitializeListHead(&head); }
+
+	auto& bucket(seqnum_t) { return head; }
+};
+
+struct hash_table
+{
+	LIST_ENTRY buckets[REQUESTS_BUCKETS];
+
+	hash_table()
+	{
+		for (auto &b: buckets) {
+			InitializeListHead(&b);
+		}
+	}
+
+	auto& bucket(seqnum_t seqnum) { return buckets[get_seqnum_bucket(seqnum, REQUESTS_BUCKETS)]; }
+};
+
+constexpr auto make_seqnum(UINT32 num) { return seqnum_t(num << 1 | (num & 1)); } // @see next_seqnum
+
+template<typename Table>
+double run(size_t depth, size_t ops)
+{
+	Table t;
+	std::vector<request> reqs(depth);
+	UINT32 num = 0;
+
+	for (auto &r: reqs) {
+		r.seqnum = make_seqnum(++num);
+		InsertTailList(&t.bucket(r.seqnum), &r.entry);
+	}
+
+	std::mt19937 rnd(depth);
+
+	auto ns = test::measure(ops, [&] {
+		auto &r = reqs[rnd() % depth];
+
+		auto found = find(&t.bucket(r.seqnum), r.seqnum); // RET_SUBMIT
+		CHECK(found == &r);
+		RemoveEntryList(&r.entry);
+
+		r.seqnum = make_seqnum(++num);
+		InsertTailList(&t.bucket(r.seqnum), &r.entry);
+
+		found = find(&t.bucket(r.seqnum), r.seqnum); // mark_request_cancelable
+		CHECK(found == &r);
+	});
+
+	for (auto &r: reqs) { // everything is still in place
+		CHECK(find(&t.bucket(r.seqnum), r.seqnum) == &r);
+	}
+
+	return ns;
+}
+
+void check_buckets()
+{
+	for (UINT32 num = 1; num < 4*REQUESTS_BUCKETS; ++num) {
+		auto idx = get_seqnum_bucket(make_seqnum(num), REQUESTS_BUCKETS);
+		CHECK(idx < REQUESTS_BUCKETS);
+		CHECK(idx != get_seqnum_bucket(make_seqnum(num + 1), REQUESTS_BUCKETS)); // sequential are spread
+		CHECK(idx == get_seqnum_bucket(make_seqnum(num + REQUESTS_BUCKETS), REQUESTS_BUCKETS));
+	}
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+	check_buckets();
+
+	auto quick = test::quick(argc, argv);
+	printf("%8s %14s %14s\n", "depth", "list, ns/op", "hash, ns/op");
+
+	for (size_t depth: {1, 64, 512, 4096}) {
+		size_t ops = quick ? 1000 : 200'000'000/(depth + 100);
+
+		auto list = run<list_table>(depth, ops);
+		auto hash = run<hash_table>(depth, ops);
+
+		printf("%8zu %14.1f %14.1f\n", depth, list, hash);
+	}
+
+	return test::result("request_list_bench");
+}
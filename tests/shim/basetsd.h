@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * Stand-in for <basetsd.h> of Windows SDK, only the types that WDK-free headers use.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+using INT8 = int8_t;
+using UINT8 = uint8_t;
+using INT16 = int16_t;
+using UINT16 = uint16_t;
+using INT32 = int32_t;
+using UINT32 = uint32_t;
+using INT64 = int64_t;
+using UINT64 = uint64_t;
+
+using LONG32 = int32_t;
+using ULONG32 = uint32_t;
+using LONG64 = int64_t;
+using ULONG64 = uint64_t;
+
+using INT_PTR = intptr_t;
+using UINT_PTR = uintptr_t;
+using LONG_PTR = intptr_t;
+using ULONG_PTR = uintptr_t;
+
+using SIZE_T = size_t;
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * Stand-in for <sal.h>, annotations are not checked off Windows.
+ */
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+
+#define _In_reads_(n)
+#define _In_reads_bytes_(n)
+#define _In_reads_opt_(n)
+#define _Out_writes_(n)
+#define _Out_writes_bytes_(n)
+#define _Out_writes_to_(n, cnt)
+#define _Inout_updates_(n)
+#define _Inout_updates_bytes_(n)
+
+#define _Ret_maybenull_
+#define _Check_return_
+#define _When_(cond, annotes)
+
+#define _IRQL_requires_(irql)
+#define _IRQL_requires_max_(irql)
+#define _IRQL_requires_min_(irql)
+#define _IRQL_requires_same_
+#define _IRQL_raises_(irql)
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * Stand-in for the part of <wdm.h> that portable driver code uses: doubly linked lists,
+ * interlocked singly linked lists and interlocked operations. IRQL is meaningless here.
+ */
+
+#include "basetsd.h"
+#include "sal.h"
+
+#include <atomic>
+#include <thread>
+
+using LONG = int32_t;
+using ULONG = uint32_t;
+using UCHAR = uint8_t;
+
+#define CONTAINING_RECORD(address, type, field) \
+	reinterpret_cast<type*>(reinterpret_cast<char*>(address) - offsetof(type, field))
+
+struct LIST_ENTRY
+{
+	LIST_ENTRY *Flink;
+	LIST_ENTRY *Blink;
+};
+
+inline void InitializeListHead(_Out_ LIST_ENTRY *head) { head->Flink = head->Blink = head; }
+inline bool IsListEmpty(_In_ const LIST_ENTRY *head) { return head->Flink == head; }
+
+inline void InsertTailList(_Inout_ LIST_ENTRY *head, _Inout_ LIST_ENTRY *entry)
+{
+	auto blink = head->Blink;
+	entry->Flink = head;
+	entry->Blink = blink;
+	blink->Flink = entry;
+	head->Blink = entry;
+}
+
+inline bool RemoveEntryList(_In_ LIST_ENTRY *entry)
+{
+	auto flink = entry->Flink;
+	auto blink = entry->Blink;
+	blink->Flink = flink;
+	flink->Blink = blink;
+	return flink == blink;
+}
+
+struct alignas(16) SLIST_ENTRY
+{
+	SLIST_ENTRY *Next;
+};
+
+struct SLIST_HEADER
+{
+	std::atomic<SLIST_ENTRY*> head;
+};
+
+inline void InitializeSListHead(_Out_ SLIST_HEADER *h) { h->head.store(nullptr); }
+
+/*
+ * Push and flush are ABA-safe without a sequence number, pop is not provided.
+ */
+inline auto InterlockedPushEntrySList(_Inout_ SLIST_HEADER *h, _Inout_ SLIST_ENTRY *e)
+{
+	auto prev = h->head.load(std::memory_order_relaxed);
+	do {
+		e->Next = prev;
+	} while (!h->head.compare_exchange_weak(prev, e, std::memory_order_release, std::memory_order_relaxed));
+
+	return prev;
+}
+
+inline auto InterlockedFlushSList(_Inout_ SLIST_HEADER *h)
+{
+	return h->head.exchange(nullptr, std::memory_order_acquire);
+}
+
+inline LONG InterlockedIncrement(_Inout_ volatile LONG *v) { return __atomic_add_fetch(v, 1, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedDecrement(_Inout_ volatile LONG *v) { return __atomic_sub_fetch(v, 1, __ATOMIC_SEQ_CST); }
+inline LONG InterlockedAdd(_Inout_ volatile LONG *v, _In_ LONG val) { return __atomic_add_fetch(v, val, __ATOMIC_SEQ_CST); }
+inline LONG ReadNoFence(_In_ const volatile LONG *v) { return __atomic_load_n(v, __ATOMIC_RELAXED); }
+
+inline void YieldProcessor() { std::this_thread::yield(); }
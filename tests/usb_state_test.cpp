@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2025 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+/*
+ * usbip::usb_state driven as the driver does: on_request when a control transfer is sent,
+ * on_success or on_error when the server has completed it, nothing if it was cancelled or unlinked.
+ */
+
+#include "check.h"
+
+#include <usbip/usb_state.h>
+
+namespace
+{
+
+using namespace usbip;
+using namespace usbip::usb_state_impl;
+
+enum : UINT8 {
+	OUT_DEVICE = 0x00, IN_DEVICE = 0x80,
+	OUT_INTERFACE = 0x01, IN_INTERFACE = 0x81,
+	OUT_VENDOR = 0x40,
+};
+
+enum : UINT8 { BUS_POWERED = 0x80, BOTH_POWERED = BUS_POWERED | SELF_POWERED }; // bmAttributes
+
+constexpr usb_setup set_configuration(UINT8 cfg) { return {OUT_DEVICE, SET_CONFIGURATION, cfg, 0, 0}; }
+constexpr usb_setup set_interface(UINT8 intf, UINT8 alt) { return {OUT_INTERFACE, SET_INTERFACE, alt, intf, 0}; }
+constexpr usb_setup set_remote_wakeup(bool on) { return {OUT_DEVICE, on ? SET_FEATURE : CLEAR_FEATURE, DEVICE_REMOTE_WAKEUP, 0, 0}; }
+
+constexpr usb_setup get_configuration() { return {IN_DEVICE, GET_CONFIGURATION, 0, 0, 1}; }
+constexpr usb_setup get_interface(UINT8 intf) { return {IN_INTERFACE, GET_INTERFACE, 0, intf, 1}; }
+constexpr usb_setup get_device_status() { return {IN_DEVICE, GET_STATUS, 0, 0, 2}; }
+constexpr usb_setup get_interface_status(UINT8 intf) { return {IN_INTERFACE, GET_STATUS, 0, intf, 2}; }
+
+/*
+ * @return the answer, -1 if the request must be sent to the device
+ */
+int ask(usb_state &st, const usb_setup &s, bool super_speed = false)
+{
+	UINT8 buf[2]{};
+	switch (answer(st, s, super_speed, buf)) {
+	case 1:
+		return buf[0];
+	case 2:
+		return buf[0] | buf[1] << 8;
+	default:
+		return -1;
+	}
+}
+
+void complete(usb_state &st, const usb_setup &s, bool ok = true)
+{
+	on_request(st, s);
+	ok ? on_success(st, s) : on_error(st, s);
+}
+
+/*
+ * SELECT_CONFIGURATION is unpacked to SET_CONFIGURATION, the interfaces are known only after it succeeds.
+ */
+void select_configuration(usb_state &st, UINT8 cfg, UINT8 attributes, UINT32 interfaces)
+{
+	on_select_configuration(st, cfg, attributes, interfaces);
+	CHECK(ask(st, get_configuration()) < 0); // in flight
+	on_success(st, set_configuration(cfg));
+}
+
+void check_initial()
+{
+	usb_state st{};
+
+	CHECK(ask(st, get_configuration()) < 0);
+	CHECK(ask(st, get_device_status()) < 0);
+	CHECK(ask(st, get_interface(0)) < 0);
+	CHECK(!st.avoided);
+}
+
+void check_select()
+{
+	usb_state st{};
+	select_configuration(st, 1, BUS_POWERED, 0b101);
+
+	CHECK(ask(st, get_configuration()) == 1);
+	CHECK(ask(st, get_interface(0)) == 0);
+	CHECK(ask(st, get_interface(1)) < 0); // not in the configuration
+	CHECK(ask(st, get_interface(2)) == 0);
+	CHECK(ask(st, get_interface_status(2)) == 0);
+	CHECK(ask(st, get_interface_status(2), true) < 0); // function remote wake is not tracked
+
+	CHECK(ask(st, get_device_status()) < 0); // remote wakeup is unknown
+	complete(st, set_remote_wakeup(true));
+	CHECK(ask(st, get_device_status()) == 2);
+	CHECK(ask(st, get_device_status(), true) < 0);
+
+	complete(st, set_interface(2, 3));
+	CHECK(ask(st, get_interface(2)) == 3);
+
+	complete(st, set_interface(1, 1)); // not in the configuration
+	CHECK(ask(st, get_interface(1)) < 0);
+
+	CHECK(st.avoided == 6);
+
+	select_configuration(st, 0, 0, 0b101); // unconfigured
+	CHECK(ask(st, get_configuration()) == 0);
+	CHECK(ask(st, get_interface(0)) < 0);
+}
+
+void check_self_powered()
+{
+	usb_state st{};
+	select_configuration(st, 1, BOTH_POWERED, 1);
+	complete(st, set_remote_wakeup(false));
+
+	CHECK(ask(st, get_configuration()) == 1);
+	CHECK(ask(st, get_device_status()) < 0); // the power source is known to the device only
+}
+
+/*
+ * The state is not changed until the device has completed the request.
+ */
+void check_in_flight()
+{
+	usb_state st{};
+	select_configuration(st, 1, BUS_POWERED, 0b11);
+	complete(st, set_remote_wakeup(true));
+
+	auto si = set_interface(1, 2);
+	on_request(st, si);
+	CHECK(ask(st, get_interface(1)) < 0);
+	CHECK(ask(st, get_interface(0)) == 0); // other interfaces are not affected
+	on_success(st, si);
+	CHECK(ask(st, get_interface(1)) == 2);
+
+	auto rw = set_remote_wakeup(false);
+	on_request(st, rw);
+	CHECK(ask(st, get_device_status()) < 0);
+	on_success(st, rw);
+	CHECK(ask(st, get_device_status()) == 0);
+
+	auto sc = set_configuration(2);
+	on_request(st, sc);
+	CHECK(ask(st, get_configuration()) < 0);
+	CHECK(ask(st, get_interface(0)) < 0);
+	on_success(st, sc);
+	CHECK(ask(st, get_configuration()) == 2);
+	CHECK(ask(st, get_interface(0)) < 0); // interfaces of the configuration are unknown
+
+	on_request(st, {OUT_VENDOR, SET_CONFIGURATION, 3, 0, 0}); // not a standard request
+	CHECK(ask(st, get_configuration()) == 2);
+}
+
+/*
+ * A cancelled or unlinked request is never completed by the server, the state it changes stays unknown.
+ */
+void check_cancel()
+{
+	usb_state st{};
+	select_configuration(st, 1, BUS_POWERED, 0b11);
+	complete(st, set_remote_wakeup(true));
+
+	on_request(st, set_interface(0, 1)); // cancelled
+	CHECK(ask(st, get_interface(0)) < 0);
+	CHECK(ask(st, get_interface(1)) == 0);
+
+	on_request(st, set_remote_wakeup(false)); // unlinked
+	CHECK(ask(st, get_device_status()) < 0);
+
+	on_select_configuration(st, 2, BUS_POWERED, 0b1); // cancelled
+	CHECK(ask(st, get_configuration()) < 0);
+	CHECK(ask(st, get_interface(1)) < 0);
+
+	complete(st, set_configuration(2)); // by an upper driver, not by SELECT_CONFIGURATION
+	CHECK(ask(st, get_configuration()) == 2);
+	CHECK(ask(st, get_interface(0)) < 0); // the cancelled SELECT_CONFIGURATION is not applied
+}
+
+/*
+ * SET_CONFIGURATION of SELECT_CONFIGURATION is not mixed up with another one.
+ */
+void check_pending_mismatch()
+{
+	usb_state st{};
+
+	on_select_configuration(st, 1, BUS_POWERED, 0b1);
+	on_success(st, set_configuration(2));
+
+	CHECK(ask(st, get_configuration()) == 2);
+	CHECK(ask(st, get_interface(0)) < 0);
+	CHECK(!st.pending.valid);
+}
+
+void check_error()
+{
+	usb_state st{};
+	select_configuration(st, 1, BUS_POWERED, 0b11);
+	complete(st, set_remote_wakeup(true));
+
+	complete(st, set_interface(1, 1), false);
+	CHECK(ask(st, get_interface(1)) < 0);
+	CHECK(ask(st, get_interface(0)) == 0);
+
+	complete(st, set_remote_wakeup(false), false);
+	CHECK(ask(st, get_device_status()) < 0);
+
+	complete(st, set_configuration(1), false);
+	CHECK(ask(st, get_configuration()) < 0);
+	CHECK(ask(st, get_interface(0)) < 0);
+}
+
+void check_forget()
+{
+	usb_state st{};
+	select_configuration(st, 1, BUS_POWERED, 1);
+	CHECK(ask(st, get_configuration()) == 1);
+
+	auto avoided = st.avoided;
+	forget(st);
+
+	CHECK(ask(st, get_configuration()) < 0);
+	CHECK(st.avoided == avoided);
+}
+
+void check_malformed()
+{
+	usb_state st{};
+	select_configuration(st, 1, BUS_POWERED, 1);
+
+	CHECK(ask(st, {IN_DEVICE, GET_CONFIGURATION, 0, 0, 2}) < 0); // wLength
+	CHECK(ask(st, {IN_DEVICE, GET_CONFIGURATION, 1, 0, 1}) < 0); // wValue
+	CHECK(ask(st, {IN_INTERFACE, GET_INTERFACE, 0, 40, 1}) < 0); // wIndex is out of range
+	CHECK(ask(st, {IN_DEVICE, GET_CONFIGURATION, 0, 0, 0}) < 0); // no data stage
+
+	complete(st, set_interface(40, 1)); // must not write out of bounds
+	CHECK(ask(st, get_interface(0)) == 0);
+}
+
+} // namespace
+
+
+int main()
+{
+	check_initial();
+	check_select();
+	check_self_powered();
+	check_in_flight();
+	check_cancel();
+	check_pending_mismatch();
+	check_error();
+	check_forget();
+	check_malformed();
+
+	return test::result("usb_state_test");
+}
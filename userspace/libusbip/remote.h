@@ -51,6 +51,7 @@ USBIP_API const char *get_tcp_port() noexcept;
 
 /**
  * This call is blocking and cannot be cancelled.
+ * Connection attempts to all resolved addresses are staggered, the first established connection wins (Happy Eyeballs).
  * @param hostname name or IP address of a host to connect to
  * @param service TCP/IP port number of symbolic name
  * @return call GetLastError() if returned handle is invalid
@@ -63,6 +64,7 @@ enum connect_flags_t : unsigned long {
 
 /**
  * The call is blocking.
+ * Connection attempts to all resolved addresses are staggered, the first established connection wins (Happy Eyeballs).
  * @param hostname name or IP address of a host to connect to
  * @param service TCP/IP port number of symbolic name
  * @param options
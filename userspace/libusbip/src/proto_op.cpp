@@ -3,21 +3,15 @@
  */
 
 #include <usbip\proto_op.h>
-#include <intrin.h>
+#include <usbip\pdu.h>
 
 namespace
 {
 
-inline void bswap(UINT16 &val)
+template<typename T>
+inline void bswap(T &val)
 {
-        static_assert(sizeof(val) == sizeof(unsigned short));
-        val = _byteswap_ushort(val);
-}
-
-inline void bswap(UINT32 &val)
-{
-        static_assert(sizeof(val) == sizeof(unsigned long));
-        val = _byteswap_ulong(val);
+        val = usbip::pdu::bswap(val);
 }
 
 } // namespace
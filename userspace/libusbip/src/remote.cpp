@@ -12,8 +12,11 @@
 #include "output.h"
 
 #include <usbip\proto_op.h>
+#include <usbip\connect_race.h>
 
 #include <chrono>
+#include <array>
+#include <vector>
 
 #include <ws2tcpip.h>
 #include <mstcpip.h>
@@ -65,11 +68,6 @@ inline auto set_keepalive(_Inout_ set_last_error &last, _In_ SOCKET s)
 	return do_setsockopt(last, s, SOL_SOCKET, SO_KEEPALIVE, true);
 }
 
-inline auto set_ipv6only(_Inout_ set_last_error &last, _In_ SOCKET s, _In_ bool ipv6only)
-{
-	return do_setsockopt(last, s, IPPROTO_IPV6, IPV6_V6ONLY, ipv6only);
-}
-
 auto set_nonblock(_Inout_ set_last_error &last, _In_ SOCKET s, _In_ bool nonblock)
 {
 	u_long mode = nonblock;
@@ -254,45 +252,6 @@ auto prepare_event(_Inout_ set_last_error &last, _In_ SOCKET s, _In_ WSAEVENT ev
 	return true;
 }
 
-auto try_connect(_In_ SOCKET s, _In_ WSAEVENT evt, _In_ const sockaddr &addr, _In_ DWORD len)
-{
-	libusbip::output(L"connecting to {}", address_to_string(addr, len));
-
-	if (auto err = connect(s, &addr, len) ? WSAGetLastError() : 0; !err) {
-		return 0;
-	} else if (err != WSAEWOULDBLOCK) {
-		libusbip::output("connect error {}", err);
-		return err;
-	}
-
-	int err;
-
-	switch (auto ret = WSAWaitForMultipleEvents(1, &evt, false, WSA_INFINITE, true)) {
-	case WSA_WAIT_EVENT_0:
-		if (WSANETWORKEVENTS events; WSAEnumNetworkEvents(s, evt, &events)) { // resets event if success
-			err = WSAGetLastError();
-			libusbip::output("WSAEnumNetworkEvents error {}", err);
-		} else {
-			assert(events.lNetworkEvents & FD_CONNECT);
-			err = events.iErrorCode[FD_CONNECT_BIT];
-		}
-		break;
-	case WSA_WAIT_IO_COMPLETION: // see QueueUserAPC
-		libusbip::output("connect cancelled");
-		err = ERROR_CANCELLED;
-		break;
-	default:
-		assert(ret == WSA_WAIT_FAILED);
-
-		err = WSAGetLastError();
-		assert(err != ERROR_CANCELLED);
-
-		libusbip::output("WSAWaitForMultipleEvents -> {}, error {}", ret, err);
-	}
-
-	return err;
-}
-
 INT wait_for_resolve(_Inout_ OVERLAPPED &ovlp, _In_opt_ HANDLE cancel, _In_ bool alertable)
 {
 	INT err;
@@ -323,7 +282,7 @@ INT wait_for_resolve(_Inout_ OVERLAPPED &ovlp, _In_opt_ HANDLE cancel, _In_ bool
 /*
  * Numeric IP addresses like "XXX.XXX.XXX.XXX" are resolved instantly. 
  */
-auto resolve(_Inout_ set_last_error &last, _In_ const char *hostname, _In_ const char *service)
+auto resolve(_Inout_ set_last_error &last, _In_ const char *hostname, _In_ const char *service, _In_ bool alertable)
 {
 	std::unique_ptr<ADDRINFOEX, decltype(FreeAddrInfoEx)&> ptr(nullptr, FreeAddrInfoEx);
 
@@ -350,7 +309,7 @@ auto resolve(_Inout_ set_last_error &last, _In_ const char *hostname, _In_ const
 
 	switch (last.error) {
 	case WSA_IO_PENDING:
-		if (last.error = wait_for_resolve(ovlp, cancel, true); last.error) {
+		if (last.error = wait_for_resolve(ovlp, cancel, alertable); last.error) {
 			break;
 		}
 		[[fallthrough]];
@@ -364,105 +323,210 @@ auto resolve(_Inout_ set_last_error &last, _In_ const char *hostname, _In_ const
 	return ptr;
 }
 
-inline auto connect_by_name(_In_ SOCKET s, _In_ LPCWSTR hostname, _In_ _In_ LPCWSTR service) noexcept
+struct attempt
 {
-	return WSAConnectByName(s, const_cast<wchar_t*>(hostname), const_cast<wchar_t*>(service), 
-				nullptr, nullptr, // LocalAddress
-				nullptr, nullptr, // RemoteAddress
-				nullptr, nullptr);
-}
+	WSAEvent evt;
+	Socket sock; // is closed before evt, pending connect is cancelled
+	bool pending{};
+};
 
-} // namespace
+/*
+ * @return zero if connect is pending or the connection is established
+ */
+auto start(_Inout_ set_last_error &last, _Inout_ attempt &a, _In_ const ADDRINFOEX &ai)
+{
+	libusbip::output(L"connecting to {}", address_to_string(*ai.ai_addr, static_cast<DWORD>(ai.ai_addrlen)));
 
+	a.sock.reset(socket(ai.ai_family, ai.ai_socktype, ai.ai_protocol));
+	if (!a.sock) {
+		last.error = WSAGetLastError();
+		libusbip::output("socket(family={}) error {}", ai.ai_family, last.error);
+		return last.error;
+	}
 
-const char* usbip::get_tcp_port() noexcept
-{
-	return tcp_port;
+	a.evt.reset(WSACreateEvent());
+	if (!a.evt) {
+		last.error = WSAGetLastError();
+		libusbip::output("WSACreateEvent error {}", last.error);
+		return last.error;
+	}
+
+	if (auto ok = set_options(last, a.sock.get()) && prepare_event(last, a.sock.get(), a.evt.get()); !ok) {
+		return last.error;
+	}
+
+	if (auto err = connect(a.sock.get(), ai.ai_addr, static_cast<int>(ai.ai_addrlen)) ? WSAGetLastError() : 0; !err) {
+		return 0;
+	} else if (err == WSAEWOULDBLOCK) {
+		a.pending = true;
+		return 0;
+	} else {
+		libusbip::output("connect error {}", err);
+		return err;
+	}
 }
 
 /*
- * QueueUserAPC() does not terminate connect/WSAConnectByName.
+ * @return the index of the completed attempt, -1 if WSA_WAIT_TIMEOUT, -2 if cancelled or failed
  */
-auto usbip::connect(_In_ const char *hostname, _In_ const char *service) -> Socket
+auto wait(_Inout_ set_last_error &last, _In_ const std::vector<attempt> &v, _In_ INT64 timeout, _In_ bool alertable)
 {
-	auto host = utf8_to_wchar(hostname);
-	auto svc = utf8_to_wchar(service);
+	std::array<WSAEVENT, WSA_MAXIMUM_WAIT_EVENTS> events;
+	std::array<int, WSA_MAXIMUM_WAIT_EVENTS> index;
 
-	set_last_error last(NO_ERROR); // restore after sock.close()
-	Socket sock;
-
-	for (auto family: {AF_INET, AF_INET6}) {
-
-		sock.reset(socket(family, SOCK_STREAM, 0));
-
-		if (!sock) {
-			last.error = WSAGetLastError();
-			libusbip::output("socket(family={}) error {}", family, last.error);
-		} else if (family == AF_INET6 && !set_ipv6only(last, sock.get(), false)) {
-			//
-		} else if (!set_options(last, sock.get())) {
-			//
-		} else if (!connect_by_name(sock.get(), host.c_str(), svc.c_str())) {
-			last.error = WSAGetLastError();
-			libusbip::output("WSAConnectByName(family={}) error {}", family, last.error);
-			break; // it makes no sense to try next family
-		} else if (setsockopt(sock.get(), SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, nullptr, 0)) {
-			last.error = WSAGetLastError();
-			libusbip::output("setsockopt(SO_UPDATE_CONNECT_CONTEXT) error {}", last.error);
-			break;
-		} else {
-			return sock;
+	DWORD cnt = 0;
+
+	for (int i = 0; i < static_cast<int>(v.size()); ++i) {
+		if (v[i].pending) {
+			events[cnt] = v[i].evt.get();
+			index[cnt++] = i;
 		}
 	}
 
-	sock.close();
-	return sock;
+	assert(cnt);
+	auto ret = WSAWaitForMultipleEvents(cnt, events.data(), false, 
+					    timeout < 0 ? WSA_INFINITE : static_cast<DWORD>(timeout), alertable);
+
+	if (auto i = ret - WSA_WAIT_EVENT_0; i < cnt) {
+		return index[i];
+	}
+
+	switch (ret) {
+	case WSA_WAIT_TIMEOUT:
+		return -1;
+	case WSA_WAIT_IO_COMPLETION: // see QueueUserAPC
+		libusbip::output("connect cancelled");
+		last.error = ERROR_CANCELLED;
+		break;
+	default:
+		assert(ret == WSA_WAIT_FAILED);
+		last.error = WSAGetLastError();
+		libusbip::output("WSAWaitForMultipleEvents -> {}, error {}", ret, last.error);
+	}
+
+	return -2;
 }
 
-auto usbip::connect(_In_ const char *hostname, _In_ const char *service, _In_ unsigned long options) -> Socket
+auto get_connect_error(_In_ const attempt &a)
 {
-	set_last_error last(ERROR_INVALID_PARAMETER); // restore after sock.close()
-	Socket sock;
+	int err;
 
-	if (options != CANCEL_BY_APC) {
-		return sock;
+	if (WSANETWORKEVENTS events; WSAEnumNetworkEvents(a.sock.get(), a.evt.get(), &events)) { // resets event if success
+		err = WSAGetLastError();
+		libusbip::output("WSAEnumNetworkEvents error {}", err);
+	} else {
+		assert(events.lNetworkEvents & FD_CONNECT);
+		if (err = events.iErrorCode[FD_CONNECT_BIT]; err) {
+			libusbip::output("connect error {}", err);
+		}
 	}
 
-	auto ai = resolve(last, hostname, service);
-	if (!ai) {
-		return sock;
-	}
+	return err;
+}
 
-	WSAEvent evt(WSACreateEvent());
-	if (!evt) {
+/*
+ * Restores blocking mode of the socket of the winner.
+ */
+auto finish(_Inout_ set_last_error &last, _In_ SOCKET s)
+{
+	if (WSAEventSelect(s, WSA_INVALID_EVENT, 0)) { // cancel the association and selection of network events
 		last.error = WSAGetLastError();
-		libusbip::output("WSACreateEvent error {}", last.error);
-		return sock;
+		libusbip::output("WSAEventSelect(0) error {}", last.error);
+		return false;
 	}
 
-	for (auto r = ai.get(); r; r = r->ai_next) {
+	return set_nonblock(last, s, false);
+}
+
+/*
+ * Staggered parallel connection attempts across all resolved addresses, @see <usbip\connect_race.h>.
+ * The first established connection wins, pending attempts are cancelled by closing their sockets.
+ * A dead address costs the delay between attempts rather than a full TCP timeout.
+ */
+auto race(_Inout_ set_last_error &last, _In_ ADDRINFOEX *head, _In_ bool alertable) -> Socket
+{
+	using namespace std::chrono_literals;
+	enum { ATTEMPT_DELAY = std::chrono::milliseconds(250ms).count() }; // "Connection Attempt Delay"
+
+	std::array<ADDRINFOEX*, WSA_MAXIMUM_WAIT_EVENTS> addrs; // the rest of the list is ignored
+	auto total = interleave(head, addrs.data(), static_cast<int>(addrs.size()));
+
+	std::vector<attempt> v(total);
+
+	auto now = [] { return static_cast<INT64>(GetTickCount64()); };
+
+	connect_race r;
+	init(r, total, ATTEMPT_DELAY, now());
 
-		sock.reset(socket(r->ai_family, r->ai_socktype, r->ai_protocol));
+	while (!is_lost(r)) {
+		auto t = now();
 
-		if (!sock) {
-			last.error = WSAGetLastError();
-			libusbip::output("socket(family={}) error {}", r->ai_family, last.error);
-		} else if (auto ok = set_options(last, sock.get()) && prepare_event(last, sock.get(), evt.get()); !ok) {
-			//
-		} else if (auto err = try_connect(sock.get(), evt.get(), *r->ai_addr, static_cast<DWORD>(r->ai_addrlen))) {
-			if (last.error = err; err == ERROR_CANCELLED) {
-				break;
+		int idx;
+		int err{};
+
+		if (auto wait_ms = get_wait(r, t); !wait_ms) {
+			idx = r.started;
+			on_started(r, t);
+
+			if (err = start(last, v[idx], *addrs[idx]); !err && v[idx].pending) {
+				continue;
+			}
+		} else if (idx = wait(last, v, wait_ms, alertable); idx == -1) {
+			continue;
+		} else if (idx < 0) {
+			return Socket();
+		} else {
+			v[idx].pending = false;
+			err = get_connect_error(v[idx]);
+		}
+
+		if (auto &a = v[idx]; err || !finish(last, a.sock.get())) {
+			if (err) {
+				last.error = err;
 			}
-		} else if (WSAEventSelect(sock.get(), WSA_INVALID_EVENT, 0)) { // cancel the association and selection of network events
-			last.error = WSAGetLastError();
-			libusbip::output("WSAEventSelect(0) error {}", last.error);
-		} else if (set_nonblock(last, sock.get(), false)) {
-			return sock;
+			on_failed(r);
+			a.sock.close();
+		} else {
+			libusbip::output("connected in {} ms, address #{} of {}, {} attempt(s) started", 
+					  get_latency(r, now()), idx, total, r.started);
+			last.error = NO_ERROR;
+			return std::move(a.sock);
 		}
 	}
 
-	sock.close();
-	return sock;
+	if (!total) {
+		last.error = WSAHOST_NOT_FOUND;
+	}
+
+	return Socket();
+}
+
+} // namespace
+
+
+const char* usbip::get_tcp_port() noexcept
+{
+	return tcp_port;
+}
+
+auto usbip::connect(_In_ const char *hostname, _In_ const char *service) -> Socket
+{
+	set_last_error last(NO_ERROR); // restore after closesocket of losers
+
+	auto ai = resolve(last, hostname, service, false);
+	return ai ? race(last, ai.get(), false) : Socket();
+}
+
+auto usbip::connect(_In_ const char *hostname, _In_ const char *service, _In_ unsigned long options) -> Socket
+{
+	set_last_error last(ERROR_INVALID_PARAMETER); // restore after closesocket of losers
+
+	if (options != CANCEL_BY_APC) {
+		return Socket();
+	}
+
+	auto ai = resolve(last, hostname, service, true);
+	return ai ? race(last, ai.get(), true) : Socket();
 }
 
 bool usbip::enum_exportable_devices(